@@ -58,7 +58,7 @@ public:
     AABB Pad()
     {
         // Return an AABB that has no side narrower than some delta, padding if necessary
-        double delta = 0.0001;
+        Real delta = 0.0001;
         Interval newX = (x.Size() >= delta) ? x : x.Expand(delta);
         Interval newY = (y.Size() >= delta) ? y : y.Expand(delta);
         Interval newZ = (z.Size() >= delta) ? z : z.Expand(delta);
@@ -66,6 +66,17 @@ public:
         return AABB(newX, newY, newZ);
     }
 
+    AABB Interpolate(const AABB &endBox, Real time) const
+    {
+        // Linearly interpolate from this box (at time=0) to endBox (at time=1). For an object
+        // moving linearly over the shutter interval, this bounds the object at the given time.
+        return AABB(Interval(x.min + time * (endBox.x.min - x.min), x.max + time * (endBox.x.max - x.max)),
+                    Interval(y.min + time * (endBox.y.min - y.min), y.max + time * (endBox.y.max - y.max)),
+                    Interval(z.min + time * (endBox.z.min - z.min), z.max + time * (endBox.z.max - z.max)));
+    }
+
+    bool operator==(const AABB &other) const = default;
+
     double SurfaceArea() const
     {
         double xSize = x.Size();
@@ -0,0 +1,175 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hitable.h"
+
+template <typename T>
+class Track
+{
+    // Values keyed by frame number, interpolated linearly between keys and held past the first
+    // and last ones
+public:
+    void Key(double frame, const T &value)
+    {
+        auto position = std::upper_bound(keys.begin(), keys.end(), frame,
+                                         [](double f, const std::pair<double, T> &key) { return f < key.first; });
+        keys.insert(position, {frame, value});
+    }
+
+    bool Empty() const { return keys.empty(); }
+
+    T At(double frame) const
+    {
+        if ( keys.empty() ) return T();
+        if ( frame <= keys.front().first ) return keys.front().second;
+        if ( frame >= keys.back().first ) return keys.back().second;
+
+        auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                     [](double f, const std::pair<double, T> &key) { return f < key.first; });
+        auto previous = next - 1;
+        auto s = (frame - previous->first) / (next->first - previous->first);
+        return (1 - s) * previous->second + s * next->second;
+    }
+
+private:
+    std::vector<std::pair<double, T>> keys;
+};
+
+class Animated : public Hitable
+{
+    // Places an object by keyframed translation and rotation about Y. The object, e.g. a BVH
+    // over a mesh, is built once and kept; posing it for a frame only replaces the transforms
+    // wrapped around it, and the BVHs above it are refitted rather than rebuilt. Pose it before
+    // building a BVH over it, so the tree is split around a pose it will actually take.
+
+public:
+    Track<Vec3> position;   // Offset of the object
+    Track<double> rotation; // Degrees about Y, applied before the offset
+
+    Animated(shared_ptr<Hitable> _object) : object(_object), posed(_object) {}
+
+    void SetFrame(double frame, double shutter)
+    {
+        // Poses the object for the shutter interval from frame to frame + shutter. The offset is
+        // blurred across the interval; rotation is held at its value when the shutter opens, as
+        // RotateY doesn't move.
+        shared_ptr<Hitable> placed = object;
+        if ( !rotation.Empty() ) placed = make_shared<RotateY>(placed, rotation.At(frame));
+
+        auto start = position.At(frame);
+        auto end = position.At(frame + shutter);
+        if ( (end - start).LengthSquared() > 0 ) {
+            placed = make_shared<Translate>(placed, start, end);
+        } else if ( start.LengthSquared() > 0 ) {
+            placed = make_shared<Translate>(placed, start);
+        }
+        posed = placed;
+    }
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override { return posed->Hit(ray, rayT, record); }
+
+    AABB BoundingBox() const override { return posed->BoundingBox(); }
+
+    AABB StartBoundingBox() const override { return posed->StartBoundingBox(); }
+
+    AABB EndBoundingBox() const override { return posed->EndBoundingBox(); }
+
+    double PDFValue(const Point3 &origin, const Vec3 &direction) const override
+    {
+        return posed->PDFValue(origin, direction);
+    }
+
+    Vec3 Random(const Point3 &origin) const override
+    {
+        return posed->Random(origin);
+    }
+
+    bool Span(const Ray &ray, Interval &span) const override { return posed->Span(ray, span); }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        posed->CollectLights(posed, lights);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { object->CollectMaterials(materials); }
+
+    bool IsAnimated() const override { return true; }
+
+private:
+    shared_ptr<Hitable> object;
+    shared_ptr<Hitable> posed; // The object in its transforms for the current frame
+};
+
+struct CameraPath
+{
+    // Keyframes for the camera; settings without keys are left as the camera has them
+    Track<Point3> lookFrom;
+    Track<Point3> lookAt;
+    Track<double> verticalFOV;
+
+    void Apply(Camera &cam, double frame) const
+    {
+        if ( !lookFrom.Empty() ) cam.lookFrom = lookFrom.At(frame);
+        if ( !lookAt.Empty() ) cam.lookAt = lookAt.At(frame);
+        if ( !verticalFOV.Empty() ) cam.verticalFOV = verticalFOV.At(frame);
+    }
+};
+
+struct Scene
+{
+    // Everything an animation renders. The world is built once, with the Animated objects in
+    // it, and stays resident across frames along with its textures and static BVHs.
+    shared_ptr<Hitable> world;
+    std::vector<shared_ptr<Animated>> animated;
+    CameraPath cameraPath;
+};
+
+class Animation
+{
+    // Renders a range of frames of a scene. Each frame poses the animated objects and camera,
+    // refits the world's bounds and renders. Frames are saved in the background, so one frame is
+    // written while the next is updated and rendered.
+
+public:
+    double shutter = 0.5; // Fraction of a frame the shutter is open, blurring whatever moves
+
+    void Render(Camera &cam, Scene &scene, int firstFrame, int lastFrame) const
+    {
+        bool asyncOutput = cam.asyncOutput;
+        cam.asyncOutput = true;
+
+        for ( int frame = firstFrame; frame <= lastFrame; frame++ ) {
+            auto startTime = std::chrono::high_resolution_clock::now();
+
+            scene.cameraPath.Apply(cam, frame);
+            for ( const auto &object : scene.animated ) {
+                object->SetFrame(frame, shutter);
+            }
+            scene.world->Refit();
+
+            auto updateTime = std::chrono::high_resolution_clock::now();
+            cam.Render(*scene.world);
+            auto endTime = std::chrono::high_resolution_clock::now();
+
+            std::chrono::duration<double> updateElapsed(updateTime - startTime);
+            std::chrono::duration<double> renderElapsed(endTime - updateTime);
+            std::clog << "\nFrame " << frame << ": Update Time: " << updateElapsed
+                      << " Render Time: " << renderElapsed << "\n"
+                      << std::flush;
+        }
+
+        Camera::WaitForOutput();
+        cam.asyncOutput = asyncOutput;
+    }
+};
+
+#endif
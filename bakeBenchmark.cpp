@@ -0,0 +1,93 @@
+#include "rtweekend.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "bakedTexture.h"
+#include "bvh.h"
+#include "hitableList.h"
+#include "material.h"
+#include "sphere.h"
+#include "texture.h"
+
+int main(int argc, char **argv)
+{
+    // Compares shading with a NoiseTexture against the same texture baked over the two Perlin
+    // spheres scene, at a range of error bounds. Shading cost is measured at the surface points
+    // the scene's camera sees inside the baked region, and scaled to a frame of 100 samples per
+    // pixel on those points.
+    // Usage: BakeBenchmark [noise scale]
+    double scale = (argc > 1) ? std::stod(argv[1]) : 4;
+    auto noise = make_shared<NoiseTexture>(scale);
+    auto material = make_shared<Lambertian>(noise);
+
+    HitableList world;
+    world.Add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, material));
+    world.Add(make_shared<Sphere>(Point3(0, 2, 0), 2, material));
+    BVHNode bvh(world);
+
+    // Surface points seen through the scene's camera, as in TwoPerlinSpheres
+    const int width = 400, height = 225, samplesPerPixel = 100;
+    Point3 lookFrom(13, 2, 3), lookAt(0, 0, 0);
+    auto w = UnitVector(lookFrom - lookAt);
+    auto u = UnitVector(Cross(Vec3(0, 1, 0), w));
+    auto v = Cross(w, u);
+    auto viewportHeight = 2 * std::tan(DegreesTooRadians(20) / 2);
+    auto viewportWidth = viewportHeight * width / height;
+
+    // Only points inside the baked region, since lookups outside it evaluate the source anyway
+    AABB region(Point3(-6, -1, -6), Point3(6, 5, 6));
+    std::vector<Point3> points;
+    for ( int j = 0; j < height; j++ ) {
+        for ( int i = 0; i < width; i++ ) {
+            auto direction = ((i + 0.5) / width - 0.5) * viewportWidth * u - ((j + 0.5) / height - 0.5) * viewportHeight * v - w;
+            HitRecord record;
+            if ( !bvh.Hit(Ray(lookFrom, direction, 0.0), Interval(0.001, maxDouble), record) ) continue;
+            if ( region.x.Contains(record.point.X()) && region.y.Contains(record.point.Y()) && region.z.Contains(record.point.Z()) ) {
+                points.push_back(record.point);
+            }
+        }
+    }
+
+    auto Shade = [&points](const Texture &texture) {
+        // Seconds per lookup, repeated to smooth out timer noise
+        const int repeats = 5;
+        auto sum = 0.0;
+        auto startTime = std::chrono::high_resolution_clock::now();
+        for ( int r = 0; r < repeats; r++ ) {
+            for ( const auto &p : points ) sum += texture.Value(0, 0, p).X();
+        }
+        auto endTime = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsedTime(endTime - startTime);
+        if ( sum < 0 ) std::cout << sum; // Keep the loop from being optimised away
+        return elapsedTime.count() / (repeats * double(points.size()));
+    };
+
+    auto lookupsPerFrame = double(points.size()) * samplesPerPixel;
+    auto sourceTime = Shade(*noise);
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "Surface points: " << points.size() << ", source " << sourceTime * 1e9 << " ns / lookup\n"
+              << "Max error  Cell size  Error est  Bricks    MB      Bake (s)  ns / lookup  Saved / frame (s)" << std::endl;
+
+    for ( double maxError : {0.1, 0.05, 0.02} ) {
+        BakedTexture baked(noise, maxError, 4096);
+
+        auto startTime = std::chrono::high_resolution_clock::now();
+        baked.Bake(bvh, region);
+        auto endTime = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> bakeTime(endTime - startTime);
+
+        auto bakedTime = Shade(baked);
+        std::cout << std::setw(9) << maxError << "  "
+                  << std::setw(9) << baked.CellSize() << "  "
+                  << std::setw(9) << baked.ErrorEstimate() << "  "
+                  << std::setw(6) << baked.BrickCount() << "  "
+                  << std::setw(6) << baked.Bytes() / 1048576.0 << "  "
+                  << std::setw(10) << bakeTime.count() << "  "
+                  << std::setw(11) << bakedTime * 1e9 << "  "
+                  << std::setw(17) << (sourceTime - bakedTime) * lookupsPerFrame << std::endl;
+    }
+}
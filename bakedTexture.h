@@ -0,0 +1,274 @@
+#ifndef BAKED_TEXTURE_H
+#define BAKED_TEXTURE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <execution>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "hitable.h"
+#include "texture.h"
+
+class BakedTexture : public Texture
+{
+    // A procedural texture evaluated once over the surfaces of static geometry and stored in a
+    // sparse world-space grid, so shading becomes a trilinear fetch instead of running the
+    // procedure. The grid is split into 8x8x8-cell bricks and only bricks the geometry passes
+    // through are baked. Lookups anywhere else, or before Bake is called, evaluate the source.
+    //
+    // Only the shading point is baked, not (u, v), so the source must depend on the point alone,
+    // as NoiseTexture and CheckerTexture do.
+
+public:
+    static const int brickSize = 8;                  // Cells along each side of a brick
+    static const int brickSide = brickSize + 1;      // Samples along each side; bricks repeat their shared faces
+    static const int brickSamples = brickSide * brickSide * brickSide;
+
+private:
+    shared_ptr<Texture> source;
+    double maxError;
+    int maxResolution;
+
+    AABB bounds;
+    double cellSize = 0;
+    int cellCount[3] = {0, 0, 0};
+    int brickCount[3] = {0, 0, 0};
+    double errorEstimate = 0;
+
+    // Samples are quantised to 16 bits over each brick's range of values, halving the memory a
+    // lookup pulls in compared with floats, with steps far below any useful error bound
+    std::vector<int32_t> brickIndices; // Per brick, the offset into samples / brickSamples, -1 if not baked
+    std::vector<uint16_t> samples;     // Baked bricks, brickSamples RGB triples each
+    std::vector<Colour> brickRanges;   // Per baked brick, the minimum and the step of its samples
+
+    int BrickIndex(int bi, int bj, int bk) const
+    {
+        return (bk * brickCount[1] + bj) * brickCount[0] + bi;
+    }
+
+    static std::vector<Point3> SurfacePoints(const Hitable &geometry, const AABB &region, double spacing)
+    {
+        // Casts a lattice of rays along each axis through the region and returns every surface
+        // point they hit inside it
+        std::vector<Point3> points;
+        const int maxHitsPerRay = 64;
+
+        for ( int axis = 0; axis < 3; axis++ ) {
+            int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+            int n1 = std::max(1, int(std::ceil(region.Axis(a1).Size() / spacing)));
+            int n2 = std::max(1, int(std::ceil(region.Axis(a2).Size() / spacing)));
+            auto extent = region.Axis(axis);
+
+            for ( int i2 = 0; i2 < n2; i2++ ) {
+                for ( int i1 = 0; i1 < n1; i1++ ) {
+                    Point3 origin;
+                    origin[axis] = extent.min;
+                    origin[a1] = region.Axis(a1).min + (i1 + 0.5) * region.Axis(a1).Size() / n1;
+                    origin[a2] = region.Axis(a2).min + (i2 + 0.5) * region.Axis(a2).Size() / n2;
+                    Vec3 direction;
+                    direction[axis] = 1;
+
+                    Ray ray(origin, direction, 0.0);
+                    Interval rayT(0, extent.Size());
+                    HitRecord record;
+                    for ( int hit = 0; hit < maxHitsPerRay && geometry.Hit(ray, rayT, record); hit++ ) {
+                        points.push_back(record.point);
+                        rayT.min = record.t + 1e-6 * (1 + extent.Size());
+                    }
+                }
+            }
+        }
+
+        return points;
+    }
+
+    double TrilinearError(const std::vector<Point3> &points, double size) const
+    {
+        // Estimates the error of baking with the given cell size, as the root mean square over the
+        // points of the largest channel difference between the source and its trilinear
+        // reconstruction from the surrounding lattice samples
+        std::vector<double> errors(points.size());
+        std::transform(std::execution::par, points.begin(), points.end(), errors.begin(), [&](const Point3 &p) {
+            double cell[3], fraction[3];
+            for ( int a = 0; a < 3; a++ ) {
+                auto x = (p[a] - bounds.Axis(a).min) / size;
+                cell[a] = std::floor(x);
+                fraction[a] = x - cell[a];
+            }
+
+            Colour reconstruction;
+            for ( int corner = 0; corner < 8; corner++ ) {
+                int di = corner & 1, dj = (corner >> 1) & 1, dk = corner >> 2;
+                Point3 q(bounds.x.min + (cell[0] + di) * size, bounds.y.min + (cell[1] + dj) * size, bounds.z.min + (cell[2] + dk) * size);
+                auto weight = (di ? fraction[0] : 1 - fraction[0]) * (dj ? fraction[1] : 1 - fraction[1]) * (dk ? fraction[2] : 1 - fraction[2]);
+                reconstruction += weight * source->Value(0, 0, q);
+            }
+
+            auto difference = reconstruction - source->Value(0, 0, p);
+            auto error = std::fmax(std::fabs(difference.X()), std::fmax(std::fabs(difference.Y()), std::fabs(difference.Z())));
+            return error * error;
+        });
+
+        if ( errors.empty() ) return 0.0;
+        return std::sqrt(std::reduce(errors.begin(), errors.end()) / errors.size());
+    }
+
+    void BakeBrick(int bi, int bj, int bk, int32_t index)
+    {
+        Colour values[brickSamples];
+        Colour minimum(maxDouble, maxDouble, maxDouble), maximum(-maxDouble, -maxDouble, -maxDouble);
+        for ( int k = 0; k < brickSide; k++ ) {
+            for ( int j = 0; j < brickSide; j++ ) {
+                for ( int i = 0; i < brickSide; i++ ) {
+                    Point3 p(bounds.x.min + (bi * brickSize + i) * cellSize,
+                             bounds.y.min + (bj * brickSize + j) * cellSize,
+                             bounds.z.min + (bk * brickSize + k) * cellSize);
+                    auto &value = values[(k * brickSide + j) * brickSide + i];
+                    value = source->Value(0, 0, p);
+                    for ( int c = 0; c < 3; c++ ) {
+                        minimum[c] = std::fmin(minimum[c], value[c]);
+                        maximum[c] = std::fmax(maximum[c], value[c]);
+                    }
+                }
+            }
+        }
+
+        Colour step;
+        for ( int c = 0; c < 3; c++ ) step[c] = (maximum[c] - minimum[c]) / 65535;
+        brickRanges[2 * size_t(index)] = minimum;
+        brickRanges[2 * size_t(index) + 1] = step;
+
+        auto brickSamplesStart = &samples[size_t(index) * brickSamples * 3];
+        for ( int s = 0; s < brickSamples; s++ ) {
+            for ( int c = 0; c < 3; c++ ) {
+                auto level = (step[c] > 0) ? (values[s][c] - minimum[c]) / step[c] : 0.0;
+                brickSamplesStart[s * 3 + c] = uint16_t(std::lround(std::clamp(level, 0.0, 65535.0)));
+            }
+        }
+    }
+
+public:
+    // maxError bounds the root mean square difference from the source over sampled surface points,
+    // in the worst colour channel; maxResolution caps the cells along the longest side of the region
+    BakedTexture(shared_ptr<Texture> _source, double _maxError = 0.01, int _maxResolution = 1024)
+        : source(_source), maxError(_maxError), maxResolution(_maxResolution) {}
+
+    void Bake(const Hitable &geometry, const AABB &region)
+    {
+        // Bakes the source over the parts of the geometry's surfaces inside region. The cell
+        // size is the coarsest power-of-two division of the region that meets maxError.
+        auto startTime = std::chrono::high_resolution_clock::now();
+
+        bounds = region;
+        auto longest = std::fmax(region.x.Size(), std::fmax(region.y.Size(), region.z.Size()));
+
+        // Estimate the error at a subset of surface points, refining until it is met
+        auto estimationPoints = SurfacePoints(geometry, region, longest / 64);
+        const size_t maxEstimationPoints = 4096;
+        if ( estimationPoints.size() > maxEstimationPoints ) {
+            auto stride = double(estimationPoints.size()) / maxEstimationPoints;
+            for ( size_t i = 0; i < maxEstimationPoints; i++ ) {
+                estimationPoints[i] = estimationPoints[size_t(i * stride)];
+            }
+            estimationPoints.resize(maxEstimationPoints);
+        }
+
+        int resolution = brickSize;
+        while ( true ) {
+            errorEstimate = TrilinearError(estimationPoints, longest / resolution);
+            if ( errorEstimate <= maxError || resolution * 2 > maxResolution ) break;
+            resolution *= 2;
+        }
+
+        cellSize = longest / resolution;
+        for ( int a = 0; a < 3; a++ ) {
+            cellCount[a] = std::max(1, int(std::ceil(region.Axis(a).Size() / cellSize)));
+            brickCount[a] = (cellCount[a] + brickSize - 1) / brickSize;
+        }
+
+        // Rays at half the brick spacing find the bricks the surfaces pass through
+        brickIndices.assign(size_t(brickCount[0]) * brickCount[1] * brickCount[2], -1);
+        std::vector<int> bakeList;
+        for ( const auto &p : SurfacePoints(geometry, region, 0.5 * brickSize * cellSize) ) {
+            int brick[3];
+            for ( int a = 0; a < 3; a++ ) {
+                brick[a] = std::clamp(int((p[a] - bounds.Axis(a).min) / (brickSize * cellSize)), 0, brickCount[a] - 1);
+            }
+            auto &index = brickIndices[BrickIndex(brick[0], brick[1], brick[2])];
+            if ( index < 0 ) {
+                index = int32_t(bakeList.size());
+                bakeList.push_back(BrickIndex(brick[0], brick[1], brick[2]));
+            }
+        }
+
+        samples.assign(bakeList.size() * brickSamples * 3, 0);
+        brickRanges.assign(2 * bakeList.size(), Colour());
+        std::for_each(std::execution::par, bakeList.begin(), bakeList.end(), [this](int brick) {
+            int bi = brick % brickCount[0];
+            int bj = (brick / brickCount[0]) % brickCount[1];
+            int bk = brick / (brickCount[0] * brickCount[1]);
+            BakeBrick(bi, bj, bk, brickIndices[brick]);
+        });
+
+        auto endTime = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsedTime(endTime - startTime);
+        std::clog << "Baked " << bakeList.size() << " brick(s) of cell size " << cellSize
+                  << ", estimated error " << errorEstimate << ", in " << elapsedTime.count() << "s\n";
+    }
+
+    double CellSize() const { return cellSize; }
+
+    double ErrorEstimate() const { return errorEstimate; }
+
+    size_t BrickCount() const { return samples.size() / (brickSamples * 3); }
+
+    size_t Bytes() const
+    {
+        return samples.size() * sizeof(uint16_t) + brickRanges.size() * sizeof(Colour) + brickIndices.size() * sizeof(int32_t);
+    }
+
+    Colour Value(double u, double v, const Point3 &p) const override
+    {
+        if ( samples.empty() ) return source->Value(u, v, p);
+
+        int brick[3];
+        double local[3];
+        for ( int a = 0; a < 3; a++ ) {
+            auto x = (p[a] - bounds.Axis(a).min) / cellSize;
+            if ( !(x >= 0 && x <= cellCount[a]) ) return source->Value(u, v, p);
+            brick[a] = std::min(int(x) / brickSize, brickCount[a] - 1);
+            local[a] = x - brick[a] * brickSize;
+        }
+
+        auto index = brickIndices[BrickIndex(brick[0], brick[1], brick[2])];
+        if ( index < 0 ) return source->Value(u, v, p);
+
+        int i = std::min(int(local[0]), brickSize - 1);
+        int j = std::min(int(local[1]), brickSize - 1);
+        int k = std::min(int(local[2]), brickSize - 1);
+        auto fx = local[0] - i, fy = local[1] - j, fz = local[2] - k;
+
+        auto base = &samples[size_t(index) * brickSamples * 3];
+        auto Sample = [base](int i, int j, int k) {
+            auto sample = base + ((k * brickSide + j) * brickSide + i) * 3;
+            return Colour(sample[0], sample[1], sample[2]);
+        };
+
+        auto c00 = (1 - fx) * Sample(i, j, k) + fx * Sample(i + 1, j, k);
+        auto c10 = (1 - fx) * Sample(i, j + 1, k) + fx * Sample(i + 1, j + 1, k);
+        auto c01 = (1 - fx) * Sample(i, j, k + 1) + fx * Sample(i + 1, j, k + 1);
+        auto c11 = (1 - fx) * Sample(i, j + 1, k + 1) + fx * Sample(i + 1, j + 1, k + 1);
+        auto levels = (1 - fz) * ((1 - fy) * c00 + fy * c10) + fz * ((1 - fy) * c01 + fy * c11);
+
+        // Dequantising is linear, so it can follow the interpolation
+        return brickRanges[2 * size_t(index)] + brickRanges[2 * size_t(index) + 1] * levels;
+    }
+};
+
+#endif
@@ -2,6 +2,13 @@
 #define BVH_H
 
 #include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <execution>
+#include <future>
+#include <numeric>
+#include <thread>
+#include <vector>
 
 #include "rtweekend.h"
 
@@ -10,69 +17,298 @@
 
 class BVHNode : public Hitable
 {
+public:
+    enum class BuildMethod
+    {
+        SAH,   // Binned surface area heuristic over time-averaged bounds (best traversal speed)
+        Morton // Linear BVH from sorted Morton codes (fastest build)
+    };
+
 private:
     shared_ptr<Hitable> left;
     shared_ptr<Hitable> right;
     AABB boundingBox;
+    AABB startBoundingBox;
+    AABB endBoundingBox;
+    bool isMoving;
+    bool isAnimated; // Some object below can be posed for a new frame, so refits visit this node
 
-    static bool BoxCompare(
-        const shared_ptr<Hitable> a, const shared_ptr<Hitable> b, int axisIndex)
+    class Builder
     {
-        return a->BoundingBox().Axis(axisIndex).min < b->BoundingBox().Axis(axisIndex).min;
-    }
+    private:
+        struct BuildPrimitive
+        {
+            shared_ptr<Hitable> object;
+            AABB startBox;
+            AABB endBox;
+            Point3 centroid; // Time-averaged centre of the bounds
+        };
+
+        static const int binCount = 12;
+        static const size_t parallelThreshold = 4096; // Smallest range split off as its own task
+
+        std::vector<BuildPrimitive> primitives;
+        std::vector<uint32_t> mortonCodes;
+        int parallelDepth; // Recursion depth down to which subtrees are built as parallel tasks
+
+        static double TimeAveragedSurfaceArea(const AABB &startBox, const AABB &endBox)
+        {
+            // Returns the surface area of the box interpolated from startBox to endBox, averaged
+            // over the shutter interval. Each extent is linear in time, so every product of two
+            // extents integrates exactly to a0*b0 + (a0*db + b0*da) / 2 + da*db / 3.
+            double a[3], d[3];
+            for ( int axis = 0; axis < 3; axis++ ) {
+                a[axis] = startBox.Axis(axis).Size();
+                d[axis] = endBox.Axis(axis).Size() - a[axis];
+            }
+
+            auto AveragedProduct = [&](int i, int j) {
+                return a[i] * a[j] + (a[i] * d[j] + a[j] * d[i]) / 2 + d[i] * d[j] / 3;
+            };
+
+            return 2 * (AveragedProduct(0, 1) + AveragedProduct(1, 2) + AveragedProduct(2, 0));
+        }
+
+        static uint32_t ExpandBits(uint32_t v)
+        {
+            // Spreads the lower 10 bits of v so there are two zero bits between each of them
+            v = (v * 0x00010001u) & 0xFF0000FFu;
+            v = (v * 0x00000101u) & 0x0F00F00Fu;
+            v = (v * 0x00000011u) & 0xC30C30C3u;
+            v = (v * 0x00000005u) & 0x49249249u;
+            return v;
+        }
+
+        template <typename LeftTask, typename RightTask>
+        shared_ptr<Hitable> Fork(size_t span, int depth, LeftTask leftTask, RightTask rightTask)
+        {
+            // Builds the node over two subtrees, running the left one as a separate task near the root
+            if ( depth < parallelDepth && span >= parallelThreshold ) {
+                auto leftFuture = std::async(std::launch::async, leftTask);
+                auto rightNode = rightTask();
+                return make_shared<BVHNode>(leftFuture.get(), rightNode);
+            }
+            return make_shared<BVHNode>(leftTask(), rightTask());
+        }
+
+        shared_ptr<Hitable> BuildSAH(size_t *indices, size_t span, int depth)
+        {
+            if ( span == 1 ) return primitives[indices[0]].object;
+
+            AABB centroidBounds;
+            for ( size_t i = 0; i < span; i++ ) {
+                const auto &c = primitives[indices[i]].centroid;
+                centroidBounds = AABB(centroidBounds, AABB(c, c));
+            }
+
+            int axis = 0;
+            for ( int a = 1; a < 3; a++ ) {
+                if ( centroidBounds.Axis(a).Size() > centroidBounds.Axis(axis).Size() ) axis = a;
+            }
+
+            size_t mid = span / 2;
+            auto extent = centroidBounds.Axis(axis);
+
+            if ( span > 2 && extent.Size() > 0 ) {
+                // Bin the primitives by centroid and sweep the bin boundaries for the cheapest split
+                AABB binStart[binCount], binEnd[binCount];
+                size_t binCounts[binCount] = {};
+                auto binScale = binCount / extent.Size();
+                auto BinIndex = [&](size_t index) {
+                    auto b = static_cast<int>((primitives[index].centroid[axis] - extent.min) * binScale);
+                    return std::clamp(b, 0, binCount - 1);
+                };
+
+                for ( size_t i = 0; i < span; i++ ) {
+                    const auto &primitive = primitives[indices[i]];
+                    auto b = BinIndex(indices[i]);
+                    binCounts[b]++;
+                    binStart[b] = AABB(binStart[b], primitive.startBox);
+                    binEnd[b] = AABB(binEnd[b], primitive.endBox);
+                }
+
+                double rightCosts[binCount] = {};
+                AABB startBox, endBox;
+                size_t count = 0;
+                for ( int b = binCount - 1; b > 0; b-- ) {
+                    startBox = AABB(startBox, binStart[b]);
+                    endBox = AABB(endBox, binEnd[b]);
+                    count += binCounts[b];
+                    rightCosts[b] = count ? TimeAveragedSurfaceArea(startBox, endBox) * count : 0;
+                }
+
+                double bestCost = maxDouble;
+                int bestBin = -1;
+                startBox = endBox = AABB();
+                count = 0;
+                for ( int b = 1; b < binCount; b++ ) {
+                    startBox = AABB(startBox, binStart[b - 1]);
+                    endBox = AABB(endBox, binEnd[b - 1]);
+                    count += binCounts[b - 1];
+                    if ( count == 0 || count == span ) continue;
+                    auto cost = TimeAveragedSurfaceArea(startBox, endBox) * count + rightCosts[b];
+                    if ( cost < bestCost ) {
+                        bestCost = cost;
+                        bestBin = b;
+                    }
+                }
+
+                if ( bestBin > 0 ) {
+                    auto split = std::partition(indices, indices + span,
+                                                [&](size_t index) { return BinIndex(index) < bestBin; });
+                    mid = split - indices;
+                }
+            }
+
+            if ( mid == 0 || mid == span ) {
+                // All centroids coincide or binning failed to separate them, so split at the median
+                mid = span / 2;
+                std::nth_element(indices, indices + mid, indices + span, [&](size_t a, size_t b) {
+                    return primitives[a].centroid[axis] < primitives[b].centroid[axis];
+                });
+            }
+
+            return Fork(
+                span, depth,
+                [=, this] { return BuildSAH(indices, mid, depth + 1); },
+                [=, this] { return BuildSAH(indices + mid, span - mid, depth + 1); });
+        }
+
+        shared_ptr<Hitable> BuildMorton(size_t *indices, size_t first, size_t last, int depth)
+        {
+            // Builds the subtree over sorted Morton codes [first, last] by splitting where the
+            // highest differing bit of the codes changes
+            if ( first == last ) return primitives[indices[first]].object;
+
+            size_t mid;
+            auto firstCode = mortonCodes[first];
+            auto lastCode = mortonCodes[last];
+            if ( firstCode == lastCode ) {
+                mid = (first + last) / 2;
+            } else {
+                auto highestBit = uint32_t(1) << (31 - std::countl_zero(firstCode ^ lastCode));
+                auto splitCode = std::partition_point(
+                    mortonCodes.begin() + first, mortonCodes.begin() + last + 1,
+                    [highestBit](uint32_t code) { return (code & highestBit) == 0; });
+                mid = (splitCode - mortonCodes.begin()) - 1;
+            }
 
-    static bool BoxXCompare(const shared_ptr<Hitable> a, const shared_ptr<Hitable> b)
+            return Fork(
+                last - first + 1, depth,
+                [=, this] { return BuildMorton(indices, first, mid, depth + 1); },
+                [=, this] { return BuildMorton(indices, mid + 1, last, depth + 1); });
+        }
+
+    public:
+        Builder(const std::vector<shared_ptr<Hitable>> &objects, size_t start, size_t end, int threadCount)
+            : primitives(end - start)
+        {
+            parallelDepth = (threadCount > 1) ? std::bit_width(unsigned(threadCount - 1)) + 1 : 0;
+
+            std::vector<size_t> primitiveIndices(primitives.size());
+            std::iota(primitiveIndices.begin(), primitiveIndices.end(), 0);
+            std::for_each(std::execution::par, primitiveIndices.begin(), primitiveIndices.end(), [&](size_t i) {
+                auto &primitive = primitives[i];
+                primitive.object = objects[start + i];
+                primitive.startBox = primitive.object->StartBoundingBox();
+                primitive.endBox = primitive.object->EndBoundingBox();
+                for ( int axis = 0; axis < 3; axis++ ) {
+                    primitive.centroid[axis] = 0.25 * (primitive.startBox.Axis(axis).min + primitive.startBox.Axis(axis).max +
+                                                       primitive.endBox.Axis(axis).min + primitive.endBox.Axis(axis).max);
+                }
+            });
+        }
+
+        shared_ptr<Hitable> Build(BuildMethod method)
+        {
+            // Every level partitions ranges of this one index array in place
+            std::vector<size_t> indices(primitives.size());
+            std::iota(indices.begin(), indices.end(), 0);
+
+            if ( method == BuildMethod::SAH ) return BuildSAH(indices.data(), indices.size(), 0);
+
+            AABB centroidBounds;
+            for ( const auto &primitive : primitives ) {
+                centroidBounds = AABB(centroidBounds, AABB(primitive.centroid, primitive.centroid));
+            }
+
+            std::vector<uint64_t> keys(primitives.size());
+            std::for_each(std::execution::par, indices.begin(), indices.end(), [&](size_t i) {
+                uint32_t code = 0;
+                for ( int axis = 0; axis < 3; axis++ ) {
+                    auto extent = centroidBounds.Axis(axis);
+                    auto t = extent.Size() > 0 ? (primitives[i].centroid[axis] - extent.min) / extent.Size() : 0.5;
+                    code |= ExpandBits(static_cast<uint32_t>(std::clamp(t * 1024, 0.0, 1023.0))) << (2 - axis);
+                }
+                keys[i] = (uint64_t(code) << 32) | i; // Pack the index so equal codes sort stably
+            });
+            std::sort(std::execution::par, keys.begin(), keys.end());
+
+            mortonCodes.resize(keys.size());
+            for ( size_t i = 0; i < keys.size(); i++ ) {
+                mortonCodes[i] = static_cast<uint32_t>(keys[i] >> 32);
+                indices[i] = static_cast<size_t>(keys[i] & 0xFFFFFFFFu);
+            }
+
+            return BuildMorton(indices.data(), 0, indices.size() - 1, 0);
+        }
+    };
+
+public:
+    BVHNode(const HitableList &list, BuildMethod method = BuildMethod::SAH,
+            int threadCount = std::thread::hardware_concurrency())
+        : BVHNode(list.objects, 0, list.objects.size(), method, threadCount) {}
+
+    BVHNode(const std::vector<shared_ptr<Hitable>> &sourceObjects, size_t start, size_t end,
+            BuildMethod method = BuildMethod::SAH, int threadCount = std::thread::hardware_concurrency())
     {
-        return BoxCompare(a, b, 0);
+        shared_ptr<Hitable> root;
+        if ( end - start > 1 ) root = Builder(sourceObjects, start, end, threadCount).Build(method);
+
+        // Take over the root's children, or wrap a lone object as both children
+        if ( auto node = std::dynamic_pointer_cast<BVHNode>(root) ) {
+            *this = *node;
+            return;
+        }
+        left = right = sourceObjects[start];
+        SetBounds();
     }
 
-    static bool BoxYCompare(const shared_ptr<Hitable> a, const shared_ptr<Hitable> b)
+    BVHNode(shared_ptr<Hitable> _left, shared_ptr<Hitable> _right) : left(_left), right(_right)
     {
-        return BoxCompare(a, b, 1);
+        SetBounds();
     }
 
-    static bool BoxZCompare(const shared_ptr<Hitable> a, const shared_ptr<Hitable> b)
+    void SetBounds()
     {
-        return BoxCompare(a, b, 2);
+        boundingBox = AABB(left->BoundingBox(), right->BoundingBox());
+        startBoundingBox = AABB(left->StartBoundingBox(), right->StartBoundingBox());
+        endBoundingBox = AABB(left->EndBoundingBox(), right->EndBoundingBox());
+
+        // Static subtrees keep testing the single stored box
+        isMoving = !(startBoundingBox == endBoundingBox);
+        isAnimated = left->IsAnimated() || right->IsAnimated();
     }
 
-public:
-    BVHNode(const HitableList &list) : BVHNode(list.objects, 0, list.objects.size()) {}
+    bool IsAnimated() const override { return isAnimated; }
 
-    BVHNode(const std::vector<shared_ptr<Hitable>> &sourceObjects, size_t start, size_t end)
+    void Refit() override
     {
-        auto objects = sourceObjects; // Create a modifiable array of the source scene objects
-        int axis = RandomInt(0, 2);
-        auto Comparator = (axis == 0)   ? BoxXCompare
-                          : (axis == 1) ? BoxYCompare
-                                        : BoxZCompare;
-
-        size_t objectSpan = end - start;
-
-        if ( objectSpan == 1 ) {
-            left = right = objects[start];
-        } else if ( objectSpan == 2 ) {
-            if ( Comparator(objects[start], objects[start + 1]) ) {
-                left = objects[start];
-                right = objects[start + 1];
-            } else {
-                left = objects[start + 1];
-                right = objects[start];
-            }
-        } else {
-            std::sort(objects.begin() + start, objects.begin() + end, Comparator);
-
-            auto mid = start + objectSpan / 2;
-            left = make_shared<BVHNode>(objects, start, mid);
-            right = make_shared<BVHNode>(objects, mid, end);
-        }
-
-        boundingBox = AABB(left->BoundingBox(), right->BoundingBox());
+        // Updates the bounds along the paths to animated objects, keeping the tree's topology.
+        // Static subtrees are skipped, so refitting costs little when few objects move.
+        if ( !isAnimated ) return;
+        if ( left->IsAnimated() ) left->Refit();
+        if ( right != left && right->IsAnimated() ) right->Refit();
+        SetBounds();
     }
 
     bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
     {
-        if ( !boundingBox.Hit(ray, rayT) ) return false;
+        if ( isMoving ) {
+            if ( !startBoundingBox.Interpolate(endBoundingBox, ray.Time()).Hit(ray, rayT) ) return false;
+        } else if ( !boundingBox.Hit(ray, rayT) ) {
+            return false;
+        }
 
         bool hitLeft = left->Hit(ray, rayT, record);
         bool hitRight = right->Hit(ray, Interval(rayT.min, hitLeft ? record.t : rayT.max), record);
@@ -82,6 +318,10 @@ public:
 
     AABB BoundingBox() const override { return boundingBox; }
 
+    AABB StartBoundingBox() const override { return startBoundingBox; }
+
+    AABB EndBoundingBox() const override { return endBoundingBox; }
+
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
         return 0.0;
@@ -91,6 +331,18 @@ public:
     {
         return Vec3(1, 0, 0);
     }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        left->CollectLights(left, lights);
+        if ( right != left ) right->CollectLights(right, lights);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override
+    {
+        left->CollectMaterials(materials);
+        if ( right != left ) right->CollectMaterials(materials);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#include "rtweekend.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bvh.h"
+#include "hitableList.h"
+#include "sphere.h"
+
+int main(int argc, char **argv)
+{
+    // Reports BVH build time per million primitives for each build method across 1..N threads.
+    // Usage: BVHBenchmark [primitive count]
+    size_t primitiveCount = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+    int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    HitableList world;
+    auto material = shared_ptr<Material>();
+    for ( size_t i = 0; i < primitiveCount; i++ ) {
+        world.Add(make_shared<Sphere>(Point3::Random(-1000, 1000), RandomDouble(0.5, 5), material));
+    }
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "Primitives: " << primitiveCount << '\n'
+              << "Method  Threads  Build (s)  s / Mprim\n";
+
+    // Powers of two up to the hardware thread count, always ending on the hardware thread count
+    std::vector<int> threadCounts;
+    for ( int threads = 1; threads < maxThreads; threads *= 2 ) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    for ( auto method : {BVHNode::BuildMethod::SAH, BVHNode::BuildMethod::Morton} ) {
+        for ( auto threads : threadCounts ) {
+            auto startTime = std::chrono::high_resolution_clock::now();
+            BVHNode bvh(world, method, threads);
+            auto endTime = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double> elapsedTime(endTime - startTime);
+
+            std::cout << ((method == BVHNode::BuildMethod::SAH) ? "SAH   " : "Morton") << "  "
+                      << std::setw(7) << threads << "  "
+                      << std::setw(9) << elapsedTime.count() << "  "
+                      << std::setw(9) << elapsedTime.count() * 1e6 / primitiveCount << '\n';
+        }
+    }
+}
@@ -1,20 +1,37 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <execution>
 #include <filesystem>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "rtweekend.h"
 
 #include "colour.h"
+#include "denoiser.h"
+#include "frameBuffer.h"
 #include "hitable.h"
+#include "hitableList.h"
+#include "imageWriter.h"
+#include "lightBVH.h"
 #include "material.h"
+#include "outputQueue.h"
 #include "pdf.h"
 #include "stbImplementation.h"
+#include "toneMapper.h"
+
+#ifndef _WIN32
+#include "distributed.h" // Worker processes need fork and Unix domain sockets
+#endif
 
 class Camera
 {
@@ -33,53 +50,423 @@ public:
     double defocusAngle = 0;   // Variation angle of rays through each pixel
     double focusDistance = 10; // Distance from camera lookfrom point to plane of perfect focus
 
+    bool nextEventEstimation = false; // Trace shadow rays to the lights and combine with BSDF sampling by MIS
+    bool rayDifferentials = false;    // Track pixel footprints through specular bounces for texture filtering
+
+    bool writePNG = true;             // Save the beauty pass as an 8-bit PNG, tone mapped by toneMapping
+    bool writeHDR = false;            // Save each pass as a Radiance RGBE .hdr
+    bool writePFM = false;            // Save each pass as a 32-bit float .pfm
+    bool writeEXR = false;            // Save every pass as channels of one OpenEXR file
+    EXRWriter::Settings exrSettings;  // Pixel type, compression and layout of the OpenEXR file
+    ToneMapper::Settings toneMapping; // Exposure, tone curve and transfer function of the PNG
+    ToneMapper::PNGSettings pngSettings; // Time spent compressing the PNG
+    bool asyncOutput = false;         // Save files on a background thread, so Render returns once the frame is done
+
+    // Auxiliary passes written to the frame alongside the beauty pass, from the same camera rays
+    bool albedoAOV = false;      // First-hit albedo, the attenuation of its scatter or its emission
+    bool normalAOV = false;      // First-hit shading normal, facing the camera ray
+    bool depthAOV = false;       // Nearest first hit in the pixel, as distance along the view axis
+    bool materialIDAOV = false;  // First-hit material, numbered in the order the scene lists them, -1 for none
+    bool motionAOV = false;      // First-hit screen motion over the shutter interval, in pixels
+    bool sampleStatsAOV = false; // Samples taken and the per-channel variance of the pixel's mean
+
+    bool denoise = false;        // Filter the beauty pass, adding the albedo, normal, depth and sample passes it's guided by
+    Denoiser::Quality denoiseQuality = Denoiser::Quality::Balanced; // Trades denoising time against smoothness
+
+    uint64_t seed = 0;       // Picks the noise pattern; every sample is seeded from it and its pixel
+    int workerProcesses = 0; // Render the frame as tiles in this many forked worker processes
+    std::string tileSocket;  // Unix socket tile workers connect to, by default one per coordinator
+    bool tileWorker = false; // Instead of rendering, serve tiles to the coordinator listening on tileSocket
+
+    // Re-rendering part of a frame. Pixels keep the full frame's coordinates and seeds, so they
+    // come out exactly as a render of the whole frame would have them.
+    PixelRect crop;                          // Render only these pixels, saved as an image of their own; empty for the whole frame
+    std::vector<bool> mask;                  // Render only pixels set here, indexed y * imageWidth + x; empty for all of them
+    shared_ptr<const FrameBuffer> mergeInto; // Earlier render of the whole frame, whose pixels fill those not rendered; the full frame is then saved
+
+    std::function<void(double)> progress; // Called with the fraction of scanlines done as each one finishes
+
+    void Render(const Hitable &world)
+    {
+        // Renders with lights gathered from the scene's emitters
+        LightCollection collected;
+        auto lights = GatherLights(world, collected);
+
+        std::clog << "Sampling " << collected.emitters.size() << " emitter(s)";
+        if ( !nextEventEstimation ) std::clog << " and " << collected.importanceSampled.size() << " tagged object(s)";
+        std::clog << "\n";
+
+        // Without lights, fall back to sampling the materials alone
+        RenderScene(world, lights, !lights.objects.empty());
+    }
+
     void Render(const Hitable &world, const Hitable &lights)
     {
+        RenderScene(world, lights, true);
+    }
+
+    // The linear output of the last render
+    const FrameBuffer &Frame() const { return frame; }
+
+    // Path and number the last render's files were saved under, without extension
+    const std::string &OutputStem() const { return outputStem; }
+
+    // Blocks until every frame handed to the background by asyncOutput has been saved
+    static void WaitForOutput() { OutputQueue::Shared().Wait(); }
+
+    static std::vector<bool> NoisyPixels(const FrameBuffer &frame, double maxRelativeError)
+    {
+        // Mask of the pixels of a render with sampleStatsAOV whose standard error is more than
+        // maxRelativeError of their brightness, to re-render them with more samples
+        std::vector<bool> noisy(size_t(frame.width) * frame.height, false);
+        auto variance = frame.Find("variance");
+        if ( !variance ) return noisy;
+        for ( int y = 0; y < frame.height; y++ ) {
+            for ( int x = 0; x < frame.width; x++ ) {
+                auto mean = frame.Beauty().Get(x, y);
+                auto meanVariance = variance->Get(x, y);
+                auto error = std::sqrt((meanVariance.X() + meanVariance.Y() + meanVariance.Z()) / 3);
+                auto brightness = (mean.X() + mean.Y() + mean.Z()) / 3;
+                noisy[size_t(y) * frame.width + x] = error > maxRelativeError * std::fmax(brightness, 1e-3);
+            }
+        }
+        return noisy;
+    }
+
+    int Prepare(const Hitable &world)
+    {
+        // Sets the camera up from its settings and gathers the scene's lights for Sample, which
+        // renders progressively as previews do. Returns how many samples per pixel Render takes.
+        LightCollection collected;
+        preparedLights = GatherLights(world, collected);
+        sampleLights = !preparedLights.objects.empty();
         Initialise();
+        return sqrtSamplesPerPixel * sqrtSamplesPerPixel;
+    }
+
+    int ImageHeight() const { return imageHeight; }
+
+    Colour Sample(const Hitable &world, int i, int j, int sampleIndex)
+    {
+        // Traces one sample of pixel i, j after Prepare, leaving the frame alone. Samples are
+        // seeded and stratified as Render's are, so the first Prepare count of them sum to
+        // the pixel Render would give. Safe to call from several threads at once.
+        auto strata = sqrtSamplesPerPixel * sqrtSamplesPerPixel;
+        auto stratum = sampleIndex % strata;
+        SeedRandom(PixelSeed(i, j) + uint64_t(sampleIndex));
+        Ray ray = GetRay(i, j, stratum % sqrtSamplesPerPixel, stratum / sqrtSamplesPerPixel);
+        auto colour = nextEventEstimation ? RayColourMIS(ray, maxDepth, world, preparedLights, -1)
+                                          : RayColour(ray, maxDepth, world, preparedLights);
+        for ( int c = 0; c < 3; c++ ) {
+            if ( colour[c] != colour[c] ) colour[c] = 0.0;
+        }
+        return colour;
+    }
+
+private:
+    void RenderScene(const Hitable &world, const Hitable &lights, bool lightSampling)
+    {
+        sampleLights = lightSampling;
+        Initialise();
+        if ( region.Empty() ) {
+            std::cerr << "ERROR: The crop window is outside the " << imageWidth << "x" << imageHeight << " frame.\n";
+            return;
+        }
+        if ( !mask.empty() && mask.size() != size_t(imageWidth) * imageHeight ) {
+            std::cerr << "ERROR: The mask has " << mask.size() << " pixels, not " << imageWidth << "x" << imageHeight << ".\n";
+            return;
+        }
+        if ( mergeInto && (mergeInto->width != imageWidth || mergeInto->height != imageHeight) ) {
+            std::cerr << "ERROR: The frame to merge into is " << mergeInto->width << "x" << mergeInto->height
+                      << ", not " << imageWidth << "x" << imageHeight << ".\n";
+            return;
+        }
+
+        bool captureFirstHit = albedoAOV || normalAOV || depthAOV || materialIDAOV || motionAOV || denoise;
+        bool anyAOV = captureFirstHit || sampleStatsAOV;
+        // Numbered here, before tile workers fork, so every process writes the same IDs
+        MaterialIDs materialIDs;
+        if ( materialIDAOV ) materialIDs.Number(world);
+
+        // Tiles render their samples in sequence: forked workers can't share the parent's threads
+        auto renderTile = [this, &world, &lights, captureFirstHit, anyAOV, &materialIDs](const PixelRect &tile) {
+            for ( int j = tile.y0; j < tile.y1; j++ ) {
+                for ( int i = tile.x0; i < tile.x1; i++ ) {
+                    RenderPixel(std::execution::seq, i, j, world, lights, captureFirstHit, anyAOV, materialIDs);
+                }
+            }
+        };
+        if ( tileWorker ) {
+#ifndef _WIN32
+            if ( !DistributedRenderer::Serve(tileSocket, frame, renderTile) ) {
+                std::cerr << "ERROR: Could not serve tiles to '" << tileSocket << "'.\n";
+            }
+#else
+            std::cerr << "ERROR: Tile workers aren't supported on this platform.\n";
+#endif
+            return;
+        }
+
+        // Float formats stream scanlines out as they finish, so open them before rendering. Saving
+        // in the background works from a copy of the finished frame instead, as does saving part
+        // of a frame, which is only complete once cropped or merged.
+        outputStem = NextOutputStem("../../Images/Book 3/");
+        auto outputs = Outputs();
+        std::vector<std::unique_ptr<ImageWriter>> writers;
+        bool wholeFrame = region == PixelRect{0, 0, imageWidth, imageHeight} && mask.empty();
+        if ( !asyncOutput && wholeFrame ) writers = OpenWriters(frame, outputStem, outputs);
 
         auto startTime = std::chrono::high_resolution_clock::now();
 
-        int scanlinesRemaining = imageHeight;
-        std::for_each(std::execution::par_unseq, verticalImageIter.begin(), verticalImageIter.end(), [this, &world, &lights, &scanlinesRemaining](int j) {
-            std::clog << "\rScanlines remaining: " << scanlinesRemaining-- << " " << std::flush;
-            std::for_each(std::execution::par_unseq, horizontalImageIter.begin(), horizontalImageIter.end(), [this, j, &world, &lights](int i) {
-                Colour pixelColour(0, 0, 0);
-                std::for_each(std::execution::par_unseq, sqrtSamplesIter.begin(), sqrtSamplesIter.end(), [this, j, i, &world, &lights, &pixelColour](int s_j) {
-                    std::for_each(std::execution::par_unseq, sqrtSamplesIter.begin(), sqrtSamplesIter.end(), [this, j, i, &world, &lights, &pixelColour, s_j](int s_i) {
-                        Ray ray = GetRay(i, j, s_i, s_j);
-                        pixelColour += RayColour(ray, maxDepth, world, lights);
-                    });
+        // Denoised rows aren't final until the whole frame is, so leave them for Close
+        std::atomic<int> scanlinesDone = 0;
+        auto rowDone = [this, &writers, &scanlinesDone](int j) {
+            if ( !denoise ) {
+                for ( auto &writer : writers ) writer->ScanlineDone(j);
+            }
+            if ( progress ) progress(double(++scanlinesDone) / region.Height());
+        };
+
+        if ( workerProcesses <= 0 || !RenderOnWorkers(renderTile, rowDone) ) {
+            // Plain par, not par_unseq: rows finish through writers and progress callbacks that
+            // lock and block, and samples can lock a texture cache shard
+            std::atomic<int> scanlinesRemaining = region.Height();
+            std::for_each(std::execution::par, verticalImageIter.begin(), verticalImageIter.end(), [this, &world, &lights, &scanlinesRemaining, &rowDone, captureFirstHit, anyAOV, &materialIDs](int j) {
+                std::clog << "\rScanlines remaining: " << scanlinesRemaining-- << " " << std::flush;
+                std::for_each(std::execution::par, horizontalImageIter.begin(), horizontalImageIter.end(), [this, j, &world, &lights, captureFirstHit, anyAOV, &materialIDs](int i) {
+                    RenderPixel(std::execution::par, i, j, world, lights, captureFirstHit, anyAOV, materialIDs);
                 });
-                int pixelIndex = 3 * (j * imageWidth + i);
-                WriteColour(image, pixelIndex, pixelColour, samplesPerPixel);
+                rowDone(j);
             });
-        });
+        }
 
         auto endTime = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsedTime(endTime - startTime);
 
-        // Save Image
-        std::string path = "../../Images/Book 3/";
-        auto dirIter = std::filesystem::directory_iterator(path.c_str());
-        int fileCount = 0;
-        for ( auto &entry : dirIter ) {
-            if ( std::filesystem::is_regular_file(entry.path()) ) {
-                fileCount++;
+        if ( !wholeFrame ) {
+            if ( mergeInto ) {
+                MergeUnrendered(*mergeInto);
+            } else if ( region != PixelRect{0, 0, imageWidth, imageHeight} ) {
+                frame = frame.Crop(region);
             }
         }
-        std::string filename = path + std::to_string(fileCount + 1) + ".png";
 
-        stbi_write_png(filename.c_str(), imageWidth, imageHeight, imageComponents, image, imageWidth * imageComponents);
-        STBI_FREE(image);
+        double denoiseTime = 0.0;
+        if ( denoise ) {
+            Denoiser denoiser(denoiseQuality);
+            denoiseTime = denoiser.Apply(frame);
+        }
+
+        // Save Image
+        if ( asyncOutput ) {
+            OutputQueue::Shared().Push([snapshot = frame, outputStem = outputStem, outputs]() {
+                auto writers = OpenWriters(snapshot, outputStem, outputs);
+                FinishOutput(snapshot, outputStem, outputs, writers);
+            });
+        } else {
+            if ( !wholeFrame ) writers = OpenWriters(frame, outputStem, outputs);
+            FinishOutput(frame, outputStem, outputs, writers);
+        }
 
         std::clog << "\rDone.                 \n"
                   << std::flush;
 
         std::clog << "\rRender Time: " << elapsedTime << " " << std::flush;
+        if ( denoise ) std::clog << "Denoise Time: " << denoiseTime << "s " << std::flush;
     }
 
-private:
+    bool RenderOnWorkers(const std::function<void(const PixelRect &)> &renderTile, const std::function<void(int)> &rowDone)
+    {
+        // Spreads the window over forked worker processes. Returns false where the platform has
+        // no fork or Unix domain sockets, leaving the caller to render it here.
+#ifndef _WIN32
+        DistributedRenderer(frame, region, renderTile, rowDone).Render(workerProcesses, tileSocket);
+        return true;
+#else
+        std::cerr << "ERROR: Worker processes aren't supported on this platform, rendering locally.\n";
+        return false;
+#endif
+    }
+
+    bool Selected(int i, int j) const { return region.Contains(i, j) && (mask.empty() || mask[size_t(j) * imageWidth + i]); }
+
+    void MergeUnrendered(const FrameBuffer &base)
+    {
+        // Fills the pixels this render skipped from base, in each pass base has with the same
+        // channels. Passes base lacks stay empty there.
+        for ( auto &pass : frame.passes ) {
+            auto basePass = base.Find(pass.name);
+            if ( !basePass || basePass->Channels() != pass.Channels() ) continue;
+            for ( int j = 0; j < imageHeight; j++ ) {
+                for ( int i = 0; i < imageWidth; i++ ) {
+                    if ( Selected(i, j) ) continue;
+                    std::copy(basePass->Pixel(i, j), basePass->Pixel(i, j) + pass.Channels(), pass.Pixel(i, j));
+                }
+            }
+        }
+    }
+
+    HitableList GatherLights(const Hitable &world, LightCollection &collected) const
+    {
+        // Collects the scene's emitters into a list of lights to sample. For the mixture PDF
+        // integrator, objects tagged ImportanceSampled are sampled as often as all the emitters
+        // together.
+        world.CollectLights(nullptr, collected);
+
+        HitableList emitters;
+        for ( const auto &emitter : collected.emitters ) {
+            emitters.Add(emitter);
+        }
+        HitableList tagged;
+        for ( const auto &object : collected.importanceSampled ) {
+            tagged.Add(object);
+        }
+
+        HitableList lights;
+        if ( !emitters.objects.empty() ) lights.Add(make_shared<LightBVH>(emitters, collected.powers));
+        if ( !nextEventEstimation && !tagged.objects.empty() ) lights.Add(make_shared<LightBVH>(tagged, collected.weights));
+        return lights;
+    }
+
+    static std::string NextOutputStem(const std::string &path)
+    {
+        // Numbers renders in sequence. Every file of a render shares its number, so take one
+        // past the highest number in use. The directory is only scanned on the first render of
+        // a run; later renders carry on the count, which also skips numbers whose files are
+        // still being saved in the background.
+        static std::mutex mutex;
+        static std::unordered_map<std::string, int> lastNumbers;
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto found = lastNumbers.find(path);
+        if ( found == lastNumbers.end() ) {
+            int lastNumber = 0;
+            for ( auto &entry : std::filesystem::directory_iterator(path) ) {
+                if ( !std::filesystem::is_regular_file(entry.path()) ) continue;
+                auto stem = entry.path().filename().string();
+                auto digits = std::min(stem.find_first_not_of("0123456789"), stem.size());
+                if ( digits == 0 || digits > 9 ) continue;
+                lastNumber = std::max(lastNumber, std::stoi(stem.substr(0, digits)));
+            }
+            found = lastNumbers.emplace(path, lastNumber).first;
+        }
+        return path + std::to_string(++found->second);
+    }
+
+    struct OutputOptions
+    {
+        // Which files to save and how; a copy goes with a frame saved in the background
+        bool png, hdr, pfm, exr;
+        EXRWriter::Settings exrSettings;
+        ToneMapper::Settings toneMapping;
+        ToneMapper::PNGSettings pngSettings;
+    };
+
+    OutputOptions Outputs() const
+    {
+        return {writePNG, writeHDR, writePFM, writeEXR, exrSettings, toneMapping, pngSettings};
+    }
+
+    static std::vector<std::unique_ptr<ImageWriter>> OpenWriters(const FrameBuffer &frame, const std::string &outputStem, const OutputOptions &options)
+    {
+        std::vector<std::unique_ptr<ImageWriter>> writers;
+        auto open = [&](std::unique_ptr<ImageWriter> writer, const std::string &filename) {
+            if ( writer->Open(filename, frame) ) {
+                writers.push_back(std::move(writer));
+            } else {
+                std::cerr << "ERROR: Could not create '" << filename << "'.\n";
+            }
+        };
+
+        for ( const auto &pass : frame.passes ) {
+            auto passStem = outputStem + ((pass.name == "beauty") ? "" : "." + pass.name);
+            if ( options.hdr ) open(std::make_unique<HDRWriter>(pass.name), passStem + ".hdr");
+            if ( options.pfm ) open(std::make_unique<PFMWriter>(pass.name), passStem + ".pfm");
+        }
+        if ( options.exr ) open(std::make_unique<EXRWriter>(options.exrSettings), outputStem + ".exr");
+        return writers;
+    }
+
+    static void FinishOutput(const FrameBuffer &frame, const std::string &outputStem, const OutputOptions &options, std::vector<std::unique_ptr<ImageWriter>> &writers)
+    {
+        // Writes the PNG and completes the float files opened on the frame
+        if ( options.png ) {
+            auto filename = outputStem + ".png";
+            if ( !ToneMapper(options.toneMapping).WritePNG(frame.Beauty(), filename, options.pngSettings) ) {
+                std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+            }
+        }
+
+        for ( auto &writer : writers ) {
+            if ( !writer->Close() ) std::cerr << "ERROR: Could not write '" << writer->Filename() << "'.\n";
+        }
+    }
+
+    struct FirstHit
+    {
+        // What a camera ray first hit, for the AOV passes
+        bool hit = false;
+        Colour albedo;
+        Vec3 normal;
+        double depth = 0;
+        const Material *material = nullptr;
+        double motionX = 0, motionY = 0;
+    };
+
+    struct PixelAOVs
+    {
+        // Running totals of a pixel's samples for the AOV passes
+        int samples = 0;
+        ColourSum colourSum, colourSquaredSum;
+        Colour albedo;
+        Vec3 normal;
+        double depth = maxDouble;
+        const Material *material = nullptr;
+        bool firstSample = true;
+        double motionX = 0, motionY = 0;
+
+        void Add(const Colour &colour, const FirstHit &firstHit)
+        {
+            samples++;
+            colourSum.Add(colour);
+            colourSquaredSum.AddSquared(colour);
+
+            // Blend the filterable quantities over the samples; an ID can't blend, so keep the first
+            // stratum's
+            albedo += firstHit.albedo;
+            normal += firstHit.normal;
+            motionX += firstHit.motionX;
+            motionY += firstHit.motionY;
+            if ( firstHit.hit ) depth = std::fmin(depth, firstHit.depth);
+            if ( firstSample ) material = firstHit.material;
+            firstSample = false;
+        }
+    };
+
+    struct MaterialIDs
+    {
+        // Numbers the scene's materials in the order the scene lists them. It's filled before
+        // rendering, so lookups take no lock and forked tile workers inherit the same numbers.
+        std::unordered_map<const Material *, int> ids;
+
+        void Number(const Hitable &world)
+        {
+            std::vector<const Material *> materials;
+            world.CollectMaterials(materials);
+            for ( auto material : materials ) {
+                if ( material ) ids.try_emplace(material, int(ids.size()));
+            }
+        }
+
+        int ID(const Material *material) const
+        {
+            auto found = ids.find(material);
+            return (found == ids.end()) ? -1 : found->second;
+        }
+    };
+
     int imageHeight;                      // Rendered image height
+    PixelRect region;                     // Pixels to render: the crop window within the frame, or all of it
     int sqrtSamplesPerPixel;              // Square root for a sum of pixel samples
     double reciprocalSqrtSamplesPerPixel; // 1 / sqrtSamplesPerPixel
     Point3 centre;                        // Camera center
@@ -89,9 +476,11 @@ private:
     Vec3 u, v, w;                         // Camera frame basis vectors
     Vec3 defocusDiskU;                    // Defocus disk horizontal radius
     Vec3 defocusDiskV;                    // Defocus disk vertical radius
+    bool sampleLights;                    // Whether the light list has anything to sample
 
-    static const int imageComponents = 3;
-    uint8_t *image;
+    FrameBuffer frame;
+    std::string outputStem;
+    HitableList preparedLights; // Lights gathered by Prepare
 
     std::vector<int> horizontalImageIter;
     std::vector<int> verticalImageIter;
@@ -136,15 +525,18 @@ private:
         defocusDiskU = u * defocusRadius;
         defocusDiskV = v * defocusRadius;
 
-        horizontalImageIter.resize(imageWidth);
-        verticalImageIter.resize(imageHeight);
+        region = crop.Empty() ? PixelRect{0, 0, imageWidth, imageHeight} : crop.Clamped(imageWidth, imageHeight);
+
+        // Scanlines and pixels are iterated over the region only
+        horizontalImageIter.resize(std::max(region.Width(), 0));
+        verticalImageIter.resize(std::max(region.Height(), 0));
         samplesIter.resize(samplesPerPixel);
         sqrtSamplesIter.resize(sqrtSamplesPerPixel);
-        for ( int i = 0; i < imageWidth; i++ ) {
-            horizontalImageIter[i] = i;
+        for ( size_t i = 0; i < horizontalImageIter.size(); i++ ) {
+            horizontalImageIter[i] = region.x0 + int(i);
         }
-        for ( int i = 0; i < imageHeight; i++ ) {
-            verticalImageIter[i] = i;
+        for ( size_t i = 0; i < verticalImageIter.size(); i++ ) {
+            verticalImageIter[i] = region.y0 + int(i);
         }
         for ( int i = 0; i < samplesPerPixel; i++ ) {
             samplesIter[i] = i;
@@ -153,7 +545,16 @@ private:
             sqrtSamplesIter[i] = i;
         }
 
-        image = new uint8_t[imageWidth * imageHeight * imageComponents];
+        frame = FrameBuffer(imageWidth, imageHeight);
+        if ( albedoAOV || denoise ) frame.AddPass("albedo", {"R", "G", "B"});
+        if ( normalAOV || denoise ) frame.AddPass("normal", {"X", "Y", "Z"});
+        if ( depthAOV || denoise ) frame.AddPass("depth", {"Z"});
+        if ( materialIDAOV ) frame.AddPass("materialID", {"ID"});
+        if ( motionAOV ) frame.AddPass("motion", {"X", "Y"});
+        if ( sampleStatsAOV || denoise ) {
+            frame.AddPass("samples", {"N"});
+            frame.AddPass("variance", {"R", "G", "B"});
+        }
     }
 
     Ray GetRay(int i, int j, int s_i, int s_j) const
@@ -168,7 +569,16 @@ private:
         auto rayDirection = pixelSample - rayOrigin;
         auto rayTime = RandomDouble();
 
-        return Ray(rayOrigin, rayDirection, rayTime);
+        Ray ray(rayOrigin, rayDirection, rayTime);
+        if ( rayDifferentials ) {
+            // Offsets to the neighbouring pixel, scaled down to one sample's share of the pixel
+            // so supersampled images still pick fine texture detail
+            auto scale = std::fmax(reciprocalSqrtSamplesPerPixel, 0.125);
+            ray.differentials = make_shared<const RayDifferentials>(
+                RayDifferentials{rayOrigin, rayOrigin, rayDirection + scale * pixelDeltaU, rayDirection + scale * pixelDeltaV});
+        }
+
+        return ray;
     }
 
     Vec3 SampleSquareStratified(int s_i, int s_j) const
@@ -203,30 +613,149 @@ private:
         return centre + (p[0] * defocusDiskU) + (p[1] * defocusDiskV);
     }
 
-    Colour RayColour(const Ray &ray, int depth, const Hitable &world, const Hitable &lights)
+    bool Project(const Point3 &p, double &x, double &y) const
+    {
+        // Continuous pixel coordinates of a world point, or false if it's behind the camera
+        auto offset = p - centre;
+        auto forward = -Dot(offset, w);
+        if ( forward <= 0 ) return false;
+
+        auto onViewport = centre + (focusDistance / forward) * offset - pixelZeroLoc;
+        x = Dot(onViewport, pixelDeltaU) / pixelDeltaU.LengthSquared();
+        y = Dot(onViewport, pixelDeltaV) / pixelDeltaV.LengthSquared();
+        return true;
+    }
+
+    void CaptureFirstHit(FirstHit &firstHit, const Ray &ray, const HitRecord &record, const Colour &albedo) const
+    {
+        firstHit.hit = true;
+        firstHit.albedo = albedo;
+        firstHit.normal = record.normal;
+        firstHit.depth = -Dot(record.point - centre, w);
+        firstHit.material = record.material.get();
+
+        if ( motionAOV && record.velocity.LengthSquared() > 0 ) {
+            // Where the point was when the shutter opened and will be when it closes
+            double startX, startY, endX, endY;
+            if ( Project(record.point - ray.Time() * record.velocity, startX, startY) &&
+                 Project(record.point + (1 - ray.Time()) * record.velocity, endX, endY) ) {
+                firstHit.motionX = endX - startX;
+                firstHit.motionY = endY - startY;
+            }
+        }
+    }
+
+    uint64_t PixelSeed(int i, int j) const
+    {
+        // The seed is hashed before the pixel index goes in. Added straight on, seed s + 1 would
+        // give every pixel the noise of its right-hand neighbour under seed s.
+        return MixBits(MixBits(seed) ^ (uint64_t(j) * imageWidth + i));
+    }
+
+    template <typename ExecutionPolicy>
+    void RenderPixel(ExecutionPolicy &&policy, int i, int j, const Hitable &world, const Hitable &lights, bool captureFirstHit, bool anyAOV, const MaterialIDs &materialIDs)
+    {
+        if ( !Selected(i, j) ) return;
+
+        // Samples may run in parallel, so each only writes its own stratum's slots. They're summed
+        // in stratum order afterwards, which leaves the pixel independent of the scheduling.
+        auto strata = size_t(sqrtSamplesPerPixel) * sqrtSamplesPerPixel;
+        std::vector<Colour> sampleColours(strata);
+        std::vector<FirstHit> firstHits(captureFirstHit ? strata : 0);
+        auto pixelSeed = PixelSeed(i, j);
+        std::for_each(policy, sqrtSamplesIter.begin(), sqrtSamplesIter.end(), [this, j, i, &world, &lights, &sampleColours, &firstHits, captureFirstHit, &policy, pixelSeed](int s_j) {
+            std::for_each(policy, sqrtSamplesIter.begin(), sqrtSamplesIter.end(), [this, j, i, &world, &lights, &sampleColours, &firstHits, captureFirstHit, pixelSeed, s_j](int s_i) {
+                // Seeding each sample makes it independent of the thread, tile or process it runs on
+                auto stratum = size_t(s_j) * sqrtSamplesPerPixel + s_i;
+                SeedRandom(pixelSeed + stratum);
+                Ray ray = GetRay(i, j, s_i, s_j);
+                auto capture = captureFirstHit ? &firstHits[stratum] : nullptr;
+                if ( nextEventEstimation ) {
+                    sampleColours[stratum] = RayColourMIS(ray, maxDepth, world, lights, -1, capture);
+                } else {
+                    sampleColours[stratum] = RayColour(ray, maxDepth, world, lights, capture);
+                }
+            });
+        });
+
+        ColourSum pixelColour;
+        PixelAOVs aovs;
+        const FirstHit noHit;
+        for ( size_t stratum = 0; stratum < strata; stratum++ ) {
+            pixelColour.Add(sampleColours[stratum]);
+            if ( anyAOV ) aovs.Add(sampleColours[stratum], captureFirstHit ? firstHits[stratum] : noHit);
+        }
+
+        // Replace NaN components with 0 and divide by the number of samples
+        for ( int c = 0; c < 3; c++ ) {
+            if ( pixelColour[c] != pixelColour[c] ) pixelColour[c] = 0.0;
+        }
+        frame.Beauty().Set(i, j, pixelColour.Scaled(1.0 / samplesPerPixel));
+        if ( anyAOV ) WriteAOVs(i, j, aovs, materialIDs);
+    }
+
+    void WriteAOVs(int i, int j, const PixelAOVs &aovs, const MaterialIDs &materialIDs)
     {
+        // Fill whichever passes Initialise added
+        auto scale = 1.0 / std::max(aovs.samples, 1);
+        if ( auto pass = frame.Find("albedo") ) pass->Set(i, j, scale * aovs.albedo);
+        if ( auto pass = frame.Find("normal") ) pass->Set(i, j, scale * aovs.normal);
+        if ( auto pass = frame.Find("depth") ) pass->Pixel(i, j)[0] = float(aovs.depth);
+        if ( auto pass = frame.Find("materialID") ) pass->Pixel(i, j)[0] = float(materialIDs.ID(aovs.material));
+        if ( auto pass = frame.Find("motion") ) {
+            auto motion = pass->Pixel(i, j);
+            motion[0] = float(scale * aovs.motionX);
+            motion[1] = float(scale * aovs.motionY);
+        }
+        if ( auto pass = frame.Find("samples") ) {
+            pass->Pixel(i, j)[0] = float(aovs.samples);
+
+            // Unbiased sample variance over the count gives the variance of the mean
+            ColourSum variance;
+            for ( int c = 0; aovs.samples > 1 && c < 3; c++ ) {
+                auto mean = scale * aovs.colourSum[c];
+                variance[c] = std::fmax((scale * aovs.colourSquaredSum[c] - mean * mean) / (aovs.samples - 1), 0.0);
+            }
+            if ( auto variancePass = frame.Find("variance") ) variancePass->Set(i, j, variance.Scaled(1));
+        }
+    }
+
+    Colour RayColour(const Ray &ray, int depth, const Hitable &world, const Hitable &lights, FirstHit *firstHit = nullptr)
+    {
+        // firstHit, when given, receives what this ray hits; it's only passed for camera rays
         HitRecord record;
 
         // If we've exceeded the ray bounce limit, no more light is gathered
         if ( depth <= 0 ) return Colour(0, 0, 0);
 
         // If the ray hits nothing, return the background colour
-        if ( !world.Hit(ray, Interval(0.001, maxDouble), record) ) return background;
+        if ( !world.Hit(ray, Interval(0, maxDouble), record) ) {
+            if ( firstHit ) firstHit->albedo = background;
+            return background;
+        }
+
+        record.ComputeDifferentials(ray);
 
         ScatterRecord sRecord;
         Colour colourFromEmission = record.material->Emitted(ray, record, record.u, record.v, record.point);
 
-        if ( !record.material->Scatter(ray, record, sRecord) ) return colourFromEmission;
+        bool scatters = record.material->Scatter(ray, record, sRecord);
+        if ( firstHit ) CaptureFirstHit(*firstHit, ray, record, scatters ? sRecord.attenuation : colourFromEmission);
+        if ( !scatters ) return colourFromEmission;
 
         if ( sRecord.skipPdf ) {
             return sRecord.attenuation * RayColour(sRecord.skipPdfRay, depth - 1, world, lights);
         }
 
-        auto lightPtr = make_shared<HitablePDF>(lights, record.point);
-        MixturePDF p(lightPtr, sRecord.pdfPtr);
+        auto p = sRecord.pdfPtr;
+        if ( sampleLights ) {
+            auto lightPtr = make_shared<HitablePDF>(lights, record.point);
+            p = make_shared<MixturePDF>(lightPtr, sRecord.pdfPtr);
+        }
 
-        Ray scattered = Ray(record.point, p.Generate(), ray.Time());
-        auto pdfValue = p.Value(scattered.Direction());
+        auto scatteredDirection = p->Generate();
+        Ray scattered = Ray(record.SpawnOrigin(scatteredDirection), scatteredDirection, ray.Time());
+        auto pdfValue = p->Value(scattered.Direction());
 
         double scatteringPDF = record.material->ScatteringPDF(ray, record, scattered);
 
@@ -235,6 +764,75 @@ private:
 
         return colourFromEmission + colourFromScatter;
     }
+
+    static double PowerHeuristic(double pdf, double otherPDF)
+    {
+        // MIS weight for a sample drawn from pdf, when otherPDF could also have produced it
+        auto pdfSquared = pdf * pdf;
+        return pdfSquared / (pdfSquared + otherPDF * otherPDF);
+    }
+
+    Colour RayColourMIS(const Ray &ray, int depth, const Hitable &world, const Hitable &lights, double bsdfPDF, FirstHit *firstHit = nullptr)
+    {
+        // Next event estimation: direct light comes from an explicit shadow ray to a light sample,
+        // and the path continues with a BSDF sample. Emission reached by that BSDF sample is
+        // weighted against the light sampling strategy with the power heuristic. bsdfPDF is the
+        // PDF of the sample that produced this ray, or negative when no light sample competed
+        // with it (camera rays and delta scattering), in which case emission is counted in full.
+        HitRecord record;
+
+        if ( depth <= 0 ) return Colour(0, 0, 0);
+
+        if ( !world.Hit(ray, Interval(0, maxDouble), record) ) {
+            if ( firstHit ) firstHit->albedo = background;
+            return background;
+        }
+
+        record.ComputeDifferentials(ray);
+
+        Colour colourFromEmission = record.material->Emitted(ray, record, record.u, record.v, record.point);
+        if ( bsdfPDF > 0 && colourFromEmission.LengthSquared() > 0 ) {
+            auto lightPDF = lights.PDFValue(ray.Origin(), ray.Direction());
+            colourFromEmission *= PowerHeuristic(bsdfPDF, lightPDF);
+        }
+
+        ScatterRecord sRecord;
+        bool scatters = record.material->Scatter(ray, record, sRecord);
+        if ( firstHit ) CaptureFirstHit(*firstHit, ray, record, scatters ? sRecord.attenuation : colourFromEmission);
+        if ( !scatters ) return colourFromEmission;
+
+        if ( sRecord.skipPdf ) {
+            return colourFromEmission + sRecord.attenuation * RayColourMIS(sRecord.skipPdfRay, depth - 1, world, lights, -1);
+        }
+
+        // Direct lighting through a shadow ray towards a sampled point on a light
+        Colour colourFromLight(0, 0, 0);
+        auto lightDirection = sampleLights ? lights.Random(record.point) : Vec3(0, 0, 0);
+        auto lightPDF = sampleLights ? lights.PDFValue(record.point, lightDirection) : 0.0;
+        if ( lightPDF > 0 ) {
+            Ray shadowRay(record.SpawnOrigin(lightDirection), lightDirection, ray.Time());
+            HitRecord lightRecord;
+            double scatteringPDF = record.material->ScatteringPDF(ray, record, shadowRay);
+            if ( scatteringPDF > 0 && world.Hit(shadowRay, Interval(0, maxDouble), lightRecord) ) {
+                Colour emitted = lightRecord.material->Emitted(shadowRay, lightRecord, lightRecord.u, lightRecord.v, lightRecord.point);
+                auto weight = PowerHeuristic(lightPDF, sRecord.pdfPtr->Value(lightDirection));
+                colourFromLight = (sRecord.attenuation * scatteringPDF * weight * emitted) / lightPDF;
+            }
+        }
+
+        // Indirect lighting through a BSDF sample
+        auto scatteredDirection = sRecord.pdfPtr->Generate();
+        Ray scattered = Ray(record.SpawnOrigin(scatteredDirection), scatteredDirection, ray.Time());
+        auto pdfValue = sRecord.pdfPtr->Value(scattered.Direction());
+        if ( pdfValue <= 0 ) return colourFromEmission + colourFromLight;
+
+        double scatteringPDF = record.material->ScatteringPDF(ray, record, scattered);
+
+        Colour sampleColour = RayColourMIS(scattered, depth - 1, world, lights, sampleLights ? pdfValue : -1);
+        Colour colourFromScatter = (sRecord.attenuation * scatteringPDF * sampleColour) / pdfValue;
+
+        return colourFromEmission + colourFromLight + colourFromScatter;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -3,47 +3,35 @@
 
 #include "vec3.h"
 
-#include "stbImplementation.h"
-
 using Colour = Vec3;
 
-inline double LinearToGamma(double linearComponent)
+struct ColourSum
 {
-    return sqrt(linearComponent);
-}
+    // Running total of colours, kept in double so sums over many samples stay accurate when
+    // Colour itself is single precision
+    double total[3] = {0, 0, 0};
 
-void WriteColour(uint8_t *image, int pixelIndex, Colour pixelColour, int samplesPerPixel)
-{
+    void Add(const Colour &colour)
+    {
+        for ( int c = 0; c < 3; c++ ) total[c] += colour[c];
+    }
+
+    void AddSquared(const Colour &colour)
+    {
+        for ( int c = 0; c < 3; c++ ) total[c] += double(colour[c]) * colour[c];
+    }
 
-    auto R = pixelColour.X();
-    auto G = pixelColour.Y();
-    auto B = pixelColour.Z();
-
-    // Replace NaN components with 0.
-    if ( R != R ) R = 0.0;
-    if ( G != G ) G = 0.0;
-    if ( B != B ) B = 0.0;
-
-    // Divide the colours by the number of samples
-    auto scale = 1.0 / samplesPerPixel;
-    R *= scale;
-    G *= scale;
-    B *= scale;
-
-    // Apply the linear to gamma transform
-    R = LinearToGamma(R);
-    G = LinearToGamma(G);
-    B = LinearToGamma(B);
-
-    // Write the translated [0,255] value of each colour component
-    static const Interval intensity(0.000, 0.999);
-    int IR = static_cast<int>(256 * intensity.Clamp(R));
-    int IG = static_cast<int>(256 * intensity.Clamp(G));
-    int IB = static_cast<int>(256 * intensity.Clamp(B));
-
-    image[pixelIndex] = IR;
-    image[pixelIndex + 1] = IG;
-    image[pixelIndex + 2] = IB;
+    double operator[](int c) const { return total[c]; }
+
+    double &operator[](int c) { return total[c]; }
+
+    Colour Scaled(double scale) const { return Colour(Real(total[0] * scale), Real(total[1] * scale), Real(total[2] * scale)); }
+};
+
+inline double Luminance(const Colour &c)
+{
+    // Rec. 709 relative luminance of a linear colour
+    return 0.2126 * c.X() + 0.7152 * c.Y() + 0.0722 * c.Z();
 }
 
 #endif
\ No newline at end of file
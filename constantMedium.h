@@ -9,17 +9,25 @@
 
 class ConstantMedium : public Hitable
 {
-private:
+protected:
     shared_ptr<Hitable> boundary;
-    double negativeInverseDensity;
+    double majorant; // Upper bound on the density inside the boundary
     shared_ptr<Material> phaseFunction;
 
+    // Density at p. Homogeneous media are at their majorant everywhere; heterogeneous media
+    // override this and bound it by the majorant.
+    virtual double Density(const Point3 &p) const { return majorant; }
+
 public:
     ConstantMedium(shared_ptr<Hitable> b, double d, shared_ptr<Texture> a)
-        : boundary(b), negativeInverseDensity(-1 / d), phaseFunction(make_shared<Isotropic>(a)) {}
+        : boundary(b), majorant(d), phaseFunction(make_shared<Isotropic>(a)) {}
 
     ConstantMedium(shared_ptr<Hitable> b, double d, Colour c)
-        : boundary(b), negativeInverseDensity(-1 / d), phaseFunction(make_shared<Isotropic>(c)) {}
+        : boundary(b), majorant(d), phaseFunction(make_shared<Isotropic>(c)) {}
+
+    // Medium with a given phase function, e.g. HenyeyGreenstein
+    ConstantMedium(shared_ptr<Hitable> b, double d, shared_ptr<Material> phase)
+        : boundary(b), majorant(d), phaseFunction(phase) {}
 
     bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
     {
@@ -27,29 +35,38 @@ public:
         const bool enableDebug = false;
         const bool debugging = enableDebug && RandomDouble() < 0.00001;
 
-        HitRecord record1, record2;
-
-        if ( !boundary->Hit(ray, Interval(-maxDouble, +maxDouble), record1) ) return false;
+        // Entry and exit of the boundary in one query
+        Interval span;
+        if ( !boundary->Span(ray, span) ) return false;
 
-        if ( !boundary->Hit(ray, Interval(record1.t + 0.0001, maxDouble), record2) ) return false;
+        if ( debugging ) std::clog << "\nrayTMin=" << span.min << ", rayTMax=" << span.max << '\n';
 
-        if ( debugging ) std::clog << "\nrayTMin=" << record1.t << ", rayTMax=" << record2.t << '\n';
+        if ( span.min < rayT.min ) span.min = rayT.min;
+        if ( span.max > rayT.max ) span.max = rayT.max;
 
-        if ( record1.t < rayT.min ) record1.t = rayT.min;
-        if ( record2.t > rayT.max ) record2.t = rayT.max;
+        if ( span.min >= span.max ) return false;
 
-        if ( record1.t >= record2.t ) return false;
-
-        if ( record1.t < 0 ) record1.t = 0;
+        if ( span.min < 0 ) span.min = 0;
 
+        // Delta tracking: take free flights at the majorant rate and accept each tentative
+        // collision with probability density / majorant. For a homogeneous medium the first
+        // collision is always real, so this is the analytic exponential free-flight sample.
         auto rayLength = ray.Direction().Length();
-        auto distanceInsideBoundary = (record2.t - record1.t) * rayLength;
-        auto hitDistance = negativeInverseDensity * log(RandomDouble());
+        auto distanceInsideBoundary = (span.max - span.min) * rayLength;
+        auto negativeInverseMajorant = -1 / majorant;
+        auto hitDistance = 0.0;
 
-        if ( hitDistance > distanceInsideBoundary ) return false;
+        while ( true ) {
+            hitDistance += negativeInverseMajorant * log(RandomDouble());
+            if ( hitDistance > distanceInsideBoundary ) return false;
 
-        record.t = record1.t + hitDistance / rayLength;
-        record.point = ray.At(record.t);
+            record.t = span.min + hitDistance / rayLength;
+            record.point = ray.At(record.t);
+            record.pointError = 0;
+
+            auto density = Density(record.point);
+            if ( density >= majorant || RandomDouble() * majorant < density ) break;
+        }
 
         if ( debugging ) {
             std::clog << "hitDistance = " << hitDistance << '\n'
@@ -60,12 +77,18 @@ public:
         record.normal = Vec3(1, 0, 0); // Arbitrary
         record.frontFace = true;
         record.material = phaseFunction;
+        record.SetSurfaceDerivatives(Vec3(), Vec3());
+        record.velocity = Vec3();
 
         return true;
     }
 
     AABB BoundingBox() const override { return boundary->BoundingBox(); }
 
+    AABB StartBoundingBox() const override { return boundary->StartBoundingBox(); }
+
+    AABB EndBoundingBox() const override { return boundary->EndBoundingBox(); }
+
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
         return 0.0;
@@ -75,6 +98,9 @@ public:
     {
         return Vec3(1, 0, 0);
     }
+
+    // Rays only ever find the phase function inside, never the boundary's materials
+    void CollectMaterials(std::vector<const Material *> &materials) const override { materials.push_back(phaseFunction.get()); }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,344 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+#include "frameBuffer.h"
+
+class Denoiser
+{
+    // Edge-avoiding a-trous wavelet filter, after SVGF (Schied et al. 2017). The beauty pass is
+    // divided by the albedo pass so texture detail is kept out of the blur, then filtered by a
+    // 5x5 B3-spline kernel whose taps spread twice as far apart each pass. A tap's weight falls
+    // off across edges in the normal and depth passes, and with the difference in luminance
+    // relative to the pixel's noise, estimated from the variance pass and tracked as it shrinks.
+    //
+    // Images are held as one plane per channel and the taps are applied a row at a time, so the
+    // weight arithmetic over a row is straight-line float code the compiler can vectorise.
+
+public:
+    enum class Quality { Fast, Balanced, High };
+
+    struct Settings
+    {
+        int passes = 3;                // Each pass doubles the tap spacing; reach is 2^(passes + 1) - 2 pixels
+        float sigmaLuminance = 8.0f;   // Luminance difference tolerated, in standard deviations of the noise
+        float normalPower = 128.0f;    // Normals are compared by about their cosine to this power
+        float sigmaDepth = 1.0f;       // Depth difference tolerated, in multiples of the local depth gradient
+        bool prefilterVariance = true; // Blur the variance before use, steadier at low sample counts
+        bool closingPass = false;      // Finish with another pass at one pixel spacing, smoothing blotches the wide taps leave
+    };
+
+    static Settings Preset(Quality quality)
+    {
+        Settings settings;
+        switch ( quality ) {
+            case Quality::Fast:
+                settings.passes = 2;
+                settings.prefilterVariance = false;
+                break;
+            case Quality::Balanced:
+                break;
+            case Quality::High:
+                // Balanced's reach, then a closing pass. A fourth doubling pass blurs more than it
+                // removes noise, and tighter luminance stops don't win that back.
+                settings.closingPass = true;
+                break;
+        }
+        return settings;
+    }
+
+    Settings settings;
+
+    Denoiser(Quality quality = Quality::Balanced) : settings(Preset(quality)) {}
+
+    Denoiser(const Settings &_settings) : settings(_settings) {}
+
+    double Apply(FrameBuffer &frame)
+    {
+        // Denoises the beauty pass in place, guided by the frame's albedo, normal, depth and
+        // variance passes where present. Returns the time taken in seconds.
+        auto startTime = std::chrono::high_resolution_clock::now();
+
+        width = frame.width;
+        height = frame.height;
+        if ( width <= 0 || height <= 0 ) return 0.0;
+
+        Demodulate(frame);
+        LoadGuides(frame);
+        if ( !frame.Find("variance") ) EstimateVariance();
+
+        for ( int pass = 0; pass < settings.passes; pass++ ) {
+            Filter(1 << pass);
+        }
+        if ( settings.closingPass ) Filter(1);
+
+        Remodulate(frame);
+
+        std::chrono::duration<double> elapsedTime(std::chrono::high_resolution_clock::now() - startTime);
+        return elapsedTime.count();
+    }
+
+private:
+    // Working state of Apply, kept between calls so repeated denoising reuses the allocations
+    int width = 0, height = 0;
+    std::vector<float> colour[3], filtered[3]; // Demodulated beauty, and the output of a pass
+    std::vector<float> variance, filteredVariance, luminanceScale;
+    std::vector<float> albedo[3];
+    std::vector<float> normal[4];              // Unit normal, plus a fourth axis that marks misses
+    std::vector<float> depth, depthGradient;
+    std::vector<int> rows;
+
+    static constexpr float lumaR = 0.2126f, lumaG = 0.7152f, lumaB = 0.0722f;
+    static constexpr float minAlbedo = 0.001f;
+
+    size_t Count() const { return size_t(width) * height; }
+
+    template <typename Function>
+    void ForEachRow(Function function)
+    {
+        rows.resize(height);
+        std::iota(rows.begin(), rows.end(), 0);
+        std::for_each(std::execution::par, rows.begin(), rows.end(), function);
+    }
+
+    static float Luminance(float r, float g, float b) { return lumaR * r + lumaG * g + lumaB * b; }
+
+    static float Falloff(float x)
+    {
+        // (1 + x/16)^-16, which follows e^-x for x >= 0 closely where weights matter. It has no
+        // library call or clamp, so loops over it vectorise.
+        float u = 1.0f / (1.0f + x * (1.0f / 16));
+        u *= u;
+        u *= u;
+        u *= u;
+        return u * u;
+    }
+
+    static void Resize(std::vector<float> &plane, size_t count) { plane.assign(count, 0.0f); }
+
+    void Demodulate(const FrameBuffer &frame)
+    {
+        // Divide out the albedo so the filter sees lighting alone, and bring the variance with it
+        auto count = Count();
+        auto albedoPass = frame.Find("albedo");
+        auto variancePass = frame.Find("variance");
+        const auto &beauty = frame.Beauty();
+
+        for ( int c = 0; c < 3; c++ ) {
+            Resize(colour[c], count);
+            Resize(filtered[c], count);
+            Resize(albedo[c], count);
+        }
+        Resize(variance, count);
+        Resize(filteredVariance, count);
+        Resize(luminanceScale, count);
+
+        const float luma[3] = {lumaR, lumaG, lumaB};
+        for ( size_t p = 0; p < count; p++ ) {
+            float luminanceVariance = 0.0f;
+            for ( int c = 0; c < 3; c++ ) {
+                auto a = albedoPass ? std::max(albedoPass->data[p * 3 + c], minAlbedo) : 1.0f;
+                albedo[c][p] = a;
+                colour[c][p] = beauty.data[p * 3 + c] / a;
+                if ( variancePass ) luminanceVariance += luma[c] * luma[c] * variancePass->data[p * 3 + c] / (a * a);
+            }
+            variance[p] = luminanceVariance;
+        }
+    }
+
+    void LoadGuides(const FrameBuffer &frame)
+    {
+        // Normals are made unit length. A pixel no sample hit has no normal or depth, so it gets
+        // a normal along a fourth axis: it then matches only other misses, and its depth never
+        // counts. Depth gradients are taken over finite neighbours only.
+        auto count = Count();
+        auto normalPass = frame.Find("normal");
+        auto depthPass = frame.Find("depth");
+
+        for ( int c = 0; c < 4; c++ ) Resize(normal[c], count);
+        Resize(depth, count);
+        Resize(depthGradient, count);
+
+        for ( size_t p = 0; p < count; p++ ) {
+            bool hit = !depthPass || std::isfinite(depthPass->data[p]);
+            depth[p] = (depthPass && hit) ? depthPass->data[p] : 0.0f;
+
+            float n[3] = {0.0f, 0.0f, 0.0f};
+            if ( normalPass ) {
+                for ( int c = 0; c < 3; c++ ) n[c] = normalPass->data[p * 3 + c];
+            }
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if ( !hit ) {
+                normal[3][p] = 1.0f;
+            } else if ( length > 1e-6f ) {
+                for ( int c = 0; c < 3; c++ ) normal[c][p] = n[c] / length;
+            } else {
+                // Without a normal pass, every hit matches every other
+                normal[3][p] = -1.0f;
+            }
+        }
+
+        if ( !depthPass ) return;
+        auto finite = [&](int x, int y) { return x >= 0 && x < width && y >= 0 && y < height && std::isfinite(depthPass->data[size_t(y) * width + x]); };
+        ForEachRow([&](int y) {
+            for ( int x = 0; x < width; x++ ) {
+                auto p = size_t(y) * width + x;
+                if ( !finite(x, y) ) continue;
+                float gradient = 0.0f;
+                if ( finite(x - 1, y) ) gradient = std::max(gradient, std::fabs(depth[p] - depth[p - 1]));
+                if ( finite(x + 1, y) ) gradient = std::max(gradient, std::fabs(depth[p + 1] - depth[p]));
+                if ( finite(x, y - 1) ) gradient = std::max(gradient, std::fabs(depth[p] - depth[p - width]));
+                if ( finite(x, y + 1) ) gradient = std::max(gradient, std::fabs(depth[p + width] - depth[p]));
+                // Floor the gradient at a fraction of the depth so surfaces facing the camera, where
+                // it's near zero, still tolerate rounding
+                depthGradient[p] = std::max(gradient, 1e-3f * depth[p]);
+            }
+        });
+    }
+
+    void EstimateVariance()
+    {
+        // Without a variance pass, use the spread of luminance over each pixel's 3x3 neighbourhood
+        ForEachRow([&](int y) {
+            for ( int x = 0; x < width; x++ ) {
+                float sum = 0.0f, sumSquares = 0.0f;
+                int n = 0;
+                for ( int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++ ) {
+                    for ( int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++ ) {
+                        auto q = size_t(ny) * width + nx;
+                        float luminance = Luminance(colour[0][q], colour[1][q], colour[2][q]);
+                        sum += luminance;
+                        sumSquares += luminance * luminance;
+                        n++;
+                    }
+                }
+                float mean = sum / n;
+                variance[size_t(y) * width + x] = std::max(sumSquares / n - mean * mean, 0.0f);
+            }
+        });
+    }
+
+    void Filter(int step)
+    {
+        static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+        // Luminance weights are scaled by the noise about each pixel, from its variance blurred
+        // over 3x3 so a few unlucky samples don't make it look noise free
+        ForEachRow([&](int y) {
+            for ( int x = 0; x < width; x++ ) {
+                auto p = size_t(y) * width + x;
+                float pixelVariance = variance[p];
+                if ( settings.prefilterVariance ) {
+                    static constexpr float binomial[2] = {0.5f, 0.25f};
+                    float sum = 0.0f, weights = 0.0f;
+                    for ( int dy = -1; dy <= 1; dy++ ) {
+                        for ( int dx = -1; dx <= 1; dx++ ) {
+                            int nx = x + dx, ny = y + dy;
+                            if ( nx < 0 || nx >= width || ny < 0 || ny >= height ) continue;
+                            float weight = binomial[std::abs(dx)] * binomial[std::abs(dy)];
+                            sum += weight * variance[size_t(ny) * width + nx];
+                            weights += weight;
+                        }
+                    }
+                    pixelVariance = sum / weights;
+                }
+                luminanceScale[p] = 1.0f / (settings.sigmaLuminance * std::sqrt(std::max(pixelVariance, 0.0f)) + 1e-6f);
+            }
+        });
+
+        ForEachRow([&](int y) {
+            std::vector<float> sums(6 * size_t(width), 0.0f);
+            float *sumR = &sums[0];
+            float *sumG = &sums[width];
+            float *sumB = &sums[2 * size_t(width)];
+            float *sumVariance = &sums[3 * size_t(width)];
+            float *sumWeight = &sums[4 * size_t(width)];
+            float *luminance = &sums[5 * size_t(width)];
+            const float *r = colour[0].data(), *g = colour[1].data(), *b = colour[2].data();
+            const float *nx = normal[0].data(), *ny = normal[1].data(), *nz = normal[2].data(), *nw = normal[3].data();
+            const float *z = depth.data(), *zGradient = depthGradient.data();
+            const float *v = variance.data(), *vScale = luminanceScale.data();
+
+            auto row = size_t(y) * width;
+            for ( int x = 0; x < width; x++ ) {
+                luminance[x] = Luminance(r[row + x], g[row + x], b[row + x]);
+            }
+
+            for ( int ky = 0; ky < 5; ky++ ) {
+                int dy = (ky - 2) * step;
+                if ( y + dy < 0 || y + dy >= height ) continue;
+
+                for ( int kx = 0; kx < 5; kx++ ) {
+                    int dx = (kx - 2) * step;
+                    int first = std::max(0, -dx), end = std::min(width, width - dx);
+                    float kernelWeight = kernel[kx] * kernel[ky];
+                    float depthSpread = settings.sigmaDepth * std::sqrt(float(dx * dx + dy * dy));
+                    float normalPower = settings.normalPower;
+                    auto tapRow = size_t(y + dy) * width + dx;
+
+                    // The row sums are separate from every plane read here; say so, or the compiler
+                    // needs more overlap checks than it will emit before vectorising
+#if defined(__clang__)
+#pragma clang loop vectorize(assume_safety)
+#elif defined(__GNUC__)
+#pragma GCC ivdep
+#endif
+                    for ( int x = first; x < end; x++ ) {
+                        auto p = row + x;
+                        auto q = tapRow + x;
+
+                        float tapLuminance = lumaR * r[q] + lumaG * g[q] + lumaB * b[q];
+                        float luminanceTerm = std::fabs(luminance[x] - tapLuminance) * vScale[p];
+                        float depthTerm = std::fabs(z[p] - z[q]) / (depthSpread * zGradient[p] + 1e-6f);
+
+                        // cos^n is close to e^(n (cos - 1)) where it matters, so all three stops share one falloff
+                        float cosine = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q] + nw[p] * nw[q];
+                        float normalTerm = normalPower * (1.0f - cosine);
+
+                        float weight = kernelWeight * Falloff(luminanceTerm + depthTerm + normalTerm);
+                        sumR[x] += weight * r[q];
+                        sumG[x] += weight * g[q];
+                        sumB[x] += weight * b[q];
+                        sumVariance[x] += weight * weight * v[q];
+                        sumWeight[x] += weight;
+                    }
+                }
+            }
+
+            // The centre tap always has full weight, but keep the pixel if even that underflowed
+            for ( int x = 0; x < width; x++ ) {
+                auto p = row + x;
+                if ( sumWeight[x] > 1e-12f ) {
+                    float inverse = 1.0f / sumWeight[x];
+                    filtered[0][p] = sumR[x] * inverse;
+                    filtered[1][p] = sumG[x] * inverse;
+                    filtered[2][p] = sumB[x] * inverse;
+                    filteredVariance[p] = sumVariance[x] * inverse * inverse;
+                } else {
+                    for ( int c = 0; c < 3; c++ ) filtered[c][p] = colour[c][p];
+                    filteredVariance[p] = variance[p];
+                }
+            }
+        });
+
+        for ( int c = 0; c < 3; c++ ) colour[c].swap(filtered[c]);
+        variance.swap(filteredVariance);
+    }
+
+    void Remodulate(FrameBuffer &frame)
+    {
+        auto &beauty = frame.Beauty();
+        auto count = Count();
+        for ( size_t p = 0; p < count; p++ ) {
+            for ( int c = 0; c < 3; c++ ) beauty.data[p * 3 + c] = colour[c][p] * albedo[c][p];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "frameBuffer.h"
+#include "localSocket.h"
+
+class DistributedRenderer
+{
+    // Renders a window of a frame as tiles spread over worker processes, which connect to the coordinator
+    // over a Unix domain socket. Local workers are forked once the scene is built, so they start
+    // with it in memory; any other process that builds the same scene can join through Serve.
+    // Every sample is seeded from its pixel, a pixel's samples are summed in stratum order, and
+    // material IDs are numbered before the workers fork. A tile comes out bit for bit the same
+    // whichever worker renders it, and the merged frame matches a render in one process.
+    //
+    // Workers are handed one tile at a time and send back every pass of it as floats. A worker
+    // that disconnects has its tile queued again. Once there is nothing left to hand out, idle
+    // workers take a second copy of the tiles that have been out longest, so a slow worker
+    // can't hold up the frame, and whichever copy arrives first is kept. If every worker is
+    // lost, the coordinator renders what's left itself.
+
+public:
+    using Tile = PixelRect; // A negative x0 tells a worker to stop
+
+    using RenderTile = std::function<void(const Tile &)>;
+    using RowDone = std::function<void(int)>;
+
+    static const int tileSize = 32;
+
+    DistributedRenderer(FrameBuffer &_frame, const PixelRect &_region, RenderTile _renderTile, RowDone _rowDone = nullptr)
+        : frame(_frame), region(_region), renderTile(_renderTile), rowDone(_rowDone) {}
+
+    void Render(int workerProcesses, std::string socketPath)
+    {
+        // Renders the window with the given number of forked workers, listening on socketPath, or
+        // on a path of its own if that's empty
+        MakeTiles();
+        if ( socketPath.empty() ) socketPath = "/tmp/rtweekend-" + std::to_string(getpid()) + ".sock";
+
+        int listener = LocalSocket::Listen(socketPath);
+        if ( listener < 0 ) {
+            std::cerr << "ERROR: Could not listen on '" << socketPath << "', rendering locally.\n";
+            RenderRemaining();
+            return;
+        }
+
+        // Buffered output would otherwise be flushed again by every child
+        std::cout << std::flush;
+        std::clog << std::flush;
+        std::vector<pid_t> children;
+        for ( int w = 0; w < workerProcesses; w++ ) {
+            pid_t pid = fork();
+            if ( pid == 0 ) {
+                close(listener);
+                _exit(Serve(socketPath, frame, renderTile) ? 0 : 1);
+            }
+            if ( pid > 0 ) children.push_back(pid);
+        }
+
+        Coordinate(listener, children);
+
+        for ( auto &worker : workers ) {
+            Tile stop = {-1, -1, -1, -1};
+            LocalSocket::SendAll(worker.fd, &stop, sizeof(stop));
+            close(worker.fd);
+        }
+        workers.clear();
+        close(listener);
+        unlink(socketPath.c_str());
+
+        // Workers still on a duplicate tile would only finish it to have it thrown away, and a
+        // stopped or hung one wouldn't act on anything gentler
+        for ( auto pid : children ) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    static bool Serve(const std::string &socketPath, FrameBuffer &frame, const RenderTile &renderTile)
+    {
+        // Runs a worker: renders tiles as the coordinator on socketPath hands them out, until
+        // it says to stop. Returns false if the connection fails.
+        int fd = LocalSocket::Connect(socketPath);
+        if ( fd < 0 ) return false;
+
+        bool ok = true;
+        Tile tile;
+        std::vector<char> message;
+        while ( LocalSocket::ReceiveAll(fd, &tile, sizeof(tile)) && tile.x0 >= 0 ) {
+            renderTile(tile);
+            message.resize(sizeof(Tile) + MessageSize(frame, tile));
+            std::memcpy(message.data(), &tile, sizeof(Tile));
+            CopyTile(frame, tile, message.data() + sizeof(Tile), true);
+            if ( !LocalSocket::SendAll(fd, message.data(), message.size()) ) {
+                ok = false;
+                break;
+            }
+        }
+        close(fd);
+        return ok;
+    }
+
+private:
+    struct Worker
+    {
+        int fd;
+        int tile = -1; // Index of the tile being rendered, or -1 if idle
+        std::vector<char> message;
+        size_t received = 0;
+    };
+
+    FrameBuffer &frame;
+    PixelRect region; // Part of the frame to render
+    RenderTile renderTile;
+    RowDone rowDone;
+
+    std::vector<Tile> tiles;
+    std::vector<bool> done;
+    std::vector<int> copies;                                     // Copies of each tile out with workers
+    std::vector<std::chrono::steady_clock::time_point> sentTime; // When each tile was first handed out
+    std::deque<int> pending;
+    std::vector<int> rowTilesLeft;
+    size_t tilesLeft = 0;
+    std::vector<Worker> workers;
+
+    void MakeTiles()
+    {
+        for ( int y = region.y0; y < region.y1; y += tileSize ) {
+            for ( int x = region.x0; x < region.x1; x += tileSize ) {
+                tiles.push_back({x, y, std::min(x + tileSize, region.x1), std::min(y + tileSize, region.y1)});
+            }
+        }
+        done.assign(tiles.size(), false);
+        copies.assign(tiles.size(), 0);
+        sentTime.resize(tiles.size());
+        for ( size_t t = 0; t < tiles.size(); t++ ) pending.push_back(int(t));
+        rowTilesLeft.assign(frame.height, (region.Width() + tileSize - 1) / tileSize);
+        tilesLeft = tiles.size();
+    }
+
+    static size_t MessageSize(const FrameBuffer &frame, const Tile &tile)
+    {
+        size_t channels = 0;
+        for ( const auto &pass : frame.passes ) channels += pass.Channels();
+        return size_t(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * channels * sizeof(float);
+    }
+
+    static void CopyTile(FrameBuffer &frame, const Tile &tile, char *message, bool fromFrame)
+    {
+        // Copies the tile's rows of every pass, in order, between the frame and a message
+        for ( auto &pass : frame.passes ) {
+            auto rowBytes = size_t(tile.x1 - tile.x0) * pass.Channels() * sizeof(float);
+            for ( int y = tile.y0; y < tile.y1; y++ ) {
+                auto pixels = reinterpret_cast<char *>(pass.Pixel(tile.x0, y));
+                if ( fromFrame ) {
+                    std::memcpy(message, pixels, rowBytes);
+                } else {
+                    std::memcpy(pixels, message, rowBytes);
+                }
+                message += rowBytes;
+            }
+        }
+    }
+
+    void Finish(int t)
+    {
+        done[t] = true;
+        tilesLeft--;
+        std::clog << "\rTiles remaining: " << tilesLeft << " " << std::flush;
+        for ( int y = tiles[t].y0; y < tiles[t].y1; y++ ) {
+            if ( --rowTilesLeft[y] == 0 && rowDone ) rowDone(y);
+        }
+    }
+
+    int NextTile() const
+    {
+        // The next queued tile, or else a second copy of the one out the longest
+        if ( !pending.empty() ) return pending.front();
+        int oldest = -1;
+        for ( size_t t = 0; t < tiles.size(); t++ ) {
+            if ( done[t] || copies[t] != 1 ) continue;
+            if ( oldest < 0 || sentTime[t] < sentTime[oldest] ) oldest = int(t);
+        }
+        return oldest;
+    }
+
+    bool Assign(Worker &worker)
+    {
+        int t = NextTile();
+        if ( t < 0 ) return true;
+        if ( !LocalSocket::SendAll(worker.fd, &tiles[t], sizeof(Tile)) ) return false;
+
+        if ( !pending.empty() && pending.front() == t ) {
+            pending.pop_front();
+            sentTime[t] = std::chrono::steady_clock::now();
+        }
+        copies[t]++;
+        worker.tile = t;
+        worker.message.resize(sizeof(Tile) + MessageSize(frame, tiles[t]));
+        worker.received = 0;
+        return true;
+    }
+
+    void Drop(size_t w)
+    {
+        auto &worker = workers[w];
+        int t = worker.tile;
+        if ( t >= 0 ) {
+            copies[t]--;
+            if ( !done[t] && copies[t] == 0 ) pending.push_front(t);
+        }
+        close(worker.fd);
+        workers.erase(workers.begin() + w);
+    }
+
+    bool Receive(Worker &worker)
+    {
+        // Reads what has arrived of the worker's tile, merging it once complete. Returns false
+        // if the worker has gone.
+        if ( worker.tile < 0 ) return false;
+        auto received = recv(worker.fd, worker.message.data() + worker.received,
+                             worker.message.size() - worker.received, MSG_DONTWAIT);
+        if ( received < 0 ) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if ( received == 0 ) return false;
+
+        worker.received += size_t(received);
+        if ( worker.received < worker.message.size() ) return true;
+
+        int t = worker.tile;
+        copies[t]--;
+        worker.tile = -1;
+        if ( !done[t] ) {
+            CopyTile(frame, tiles[t], worker.message.data() + sizeof(Tile), false);
+            Finish(t);
+        }
+        return true;
+    }
+
+    void Coordinate(int listener, std::vector<pid_t> &children)
+    {
+        // Hands out tiles and merges results until the frame is done. Children that exit are
+        // removed from children.
+        std::vector<pollfd> polls;
+
+        while ( tilesLeft > 0 ) {
+            for ( size_t w = 0; w < workers.size(); ) {
+                if ( workers[w].tile < 0 && !Assign(workers[w]) ) {
+                    Drop(w);
+                } else {
+                    w++;
+                }
+            }
+
+            // With no workers connected and no children left to connect, finish the frame here
+            if ( workers.empty() ) {
+                std::erase_if(children, [](pid_t pid) { return waitpid(pid, nullptr, WNOHANG) != 0; });
+                if ( children.empty() ) {
+                    std::cerr << "ERROR: No workers left, rendering the remaining tiles locally.\n";
+                    RenderRemaining();
+                    return;
+                }
+            }
+
+            polls.assign(1, {listener, POLLIN, 0});
+            for ( const auto &worker : workers ) polls.push_back({worker.fd, POLLIN, 0});
+            if ( poll(polls.data(), polls.size(), 100) <= 0 ) continue;
+
+            for ( size_t p = polls.size() - 1; p > 0; p-- ) {
+                if ( polls[p].revents && !Receive(workers[p - 1]) ) Drop(p - 1);
+            }
+            if ( polls[0].revents & POLLIN ) {
+                int fd = accept(listener, nullptr, nullptr);
+                if ( fd >= 0 ) workers.push_back(Worker{fd, -1, {}, 0});
+            }
+        }
+    }
+
+    void RenderRemaining()
+    {
+        for ( size_t t = 0; t < tiles.size(); t++ ) {
+            if ( done[t] ) continue;
+            renderTile(tiles[t]);
+            Finish(int(t));
+        }
+    }
+};
+
+#endif
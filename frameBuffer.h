@@ -0,0 +1,132 @@
+#ifndef FRAME_BUFFER_H
+#define FRAME_BUFFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "colour.h"
+
+struct PixelRect
+{
+    // Pixels [x0, x1) by [y0, y1) of a frame. Plain data, so it can be sent between processes.
+    int32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    int Width() const { return x1 - x0; }
+
+    int Height() const { return y1 - y0; }
+
+    bool Empty() const { return x1 <= x0 || y1 <= y0; }
+
+    bool Contains(int x, int y) const { return x >= x0 && x < x1 && y >= y0 && y < y1; }
+
+    PixelRect Clamped(int width, int height) const
+    {
+        // The part of the rectangle inside a frame of the given size
+        return {std::clamp(x0, 0, width), std::clamp(y0, 0, height), std::clamp(x1, 0, width), std::clamp(y1, 0, height)};
+    }
+
+    bool operator==(const PixelRect &) const = default;
+};
+
+class FrameBuffer
+{
+    // The linear floating point output of a render, as a set of named passes of equal size. The
+    // beauty pass holds the rendered colour; any others are arbitrary output variables (AOVs).
+    // Each pass stores its channels interleaved, rows top to bottom.
+
+public:
+    class Pass
+    {
+    public:
+        std::string name;                  // "beauty" for the rendered colour, otherwise the AOV's name
+        std::vector<std::string> channels; // Channel names in storage order, e.g. R, G, B
+        int width, height;
+        std::vector<float> data;
+
+        Pass(const std::string &_name, const std::vector<std::string> &_channels, int _width, int _height)
+            : name(_name), channels(_channels), width(_width), height(_height),
+              data(size_t(_width) * _height * _channels.size(), 0.0f) {}
+
+        int Channels() const { return int(channels.size()); }
+
+        float *Pixel(int x, int y) { return &data[(size_t(y) * width + x) * channels.size()]; }
+
+        const float *Pixel(int x, int y) const { return &data[(size_t(y) * width + x) * channels.size()]; }
+
+        const float *Row(int y) const { return Pixel(0, y); }
+
+        void Set(int x, int y, const Colour &colour)
+        {
+            auto pixel = Pixel(x, y);
+            for ( int c = 0; c < Channels() && c < 3; c++ ) pixel[c] = float(colour[c]);
+        }
+
+        Colour Get(int x, int y) const
+        {
+            auto pixel = Pixel(x, y);
+            Colour colour;
+            for ( int c = 0; c < Channels() && c < 3; c++ ) colour[c] = pixel[c];
+            return colour;
+        }
+    };
+
+    int width = 0;
+    int height = 0;
+    std::deque<Pass> passes; // Adding a pass leaves references to the others valid
+
+    FrameBuffer() {}
+
+    // Frame with a beauty pass of the given size
+    FrameBuffer(int _width, int _height) : width(_width), height(_height)
+    {
+        AddPass("beauty", {"R", "G", "B"});
+    }
+
+    Pass &AddPass(const std::string &name, const std::vector<std::string> &channels)
+    {
+        // Adds a pass, or returns the existing one of that name
+        if ( auto pass = Find(name) ) return *pass;
+        passes.emplace_back(name, channels, width, height);
+        return passes.back();
+    }
+
+    Pass *Find(const std::string &name)
+    {
+        for ( auto &pass : passes ) {
+            if ( pass.name == name ) return &pass;
+        }
+        return nullptr;
+    }
+
+    const Pass *Find(const std::string &name) const
+    {
+        for ( const auto &pass : passes ) {
+            if ( pass.name == name ) return &pass;
+        }
+        return nullptr;
+    }
+
+    Pass &Beauty() { return passes.front(); }
+
+    const Pass &Beauty() const { return passes.front(); }
+
+    FrameBuffer Crop(const PixelRect &rect) const
+    {
+        // Copy of the pixels of every pass inside rect, which must lie within the frame
+        FrameBuffer cropped(rect.Width(), rect.Height());
+        for ( const auto &pass : passes ) {
+            auto &croppedPass = cropped.AddPass(pass.name, pass.channels);
+            if ( rect.Empty() ) continue;
+            for ( int y = rect.y0; y < rect.y1; y++ ) {
+                auto row = pass.Pixel(rect.x0, y);
+                std::copy(row, row + size_t(rect.Width()) * pass.Channels(), croppedPass.Pixel(0, y - rect.y0));
+            }
+        }
+        return cropped;
+    }
+};
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "constantMedium.h"
+#include "hitable.h"
+#include "material.h"
+#include "quad.h"
+
+class DensityGrid
+{
+    // A sparse voxel density grid stored as 8x8x8 bricks. Only bricks holding non-zero voxels are
+    // allocated; the rest of the volume costs one index and one majorant per brick, 1/256th of a
+    // dense float grid. Each brick's majorant bounds every density a trilinear lookup inside it
+    // can return, so media can take free flights brick by brick and skip empty ones outright.
+    // Regions of 4x4x4 bricks carry a second, coarser level of majorants, the largest of their
+    // bricks', so long runs of empty space are crossed a region at a time.
+    //
+    // Binary format (little endian), as written by Save:
+    //   char[8] "RTWGRID1", int32 nx ny nz (voxels), float64 min xyz, float64 max xyz (bounds),
+    //   uint32 brick count, then per brick: int32 brick coordinates, float32[512] densities
+    //   (x fastest, then y, then z).
+
+public:
+    static const int brickSize = 8; // Voxels along each side of a brick
+    static const int brickVoxels = brickSize * brickSize * brickSize;
+    static const int regionSize = 4; // Bricks along each side of a region
+
+private:
+    int voxelCount[3] = {0, 0, 0};
+    int brickCount[3] = {0, 0, 0};
+    int regionCount[3] = {0, 0, 0};
+    AABB bounds;
+    Vec3 voxelExtent; // World size of one voxel along each axis
+
+    std::vector<int32_t> brickIndices; // Per brick, the offset into voxels / brickVoxels, -1 if empty
+    std::vector<float> brickMajorants; // Per brick, bounds the interpolated density inside it
+    std::vector<float> regionMajorants; // Per region, the largest majorant of its bricks
+    std::vector<float> voxels;         // Allocated bricks, brickVoxels floats each
+
+    int BrickIndex(int bi, int bj, int bk) const
+    {
+        return (bk * brickCount[1] + bj) * brickCount[0] + bi;
+    }
+
+    int RegionIndex(int ri, int rj, int rk) const
+    {
+        return (rk * regionCount[1] + rj) * regionCount[0] + ri;
+    }
+
+    void Initialise(int nx, int ny, int nz, const AABB &gridBounds)
+    {
+        voxelCount[0] = nx, voxelCount[1] = ny, voxelCount[2] = nz;
+        for ( int a = 0; a < 3; a++ ) {
+            brickCount[a] = (voxelCount[a] + brickSize - 1) / brickSize;
+            regionCount[a] = (brickCount[a] + regionSize - 1) / regionSize;
+        }
+        bounds = gridBounds;
+        voxelExtent = Vec3(bounds.x.Size() / nx, bounds.y.Size() / ny, bounds.z.Size() / nz);
+
+        auto bricks = size_t(brickCount[0]) * brickCount[1] * brickCount[2];
+        brickIndices.assign(bricks, -1);
+        brickMajorants.assign(bricks, 0.0f);
+        regionMajorants.assign(size_t(regionCount[0]) * regionCount[1] * regionCount[2], 0.0f);
+        voxels.clear();
+    }
+
+    int32_t AllocateBrick(int bi, int bj, int bk)
+    {
+        auto &index = brickIndices[BrickIndex(bi, bj, bk)];
+        if ( index < 0 ) {
+            index = int32_t(voxels.size() / brickVoxels);
+            voxels.resize(voxels.size() + brickVoxels, 0.0f);
+        }
+        return index;
+    }
+
+    void RaiseMajorants(int bi, int bj, int bk, float density)
+    {
+        // A trilinear lookup reaches one voxel into the neighbouring bricks, so a voxel bounds
+        // the lookups in its own brick and every brick around it
+        for ( int k = std::max(bk - 1, 0); k <= std::min(bk + 1, brickCount[2] - 1); k++ ) {
+            for ( int j = std::max(bj - 1, 0); j <= std::min(bj + 1, brickCount[1] - 1); j++ ) {
+                for ( int i = std::max(bi - 1, 0); i <= std::min(bi + 1, brickCount[0] - 1); i++ ) {
+                    auto &majorant = brickMajorants[BrickIndex(i, j, k)];
+                    majorant = std::max(majorant, density);
+                    auto &regionMajorant = regionMajorants[RegionIndex(i / regionSize, j / regionSize, k / regionSize)];
+                    regionMajorant = std::max(regionMajorant, density);
+                }
+            }
+        }
+    }
+
+public:
+    DensityGrid() {}
+
+    // Empty grid of nx*ny*nz voxels spanning gridBounds
+    DensityGrid(int nx, int ny, int nz, const AABB &gridBounds)
+    {
+        Initialise(nx, ny, nz, gridBounds);
+    }
+
+    DensityGrid(const char *filename)
+    {
+        // Loads a grid from the given file, searching the same asset directories as RTWImage.
+        // If the file can't be read, the grid is left empty.
+        auto name = std::string(filename);
+        if ( Load(name) ) return;
+        if ( Load("Assets/" + name) ) return;
+        if ( Load("../Assets/" + name) ) return;
+        if ( Load("../../Assets/" + name) ) return;
+        if ( Load("../../../Assets/" + name) ) return;
+
+        std::cerr << "ERROR: Could not load density grid '" << filename << "'.\n";
+    }
+
+    bool Load(const std::string &filename)
+    {
+        // Loads the grid from the given file. Returns true if load succeeded
+        std::ifstream file(filename, std::ios::binary);
+        if ( !file ) return false;
+
+        char magic[8];
+        int32_t n[3];
+        double extents[6];
+        uint32_t bricks;
+        file.read(magic, sizeof(magic));
+        file.read(reinterpret_cast<char *>(n), sizeof(n));
+        file.read(reinterpret_cast<char *>(extents), sizeof(extents));
+        file.read(reinterpret_cast<char *>(&bricks), sizeof(bricks));
+        if ( !file || std::memcmp(magic, "RTWGRID1", 8) != 0 || n[0] <= 0 || n[1] <= 0 || n[2] <= 0 ) return false;
+
+        Initialise(n[0], n[1], n[2], AABB(Point3(extents[0], extents[1], extents[2]), Point3(extents[3], extents[4], extents[5])));
+
+        for ( uint32_t b = 0; b < bricks; b++ ) {
+            int32_t coordinates[3];
+            float values[brickVoxels];
+            file.read(reinterpret_cast<char *>(coordinates), sizeof(coordinates));
+            file.read(reinterpret_cast<char *>(values), sizeof(values));
+            if ( !file ) return false;
+
+            for ( int a = 0; a < 3; a++ ) {
+                if ( coordinates[a] < 0 || coordinates[a] >= brickCount[a] ) return false;
+            }
+
+            auto index = AllocateBrick(coordinates[0], coordinates[1], coordinates[2]);
+            std::memcpy(&voxels[size_t(index) * brickVoxels], values, sizeof(values));
+
+            float brickMaximum = 0;
+            for ( float value : values ) {
+                brickMaximum = std::max(brickMaximum, value);
+            }
+            RaiseMajorants(coordinates[0], coordinates[1], coordinates[2], brickMaximum);
+        }
+
+        return true;
+    }
+
+    bool Save(const std::string &filename) const
+    {
+        // Writes the allocated bricks in the format Load reads. Returns true if save succeeded
+        std::ofstream file(filename, std::ios::binary);
+        if ( !file ) return false;
+
+        int32_t n[3] = {voxelCount[0], voxelCount[1], voxelCount[2]};
+        double extents[6] = {bounds.x.min, bounds.y.min, bounds.z.min, bounds.x.max, bounds.y.max, bounds.z.max};
+        uint32_t bricks = uint32_t(voxels.size() / brickVoxels);
+        file.write("RTWGRID1", 8);
+        file.write(reinterpret_cast<const char *>(n), sizeof(n));
+        file.write(reinterpret_cast<const char *>(extents), sizeof(extents));
+        file.write(reinterpret_cast<const char *>(&bricks), sizeof(bricks));
+
+        for ( int bk = 0; bk < brickCount[2]; bk++ ) {
+            for ( int bj = 0; bj < brickCount[1]; bj++ ) {
+                for ( int bi = 0; bi < brickCount[0]; bi++ ) {
+                    auto index = brickIndices[BrickIndex(bi, bj, bk)];
+                    if ( index < 0 ) continue;
+
+                    int32_t coordinates[3] = {bi, bj, bk};
+                    file.write(reinterpret_cast<const char *>(coordinates), sizeof(coordinates));
+                    file.write(reinterpret_cast<const char *>(&voxels[size_t(index) * brickVoxels]), brickVoxels * sizeof(float));
+                }
+            }
+        }
+
+        return bool(file);
+    }
+
+    void Set(int i, int j, int k, float density)
+    {
+        // Sets one voxel, allocating its brick when the density is non-zero
+        if ( i < 0 || j < 0 || k < 0 || i >= voxelCount[0] || j >= voxelCount[1] || k >= voxelCount[2] ) return;
+
+        int bi = i / brickSize, bj = j / brickSize, bk = k / brickSize;
+        auto index = brickIndices[BrickIndex(bi, bj, bk)];
+        if ( index < 0 ) {
+            if ( density == 0 ) return;
+            index = AllocateBrick(bi, bj, bk);
+        }
+
+        voxels[size_t(index) * brickVoxels + ((k % brickSize) * brickSize + (j % brickSize)) * brickSize + (i % brickSize)] = density;
+        RaiseMajorants(bi, bj, bk, density);
+    }
+
+    float Voxel(int i, int j, int k) const
+    {
+        // Density of one voxel, zero outside the grid and in unallocated bricks
+        if ( i < 0 || j < 0 || k < 0 || i >= voxelCount[0] || j >= voxelCount[1] || k >= voxelCount[2] ) return 0;
+
+        auto index = brickIndices[BrickIndex(i / brickSize, j / brickSize, k / brickSize)];
+        if ( index < 0 ) return 0;
+
+        return voxels[size_t(index) * brickVoxels + ((k % brickSize) * brickSize + (j % brickSize)) * brickSize + (i % brickSize)];
+    }
+
+    double Lookup(const Point3 &p) const
+    {
+        // Trilinearly interpolated density at p, with voxel values at the voxel centres
+        double x = (p.X() - bounds.x.min) / voxelExtent.X() - 0.5;
+        double y = (p.Y() - bounds.y.min) / voxelExtent.Y() - 0.5;
+        double z = (p.Z() - bounds.z.min) / voxelExtent.Z() - 0.5;
+        int i = int(std::floor(x)), j = int(std::floor(y)), k = int(std::floor(z));
+        double fx = x - i, fy = y - j, fz = z - k;
+
+        auto Lerp = [](double a, double b, double t) { return a + t * (b - a); };
+        auto c00 = Lerp(Voxel(i, j, k), Voxel(i + 1, j, k), fx);
+        auto c10 = Lerp(Voxel(i, j + 1, k), Voxel(i + 1, j + 1, k), fx);
+        auto c01 = Lerp(Voxel(i, j, k + 1), Voxel(i + 1, j, k + 1), fx);
+        auto c11 = Lerp(Voxel(i, j + 1, k + 1), Voxel(i + 1, j + 1, k + 1), fx);
+
+        return Lerp(Lerp(c00, c10, fy), Lerp(c01, c11, fy), fz);
+    }
+
+    const AABB &Bounds() const { return bounds; }
+
+    int BrickCount(int axis) const { return brickCount[axis]; }
+
+    Vec3 BrickExtent() const { return brickSize * voxelExtent; }
+
+    double BrickMajorant(int bi, int bj, int bk) const { return brickMajorants[BrickIndex(bi, bj, bk)]; }
+
+    int RegionCount(int axis) const { return regionCount[axis]; }
+
+    Vec3 RegionExtent() const { return regionSize * BrickExtent(); }
+
+    double RegionMajorant(int ri, int rj, int rk) const { return regionMajorants[RegionIndex(ri, rj, rk)]; }
+
+    double Majorant() const
+    {
+        float maximum = 0;
+        for ( float majorant : regionMajorants ) {
+            maximum = std::max(maximum, majorant);
+        }
+        return maximum;
+    }
+
+    size_t AllocatedBricks() const { return voxels.size() / brickVoxels; }
+};
+
+class GridMedium : public ConstantMedium
+{
+    // A heterogeneous medium whose density comes from a sparse DensityGrid, scaled by
+    // densityScale. Hit walks the grid's regions with a 3D DDA, skipping empty ones, and within
+    // the rest walks the bricks, delta tracking inside each against that brick's own majorant, so
+    // empty space costs next to nothing and thin bricks take long free flights. The inherited
+    // ConstantMedium::Hit, tracking against the global majorant, gives the same distribution more
+    // slowly.
+
+private:
+    shared_ptr<DensityGrid> grid;
+    double densityScale;
+
+protected:
+    double Density(const Point3 &p) const override { return densityScale * grid->Lookup(p); }
+
+public:
+    GridMedium(shared_ptr<DensityGrid> g, double scale, Colour c)
+        : GridMedium(g, scale, make_shared<Isotropic>(c)) {}
+
+    GridMedium(shared_ptr<DensityGrid> g, double scale, shared_ptr<Material> phase)
+        : ConstantMedium(make_shared<AxisAlignedBox>(Point3(g->Bounds().x.min, g->Bounds().y.min, g->Bounds().z.min),
+                                                     Point3(g->Bounds().x.max, g->Bounds().y.max, g->Bounds().z.max), nullptr),
+                         scale * g->Majorant(), phase),
+          grid(g), densityScale(scale) {}
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
+    {
+        Interval span;
+        if ( !boundary->Span(ray, span) ) return false;
+
+        if ( span.min < rayT.min ) span.min = rayT.min;
+        if ( span.max > rayT.max ) span.max = rayT.max;
+        if ( span.min >= span.max ) return false;
+
+        // Walk the regions, descending into the bricks of those with anything in them
+        const int first[3] = {0, 0, 0};
+        const int last[3] = {grid->RegionCount(0) - 1, grid->RegionCount(1) - 1, grid->RegionCount(2) - 1};
+        GridWalk regions(ray, span.min, grid->RegionExtent(), grid->Bounds(), first, last);
+        auto t = span.min;
+        while ( true ) {
+            int axis = regions.Axis();
+            auto regionEnd = std::fmin(regions.tNext[axis], span.max);
+            if ( grid->RegionMajorant(regions.cell[0], regions.cell[1], regions.cell[2]) > 0 &&
+                 TrackBricks(ray, regions.cell, t, regionEnd, record) ) {
+                return true;
+            }
+
+            t = regionEnd;
+            if ( t >= span.max || !regions.Step(axis, first, last) ) return false;
+        }
+    }
+
+private:
+    struct GridWalk
+    {
+        // 3D DDA over the cells of a grid aligned with the density grid's bounds, from the cell
+        // holding the ray's point at t, limited to cells first to last
+        int cell[3], step[3];
+        double tNext[3], tDelta[3];
+
+        GridWalk(const Ray &ray, double t, const Vec3 &cellExtent, const AABB &bounds, const int first[3], const int last[3])
+        {
+            auto entry = ray.At(t);
+            const auto origin = ray.Origin();
+            const auto direction = ray.Direction();
+            for ( int a = 0; a < 3; a++ ) {
+                cell[a] = int(std::floor((entry[a] - bounds.Axis(a).min) / cellExtent[a]));
+                cell[a] = std::clamp(cell[a], first[a], last[a]);
+
+                if ( direction[a] > 0 ) {
+                    step[a] = 1;
+                    tNext[a] = (bounds.Axis(a).min + (cell[a] + 1) * cellExtent[a] - origin[a]) / direction[a];
+                    tDelta[a] = cellExtent[a] / direction[a];
+                } else if ( direction[a] < 0 ) {
+                    step[a] = -1;
+                    tNext[a] = (bounds.Axis(a).min + cell[a] * cellExtent[a] - origin[a]) / direction[a];
+                    tDelta[a] = -cellExtent[a] / direction[a];
+                } else {
+                    step[a] = 0;
+                    tNext[a] = maxDouble;
+                    tDelta[a] = maxDouble;
+                }
+            }
+        }
+
+        // Axis whose cell boundary the ray crosses next
+        int Axis() const { return (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2); }
+
+        bool Step(int axis, const int first[3], const int last[3])
+        {
+            // Moves to the next cell along axis. Returns false on leaving the cells
+            cell[axis] += step[axis];
+            if ( cell[axis] < first[axis] || cell[axis] > last[axis] ) return false;
+            tNext[axis] += tDelta[axis];
+            return true;
+        }
+    };
+
+    bool TrackBricks(const Ray &ray, const int region[3], double t, double end, HitRecord &record) const
+    {
+        // Delta tracks from t to end through the bricks of a region, restarting at each brick
+        // with its majorant, as free flights are memoryless. Returns true on a collision.
+        int first[3], last[3];
+        for ( int a = 0; a < 3; a++ ) {
+            first[a] = region[a] * DensityGrid::regionSize;
+            last[a] = std::min(first[a] + DensityGrid::regionSize, grid->BrickCount(a)) - 1;
+        }
+        GridWalk bricks(ray, t, grid->BrickExtent(), grid->Bounds(), first, last);
+        const auto rayLength = ray.Direction().Length();
+
+        while ( true ) {
+            int axis = bricks.Axis();
+            auto segmentEnd = std::fmin(bricks.tNext[axis], end);
+
+            auto majorant = densityScale * grid->BrickMajorant(bricks.cell[0], bricks.cell[1], bricks.cell[2]);
+            if ( majorant > 0 ) {
+                auto negativeInverseMajorant = -1 / (majorant * rayLength);
+                while ( true ) {
+                    t += negativeInverseMajorant * log(RandomDouble());
+                    if ( t >= segmentEnd ) break;
+
+                    auto point = ray.At(t);
+                    auto density = Density(point);
+                    if ( density >= majorant || RandomDouble() * majorant < density ) {
+                        record.t = t;
+                        record.point = point;
+                        record.pointError = 0;
+                        record.normal = Vec3(1, 0, 0); // Arbitrary
+                        record.frontFace = true;
+                        record.material = phaseFunction;
+                        record.SetSurfaceDerivatives(Vec3(), Vec3());
+                        record.velocity = Vec3();
+                        return true;
+                    }
+                }
+            }
+
+            t = segmentEnd;
+            if ( t >= end || !bricks.Step(axis, first, last) ) return false;
+        }
+    }
+};
+
+#endif
@@ -1,10 +1,51 @@
 #ifndef HITABLE_H
 #define HITABLE_H
 
+#include <vector>
+
 #include "aabb.h"
 #include "rtweekend.h"
 
 class Material;
+class Hitable;
+
+class LightCollection
+{
+    // Light sources gathered from a scene graph by Hitable::CollectLights. Instances come back
+    // already wrapped in their transforms, so each entry can be sampled in world space.
+public:
+    std::vector<shared_ptr<Hitable>> emitters;
+    std::vector<double> powers; // Estimated emitted power of each emitter
+
+    std::vector<shared_ptr<Hitable>> importanceSampled; // Tagged non-emissive objects, e.g. glass for caustics
+    std::vector<double> weights;                        // Sampling weight of each tagged object
+
+    void AddEmitter(shared_ptr<Hitable> emitter, double power)
+    {
+        if ( !emitter || power <= 0 ) return;
+        emitters.push_back(emitter);
+        powers.push_back(power);
+    }
+
+    void AddImportanceSampled(shared_ptr<Hitable> object, double weight)
+    {
+        if ( !object || weight <= 0 ) return;
+        importanceSampled.push_back(object);
+        weights.push_back(weight);
+    }
+
+    template <typename Wrap>
+    void Append(const LightCollection &other, Wrap wrap)
+    {
+        // Adds every light in other, passed through wrap (e.g. to place it inside a transform)
+        for ( size_t i = 0; i < other.emitters.size(); i++ ) {
+            AddEmitter(wrap(other.emitters[i]), other.powers[i]);
+        }
+        for ( size_t i = 0; i < other.importanceSampled.size(); i++ ) {
+            AddImportanceSampled(wrap(other.importanceSampled[i]), other.weights[i]);
+        }
+    }
+};
 
 class HitRecord
 {
@@ -12,11 +53,23 @@ public:
     Point3 point;
     Vec3 normal;
     shared_ptr<Material> material;
-    double t;
+    Real t;
     double u;
     double v;
     bool frontFace;
 
+    Vec3 dpdu, dpdv; // Change in point with the surface coordinates
+    Vec3 dndu, dndv; // Change in normal with the surface coordinates
+
+    Vec3 dpdx, dpdy;                                  // Change in point to the neighbouring pixels
+    double dudx = 0, dvdx = 0, dudy = 0, dvdy = 0; // Change in surface coordinates likewise
+
+    Vec3 velocity; // Displacement of the surface point over the whole shutter interval
+
+    // Relative rounding error of a computed hit point, in units of its coordinates' magnitude
+    static constexpr Real errorScale = 64 * std::numeric_limits<Real>::epsilon();
+    Real pointError = 0; // Bound on the point's distance off the surface, if larger than the default
+
     void SetFaceNormal(const Ray &ray, const Vec3 &outwardNormal)
     {
         // Sets the hit record normal normal vector
@@ -25,6 +78,123 @@ public:
         frontFace = Dot(ray.Direction(), outwardNormal) < 0;
         normal = frontFace ? outwardNormal : -outwardNormal;
     }
+
+    void SetSurfaceDerivatives(const Vec3 &_dpdu, const Vec3 &_dpdv, const Vec3 &_dndu = Vec3(), const Vec3 &_dndv = Vec3())
+    {
+        // Sets the surface derivatives, given for the outward normal. Call after SetFaceNormal.
+        dpdu = _dpdu;
+        dpdv = _dpdv;
+        dndu = frontFace ? _dndu : -_dndu;
+        dndv = frontFace ? _dndv : -_dndv;
+    }
+
+    void ComputeDifferentials(const Ray &ray)
+    {
+        // Intersects the ray's differentials with the tangent plane at the hit point, then solves
+        // for the matching changes in (u, v). Without differentials everything is zero.
+        dpdx = dpdy = Vec3();
+        dudx = dvdx = dudy = dvdy = 0;
+        if ( !ray.differentials ) return;
+        const auto &differentials = *ray.differentials;
+
+        auto d = Dot(normal, point);
+        auto denominatorX = Dot(normal, differentials.rxDirection);
+        auto denominatorY = Dot(normal, differentials.ryDirection);
+        if ( denominatorX == 0 || denominatorY == 0 ) return;
+
+        auto tx = (d - Dot(normal, differentials.rxOrigin)) / denominatorX;
+        auto ty = (d - Dot(normal, differentials.ryOrigin)) / denominatorY;
+        dpdx = differentials.rxOrigin + tx * differentials.rxDirection - point;
+        dpdy = differentials.ryOrigin + ty * differentials.ryDirection - point;
+
+        // Least squares over the two axes the normal is least aligned with
+        int dim0 = 0, dim1 = 1;
+        if ( fabs(normal.X()) > fabs(normal.Y()) && fabs(normal.X()) > fabs(normal.Z()) ) {
+            dim0 = 1, dim1 = 2;
+        } else if ( fabs(normal.Y()) > fabs(normal.Z()) ) {
+            dim0 = 0, dim1 = 2;
+        }
+
+        auto determinant = dpdu[dim0] * dpdv[dim1] - dpdv[dim0] * dpdu[dim1];
+        if ( fabs(determinant) < 1e-12 ) return;
+
+        dudx = (dpdv[dim1] * dpdx[dim0] - dpdv[dim0] * dpdx[dim1]) / determinant;
+        dvdx = (dpdu[dim0] * dpdx[dim1] - dpdu[dim1] * dpdx[dim0]) / determinant;
+        dudy = (dpdv[dim1] * dpdy[dim0] - dpdv[dim0] * dpdy[dim1]) / determinant;
+        dvdy = (dpdu[dim0] * dpdy[dim1] - dpdu[dim1] * dpdy[dim0]) / determinant;
+    }
+
+    double UVFootprint() const
+    {
+        // Width of the pixel footprint in surface coordinates
+        return fmax(fmax(fabs(dudx), fabs(dvdx)), fmax(fabs(dudy), fabs(dvdy)));
+    }
+
+    double PointFootprint() const
+    {
+        // Width of the pixel footprint in world space
+        return fmax(dpdx.Length(), dpdy.Length());
+    }
+
+    void ReflectDifferentials(const Ray &rayIn, Ray &reflected) const
+    {
+        // Gives a mirror-reflected ray the differentials of rayIn reflected about the surface,
+        // accounting for the change in normal across the footprint
+        if ( !rayIn.differentials ) return;
+
+        auto wo = -UnitVector(rayIn.Direction());
+        auto wi = UnitVector(reflected.Direction());
+        auto dndx = dndu * dudx + dndv * dvdx;
+        auto dndy = dndu * dudy + dndv * dvdy;
+        auto dwodx = -UnitVector(rayIn.differentials->rxDirection) - wo;
+        auto dwody = -UnitVector(rayIn.differentials->ryDirection) - wo;
+        auto dDNdx = Dot(dwodx, normal) + Dot(wo, dndx);
+        auto dDNdy = Dot(dwody, normal) + Dot(wo, dndy);
+        auto cosine = Dot(wo, normal);
+
+        reflected.differentials = make_shared<const RayDifferentials>(RayDifferentials{
+            reflected.Origin() + dpdx, reflected.Origin() + dpdy,
+            wi - dwodx + 2 * (cosine * dndx + dDNdx * normal), wi - dwody + 2 * (cosine * dndy + dDNdy * normal)});
+    }
+
+    void RefractDifferentials(const Ray &rayIn, Ray &refracted, double refractionRatio) const
+    {
+        // As ReflectDifferentials, for a ray refracted with the given ratio of refractive indices
+        if ( !rayIn.differentials ) return;
+
+        auto wo = -UnitVector(rayIn.Direction());
+        auto wi = UnitVector(refracted.Direction());
+        auto dndx = dndu * dudx + dndv * dvdx;
+        auto dndy = dndu * dudy + dndv * dvdy;
+        auto dwodx = -UnitVector(rayIn.differentials->rxDirection) - wo;
+        auto dwody = -UnitVector(rayIn.differentials->ryDirection) - wo;
+        auto dDNdx = Dot(dwodx, normal) + Dot(wo, dndx);
+        auto dDNdy = Dot(dwody, normal) + Dot(wo, dndy);
+
+        auto eta = refractionRatio;
+        auto cosineIn = Dot(wo, normal);
+        auto cosineOut = fabs(Dot(wi, normal));
+        auto mu = eta * cosineIn - cosineOut;
+        auto dmudx = (eta - (eta * eta * cosineIn) / cosineOut) * dDNdx;
+        auto dmudy = (eta - (eta * eta * cosineIn) / cosineOut) * dDNdy;
+
+        refracted.differentials = make_shared<const RayDifferentials>(RayDifferentials{
+            refracted.Origin() + dpdx, refracted.Origin() + dpdy,
+            wi - eta * dwodx + (mu * dndx + dmudx * normal), wi - eta * dwody + (mu * dndy + dmudy * normal)});
+    }
+
+    Point3 SpawnOrigin(const Vec3 &direction) const
+    {
+        // Returns the origin for a ray leaving the hit point in the given direction. The point is
+        // pushed off the surface, to the side the ray leaves from, by a bound on the rounding
+        // error of the intersection so the new ray can't hit the same surface again. This scales
+        // with the coordinate magnitude and precision, unlike a fixed epsilon on the ray interval.
+        // Primitives whose solvers lose more than that, such as large spheres, report their own
+        // bound in pointError.
+        auto magnitude = fmax(fabs(point.X()), fmax(fabs(point.Y()), fabs(point.Z())));
+        auto offset = fmax((magnitude + 1) * errorScale, pointError);
+        return point + ((Dot(direction, normal) > 0) ? offset : -offset) * normal;
+    }
 };
 
 class Hitable
@@ -36,9 +206,91 @@ public:
 
     virtual AABB BoundingBox() const = 0;
 
+    // Bounding boxes at the start (time=0) and end (time=1) of the shutter interval. Moving
+    // objects override these so the BVH can interpolate their bounds at the ray time instead of
+    // using the box swept over the whole interval.
+    virtual AABB StartBoundingBox() const { return BoundingBox(); }
+
+    virtual AABB EndBoundingBox() const { return BoundingBox(); }
+
     virtual double PDFValue(const Point3 &origin, const Vec3 &direction) const = 0;
 
     virtual Vec3 Random(const Point3 &origin) const = 0;
+
+    // Returns the parametric interval over which the ray's line is inside this object. Convex
+    // objects override this to find entry and exit in one query; the fallback finds the first hit
+    // along the whole line and then the next one beyond it.
+    virtual bool Span(const Ray &ray, Interval &span) const
+    {
+        HitRecord record1, record2;
+
+        if ( !Hit(ray, Interval(-maxDouble, +maxDouble), record1) ) return false;
+
+        if ( !Hit(ray, Interval(record1.t + 0.0001, maxDouble), record2) ) return false;
+
+        span = Interval(record1.t, record2.t);
+        return true;
+    }
+
+    // Appends the light sources in this object to lights. self is the pointer this object is
+    // owned through (null for an unowned root), so primitives can add themselves.
+    virtual void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const {}
+
+    // Appends the materials rays can find on this object, in a fixed order, repeats allowed
+    virtual void CollectMaterials(std::vector<const Material *> &materials) const {}
+
+    // Whether anything below this object can move between frames, so Refit has to visit it
+    virtual bool IsAnimated() const { return false; }
+
+    // Recomputes bounds cached from the objects below, after animated ones have been posed for
+    // a new frame. Only containers cache their children's bounds.
+    virtual void Refit() {}
+};
+
+class ImportanceSampled : public Hitable
+{
+    // Tags an object that doesn't emit but should still be sampled like a light, such as a glass
+    // sphere focusing caustics. Only the mixture PDF integrator uses tagged objects; shadow rays
+    // towards them would find no emission.
+
+private:
+    shared_ptr<Hitable> object;
+    double weight; // Sampling weight relative to an average emitter
+
+public:
+    ImportanceSampled(shared_ptr<Hitable> p, double w = 1.0) : object(p), weight(w) {}
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override { return object->Hit(ray, rayT, record); }
+
+    AABB BoundingBox() const override { return object->BoundingBox(); }
+
+    AABB StartBoundingBox() const override { return object->StartBoundingBox(); }
+
+    AABB EndBoundingBox() const override { return object->EndBoundingBox(); }
+
+    double PDFValue(const Point3 &origin, const Vec3 &direction) const override
+    {
+        return object->PDFValue(origin, direction);
+    }
+
+    Vec3 Random(const Point3 &origin) const override
+    {
+        return object->Random(origin);
+    }
+
+    bool Span(const Ray &ray, Interval &span) const override { return object->Span(ray, span); }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        lights.AddImportanceSampled(object, weight);
+        object->CollectLights(object, lights);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { object->CollectMaterials(materials); }
+
+    bool IsAnimated() const override { return object->IsAnimated(); }
+
+    void Refit() override { object->Refit(); }
 };
 
 class Translate : public Hitable
@@ -46,67 +298,107 @@ class Translate : public Hitable
 private:
     shared_ptr<Hitable> object;
     Vec3 offset;
+    bool isMoving;
+    Vec3 offsetVec;
     AABB boundingBox;
 
+    Vec3 Offset(double time) const
+    {
+        // Linearly interpolate from the start offset to the end offset according to time
+        return isMoving ? offset + time * offsetVec : offset;
+    }
+
 public:
+    // Stationary Translation
     Translate(shared_ptr<Hitable> p, const Vec3 &displacement)
-        : object(p), offset(displacement)
+        : object(p), offset(displacement), isMoving(false)
     {
         boundingBox = object->BoundingBox() + offset;
     }
 
+    // Moving Translation
+    Translate(shared_ptr<Hitable> p, const Vec3 &displacement1, const Vec3 &displacement2)
+        : object(p), offset(displacement1), isMoving(true), offsetVec(displacement2 - displacement1)
+    {
+        boundingBox = AABB(StartBoundingBox(), EndBoundingBox());
+    }
+
     bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
     {
+        auto currentOffset = Offset(ray.Time());
+
         // Move ray backwards by the offset
-        Ray offsetRay(ray.Origin() - offset, ray.Direction(), ray.Time());
+        Ray offsetRay(ray.Origin() - currentOffset, ray.Direction(), ray.Time());
 
         // Determine where (if any) an intersection occurs along the offset ray
         if ( !object->Hit(offsetRay, rayT, record) ) return false;
 
         // Move the intersection point forwards by the offset
-        record.point += offset;
+        record.point += currentOffset;
+        if ( isMoving ) record.velocity += offsetVec;
 
         return true;
     }
 
     AABB BoundingBox() const override { return boundingBox; }
 
+    AABB StartBoundingBox() const override { return object->StartBoundingBox() + offset; }
+
+    AABB EndBoundingBox() const override { return object->EndBoundingBox() + Offset(1); }
+
+    // Light sampling has no ray time, so these use the start position. Gathered light lists leave
+    // moving instances out, as rays at other times would miss where they aim.
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
-        return 0.0;
+        return object->PDFValue(origin - offset, direction);
     }
 
     Vec3 Random(const Point3 &origin) const override
     {
-        return Vec3(1, 0, 0);
+        return object->Random(origin - offset);
+    }
+
+    bool Span(const Ray &ray, Interval &span) const override
+    {
+        return object->Span(Ray(ray.Origin() - Offset(ray.Time()), ray.Direction(), ray.Time()), span);
+    }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        // Moving emitters are left to scattered rays to find
+        if ( isMoving ) return;
+
+        LightCollection objectLights;
+        object->CollectLights(object, objectLights);
+        lights.Append(objectLights, [this](shared_ptr<Hitable> light) -> shared_ptr<Hitable> {
+            return make_shared<Translate>(light, offset);
+        });
     }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { object->CollectMaterials(materials); }
 };
 
 class RotateY : public Hitable
 {
 private:
     shared_ptr<Hitable> object;
-    double sinTheta;
-    double cosTheta;
+    double angle;
+    Real sinTheta;
+    Real cosTheta;
     AABB boundingBox;
 
-public:
-    RotateY(shared_ptr<Hitable> p, double angle) : object(p)
+    AABB RotatedBox(const AABB &box) const
     {
-        auto radians = DegreesTooRadians(angle);
-        sinTheta = sin(radians);
-        cosTheta = cos(radians);
-        boundingBox = object->BoundingBox();
-
+        // Returns the bounding box of the given object space box once rotated into world space
         Point3 min(maxDouble, maxDouble, maxDouble);
         Point3 max(-maxDouble, -maxDouble, -maxDouble);
 
         for ( int i = 0; i < 2; i++ ) {
             for ( int j = 0; j < 2; j++ ) {
                 for ( int k = 0; k < 2; k++ ) {
-                    auto x = i * boundingBox.x.max + (1 - i) * boundingBox.x.min;
-                    auto y = j * boundingBox.y.max + (1 - j) * boundingBox.y.min;
-                    auto z = k * boundingBox.z.max + (1 - k) * boundingBox.z.min;
+                    auto x = i * box.x.max + (1 - i) * box.x.min;
+                    auto y = j * box.y.max + (1 - j) * box.y.min;
+                    auto z = k * box.z.max + (1 - k) * box.z.min;
 
                     auto newX = cosTheta * x + sinTheta * z;
                     auto newZ = -sinTheta * x + cosTheta * z;
@@ -121,7 +413,26 @@ public:
             }
         }
 
-        boundingBox = AABB(min, max);
+        return AABB(min, max);
+    }
+
+    Vec3 ToObject(const Vec3 &v) const
+    {
+        return Vec3(cosTheta * v[0] - sinTheta * v[2], v[1], sinTheta * v[0] + cosTheta * v[2]);
+    }
+
+    Vec3 ToWorld(const Vec3 &v) const
+    {
+        return Vec3(cosTheta * v[0] + sinTheta * v[2], v[1], -sinTheta * v[0] + cosTheta * v[2]);
+    }
+
+public:
+    RotateY(shared_ptr<Hitable> p, double angle) : object(p), angle(angle)
+    {
+        auto radians = DegreesTooRadians(angle);
+        sinTheta = sin(radians);
+        cosTheta = cos(radians);
+        boundingBox = RotatedBox(object->BoundingBox());
     }
 
     bool Hit(const Ray &ray, Interval ray_t, HitRecord &rec) const override
@@ -154,21 +465,46 @@ public:
 
         rec.point = point;
         rec.normal = normal;
+        rec.dpdu = ToWorld(rec.dpdu);
+        rec.dpdv = ToWorld(rec.dpdv);
+        rec.dndu = ToWorld(rec.dndu);
+        rec.dndv = ToWorld(rec.dndv);
+        rec.velocity = ToWorld(rec.velocity);
 
         return true;
     }
 
     AABB BoundingBox() const override { return boundingBox; }
 
+    AABB StartBoundingBox() const override { return RotatedBox(object->StartBoundingBox()); }
+
+    AABB EndBoundingBox() const override { return RotatedBox(object->EndBoundingBox()); }
+
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
-        return 0.0;
+        return object->PDFValue(ToObject(origin), ToObject(direction));
     }
 
     Vec3 Random(const Point3 &origin) const override
     {
-        return Vec3(1, 0, 0);
+        return ToWorld(object->Random(ToObject(origin)));
+    }
+
+    bool Span(const Ray &ray, Interval &span) const override
+    {
+        return object->Span(Ray(ToObject(ray.Origin()), ToObject(ray.Direction()), ray.Time()), span);
     }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        LightCollection objectLights;
+        object->CollectLights(object, objectLights);
+        lights.Append(objectLights, [this](shared_ptr<Hitable> light) -> shared_ptr<Hitable> {
+            return make_shared<RotateY>(light, angle);
+        });
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { object->CollectMaterials(materials); }
 };
 
 #endif
\ No newline at end of file
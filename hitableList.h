@@ -25,6 +25,9 @@ public:
     {
         objects.push_back(object);
         boundingBox = AABB(boundingBox, object->BoundingBox());
+        startBoundingBox = AABB(startBoundingBox, object->StartBoundingBox());
+        endBoundingBox = AABB(endBoundingBox, object->EndBoundingBox());
+        isAnimated = isAnimated || object->IsAnimated();
     }
 
     bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
@@ -46,6 +49,10 @@ public:
 
     AABB BoundingBox() const override { return boundingBox; }
 
+    AABB StartBoundingBox() const override { return startBoundingBox; }
+
+    AABB EndBoundingBox() const override { return endBoundingBox; }
+
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
         auto weight = 1.0 / objects.size();
@@ -64,8 +71,46 @@ public:
         return objects[RandomInt(0, intSize - 1)]->Random(origin);
     }
 
+    bool Span(const Ray &ray, Interval &span) const override
+    {
+        // A single object keeps its own (possibly analytic) span, e.g. the box Box() returns
+        if ( objects.size() == 1 ) return objects[0]->Span(ray, span);
+        return Hitable::Span(ray, span);
+    }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        for ( const auto &object : objects ) {
+            object->CollectLights(object, lights);
+        }
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override
+    {
+        for ( const auto &object : objects ) {
+            object->CollectMaterials(materials);
+        }
+    }
+
+    bool IsAnimated() const override { return isAnimated; }
+
+    void Refit() override
+    {
+        if ( !isAnimated ) return;
+        boundingBox = startBoundingBox = endBoundingBox = AABB();
+        for ( const auto &object : objects ) {
+            if ( object->IsAnimated() ) object->Refit();
+            boundingBox = AABB(boundingBox, object->BoundingBox());
+            startBoundingBox = AABB(startBoundingBox, object->StartBoundingBox());
+            endBoundingBox = AABB(endBoundingBox, object->EndBoundingBox());
+        }
+    }
+
 private:
     AABB boundingBox;
+    AABB startBoundingBox;
+    AABB endBoundingBox;
+    bool isAnimated = false;
 };
 
 #endif
\ No newline at end of file
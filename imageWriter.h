@@ -0,0 +1,517 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frameBuffer.h"
+#include "stbImplementation.h"
+
+class ImageWriter
+{
+    // Writes passes of a FrameBuffer to a floating point image file, streaming scanlines out as
+    // the renderer finishes them rather than copying the frame. Open the writer on the frame
+    // before rendering, report each finished scanline, in any order and from any thread, then
+    // Close. Rows never reported are written at Close, so Open then Close writes a whole frame.
+
+protected:
+    const FrameBuffer *frame = nullptr;
+    std::string filename;
+    std::vector<char> rowDone;
+    bool failed = false;
+    std::mutex mutex;
+
+    void Begin(const std::string &_filename, const FrameBuffer &_frame)
+    {
+        filename = _filename;
+        frame = &_frame;
+        rowDone.assign(frame->height, 0);
+        failed = false;
+    }
+
+    bool RowsDone(int first, int end) const
+    {
+        // Whether every row in [first, end) has finished
+        for ( int y = first; y < std::min(end, frame->height); y++ ) {
+            if ( !rowDone[y] ) return false;
+        }
+        return true;
+    }
+
+    void FinishRemainingRows()
+    {
+        for ( int y = 0; y < frame->height; y++ ) {
+            if ( !rowDone[y] ) {
+                rowDone[y] = 1;
+                RowFinished(y);
+            }
+        }
+    }
+
+    // Called with the mutex held once row y, and so every pass's row y, holds final values
+    virtual void RowFinished(int y) = 0;
+
+public:
+    virtual ~ImageWriter() {}
+
+    // Creates the file for the frame, whose size and passes must not change until Close.
+    // Returns false if the file can't be created
+    virtual bool Open(const std::string &filename, const FrameBuffer &frame) = 0;
+
+    void ScanlineDone(int y)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( !frame || y < 0 || y >= frame->height || rowDone[y] ) return;
+        rowDone[y] = 1;
+        RowFinished(y);
+    }
+
+    // Writes any rows not yet written and completes the file. Returns true if every write succeeded
+    virtual bool Close() = 0;
+
+    const std::string &Filename() const { return filename; }
+};
+
+class PFMWriter : public ImageWriter
+{
+    // Portable float map of one pass: 32-bit floats, 1 channel ("Pf") or 3 ("PF"). Passes with
+    // other channel counts are truncated or padded with zeros to 3. PFM stores rows bottom to top
+    // with a fixed size, so each row is written at its own offset as soon as it finishes.
+
+private:
+    std::string passName;
+    const FrameBuffer::Pass *pass = nullptr;
+    std::FILE *file = nullptr;
+    int channels = 3;
+    long dataOffset = 0;
+
+    void RowFinished(int y) override
+    {
+        if ( !file ) return;
+
+        std::vector<float> row(size_t(frame->width) * channels, 0.0f);
+        for ( int x = 0; x < frame->width; x++ ) {
+            auto pixel = pass->Pixel(x, y);
+            for ( int c = 0; c < std::min(channels, pass->Channels()); c++ ) row[size_t(x) * channels + c] = pixel[c];
+        }
+
+        auto rowBytes = long(row.size() * sizeof(float));
+        if ( std::fseek(file, dataOffset + (frame->height - 1 - y) * rowBytes, SEEK_SET) != 0 ||
+             std::fwrite(row.data(), rowBytes, 1, file) != 1 ) {
+            failed = true;
+        }
+    }
+
+public:
+    PFMWriter(const std::string &_passName = "beauty") : passName(_passName) {}
+
+    ~PFMWriter()
+    {
+        if ( file ) std::fclose(file);
+    }
+
+    bool Open(const std::string &filename, const FrameBuffer &frame) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Begin(filename, frame);
+
+        pass = frame.Find(passName);
+        if ( !pass ) return false;
+        channels = (pass->Channels() == 1) ? 1 : 3;
+
+        file = std::fopen(filename.c_str(), "wb");
+        if ( !file ) return false;
+
+        // A negative scale marks the data little endian
+        std::fprintf(file, "%s\n%d %d\n-1.0\n", (channels == 1) ? "Pf" : "PF", frame.width, frame.height);
+        dataOffset = std::ftell(file);
+        return true;
+    }
+
+    bool Close() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( !file ) return false;
+
+        FinishRemainingRows();
+        if ( std::fclose(file) != 0 ) failed = true;
+        file = nullptr;
+        return !failed;
+    }
+
+    static bool Read(const std::string &filename, FrameBuffer &frame, const std::string &passName = "beauty")
+    {
+        // Reads a PFM as written here into the named pass, adding it if needed, so a render can
+        // be merged into one saved earlier. An empty frame takes the file's size; otherwise the
+        // sizes must match. Returns false if the file can't be read.
+        std::FILE *file = std::fopen(filename.c_str(), "rb");
+        if ( !file ) return false;
+
+        char type[3] = {};
+        int width = 0, height = 0;
+        double scale = 0;
+        bool ok = std::fscanf(file, "%2s %d %d %lf", type, &width, &height, &scale) == 4 && std::fgetc(file) == '\n' &&
+                  (std::strcmp(type, "PF") == 0 || std::strcmp(type, "Pf") == 0) && width > 0 && height > 0 && scale < 0;
+        if ( ok && frame.passes.empty() ) frame = FrameBuffer(width, height);
+        if ( !ok || frame.width != width || frame.height != height ) {
+            std::fclose(file);
+            return false;
+        }
+
+        int channels = (type[1] == 'f') ? 1 : 3;
+        auto &pass = frame.AddPass(passName, (channels == 1) ? std::vector<std::string>{"Y"} : std::vector<std::string>{"R", "G", "B"});
+        std::vector<float> row(size_t(width) * channels);
+        for ( int y = height - 1; ok && y >= 0; y-- ) {
+            ok = std::fread(row.data(), sizeof(float), row.size(), file) == row.size();
+            for ( int x = 0; ok && x < width; x++ ) {
+                for ( int c = 0; c < std::min(channels, pass.Channels()); c++ ) pass.Pixel(x, y)[c] = row[size_t(x) * channels + c];
+            }
+        }
+        std::fclose(file);
+        return ok;
+    }
+};
+
+class HDRWriter : public ImageWriter
+{
+    // Radiance RGBE (.hdr) of one pass through stb_image_write. The format is run-length encoded
+    // in row order, so the pass is encoded in one call at Close, read in place from the frame.
+
+private:
+    std::string passName;
+
+    void RowFinished(int y) override {}
+
+public:
+    HDRWriter(const std::string &_passName = "beauty") : passName(_passName) {}
+
+    bool Open(const std::string &filename, const FrameBuffer &frame) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Begin(filename, frame);
+        auto pass = frame.Find(passName);
+        return pass && pass->Channels() >= 1 && pass->Channels() <= 4;
+    }
+
+    bool Close() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pass = frame ? frame->Find(passName) : nullptr;
+        if ( !pass || pass->Channels() < 1 || pass->Channels() > 4 ) return false;
+        return stbi_write_hdr(filename.c_str(), frame->width, frame->height, pass->Channels(), pass->data.data()) != 0;
+    }
+};
+
+inline uint16_t FloatToHalf(float value)
+{
+    // IEEE 754 binary32 to binary16, rounding to nearest even. Overflow becomes infinity and NaN
+    // stays NaN.
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int exponent = int((bits >> 23) & 0xff);
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if ( exponent == 255 ) return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 | (mantissa >> 13) : 0));
+
+    int halfExponent = exponent - 127 + 15;
+    if ( halfExponent >= 31 ) return uint16_t(sign | 0x7c00);
+
+    uint32_t half, remainder, halfway;
+    if ( halfExponent <= 0 ) {
+        // Subnormal half, including the implicit leading bit in the shifted mantissa
+        if ( halfExponent < -10 ) return uint16_t(sign);
+        mantissa |= 0x800000;
+        int shift = 14 - halfExponent;
+        half = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        half = (uint32_t(halfExponent) << 10) | (mantissa >> 13);
+        remainder = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    // A carry out of the mantissa correctly steps up the exponent, or on to infinity
+    if ( remainder > halfway || (remainder == halfway && (half & 1)) ) half++;
+    return uint16_t(sign | half);
+}
+
+class EXRWriter : public ImageWriter
+{
+    // Self-contained single-part OpenEXR writer. Every pass becomes channels of the one file:
+    // the beauty pass keeps its plain names (R, G, B) and other passes are prefixed with the pass
+    // name (albedo.R, depth.Z, ...). Pixels are half or full floats, stored as scanline blocks or
+    // tiles, uncompressed or with ZIP (zlib) compression. Blocks and tiles are compressed and
+    // written as soon as all their rows finish; the offset table is filled in at Close.
+
+public:
+    enum class Compression
+    {
+        None,         // Uncompressed
+        ZIPScanline,  // zlib, one scanline per block
+        ZIP           // zlib, 16 scanlines per block
+    };
+
+    struct Settings
+    {
+        bool halfFloat = true;                    // 16-bit half floats, otherwise 32-bit floats
+        Compression compression = Compression::ZIP;
+        bool tiled = false;                       // Store tiles rather than scanline blocks
+        int tileSize = 64;                        // Tile width and height when tiled
+    };
+
+private:
+    struct Channel
+    {
+        std::string name;
+        const FrameBuffer::Pass *pass;
+        int index; // Channel within the pass
+    };
+
+    Settings settings;
+    std::vector<Channel> channels; // Sorted by name, as the format requires
+    std::FILE *file = nullptr;
+    long offsetTablePosition = 0;
+    std::vector<uint64_t> offsets; // File position of each chunk, by chunk index
+
+    // Scanline files list their blocks in increasing y, so finished blocks wait here for any
+    // earlier block still rendering
+    std::map<int, std::vector<uint8_t>> pendingBlocks;
+    int nextBlock = 0;
+
+    int LinesPerBlock() const { return (settings.compression == Compression::ZIP) ? 16 : 1; }
+
+    int TilesX() const { return (frame->width + settings.tileSize - 1) / settings.tileSize; }
+
+    int TilesY() const { return (frame->height + settings.tileSize - 1) / settings.tileSize; }
+
+    static void Append(std::vector<uint8_t> &out, const void *data, size_t size)
+    {
+        auto bytes = static_cast<const uint8_t *>(data);
+        out.insert(out.end(), bytes, bytes + size);
+    }
+
+    template <typename T>
+    static void AppendValue(std::vector<uint8_t> &out, T value)
+    {
+        Append(out, &value, sizeof(value)); // The format is little endian, as are our targets
+    }
+
+    static void AppendAttribute(std::vector<uint8_t> &out, const char *name, const char *type, const std::vector<uint8_t> &value)
+    {
+        Append(out, name, std::strlen(name) + 1);
+        Append(out, type, std::strlen(type) + 1);
+        AppendValue(out, int32_t(value.size()));
+        Append(out, value.data(), value.size());
+    }
+
+    std::vector<uint8_t> Header() const
+    {
+        std::vector<uint8_t> header;
+        bool longNames = false;
+        for ( const auto &channel : channels ) longNames |= channel.name.size() > 31;
+
+        AppendValue(header, uint32_t(20000630));
+        AppendValue(header, uint32_t(2 | (settings.tiled ? 0x200 : 0) | (longNames ? 0x400 : 0)));
+
+        std::vector<uint8_t> value;
+        for ( const auto &channel : channels ) {
+            Append(value, channel.name.c_str(), channel.name.size() + 1);
+            AppendValue(value, int32_t(settings.halfFloat ? 1 : 2));
+            AppendValue(value, uint32_t(0)); // pLinear and reserved
+            AppendValue(value, int32_t(1));  // x sampling
+            AppendValue(value, int32_t(1));  // y sampling
+        }
+        value.push_back(0);
+        AppendAttribute(header, "channels", "chlist", value);
+
+        uint8_t compression = (settings.compression == Compression::None) ? 0 : (settings.compression == Compression::ZIPScanline) ? 2 : 3;
+        AppendAttribute(header, "compression", "compression", {compression});
+
+        value.clear();
+        for ( int32_t bound : {0, 0, frame->width - 1, frame->height - 1} ) AppendValue(value, bound);
+        AppendAttribute(header, "dataWindow", "box2i", value);
+        AppendAttribute(header, "displayWindow", "box2i", value);
+
+        // Tiles may be written in any order; scanline blocks go in increasing y
+        AppendAttribute(header, "lineOrder", "lineOrder", {uint8_t(settings.tiled ? 2 : 0)});
+
+        value.clear();
+        AppendValue(value, 1.0f);
+        AppendAttribute(header, "pixelAspectRatio", "float", value);
+
+        value.clear();
+        AppendValue(value, 0.0f);
+        AppendValue(value, 0.0f);
+        AppendAttribute(header, "screenWindowCenter", "v2f", value);
+
+        value.clear();
+        AppendValue(value, 1.0f);
+        AppendAttribute(header, "screenWindowWidth", "float", value);
+
+        if ( settings.tiled ) {
+            value.clear();
+            AppendValue(value, uint32_t(settings.tileSize));
+            AppendValue(value, uint32_t(settings.tileSize));
+            value.push_back(0); // One level, no mip or rip maps
+            AppendAttribute(header, "tiles", "tiledesc", value);
+        }
+
+        header.push_back(0);
+        return header;
+    }
+
+    std::vector<uint8_t> EncodeRegion(int x0, int y0, int x1, int y1) const
+    {
+        // Pixel data for the region: each row in turn, holding each channel's values for the row
+        std::vector<uint8_t> raw;
+        raw.reserve(size_t(x1 - x0) * (y1 - y0) * channels.size() * (settings.halfFloat ? 2 : 4));
+        for ( int y = y0; y < y1; y++ ) {
+            for ( const auto &channel : channels ) {
+                for ( int x = x0; x < x1; x++ ) {
+                    auto value = channel.pass->Pixel(x, y)[channel.index];
+                    if ( settings.halfFloat ) {
+                        AppendValue(raw, FloatToHalf(value));
+                    } else {
+                        AppendValue(raw, value);
+                    }
+                }
+            }
+        }
+
+        if ( settings.compression == Compression::None ) return raw;
+
+        // ZIP splits the bytes into two halves of alternate bytes, delta encodes them, then
+        // deflates. Data that doesn't shrink is stored raw.
+        std::vector<uint8_t> reordered(raw.size());
+        size_t half = (raw.size() + 1) / 2;
+        for ( size_t i = 0; i < raw.size(); i++ ) {
+            reordered[(i % 2) ? half + i / 2 : i / 2] = raw[i];
+        }
+        for ( size_t i = reordered.size() - 1; i > 0; i-- ) {
+            reordered[i] = uint8_t(int(reordered[i]) - int(reordered[i - 1]) + 128);
+        }
+
+        int compressedSize = 0;
+        auto compressed = stbi_zlib_compress(reordered.data(), int(reordered.size()), &compressedSize, 6);
+        if ( !compressed ) return raw;
+        if ( size_t(compressedSize) >= raw.size() ) {
+            STBIW_FREE(compressed);
+            return raw;
+        }
+
+        std::vector<uint8_t> result(compressed, compressed + compressedSize);
+        STBIW_FREE(compressed);
+        return result;
+    }
+
+    void WriteChunk(int chunkIndex, const std::vector<int32_t> &coordinates, const std::vector<uint8_t> &data)
+    {
+        offsets[chunkIndex] = uint64_t(std::ftell(file));
+        std::vector<uint8_t> chunk;
+        for ( auto coordinate : coordinates ) AppendValue(chunk, coordinate);
+        AppendValue(chunk, int32_t(data.size()));
+        Append(chunk, data.data(), data.size());
+        if ( std::fwrite(chunk.data(), chunk.size(), 1, file) != 1 ) failed = true;
+    }
+
+    void RowFinished(int y) override
+    {
+        if ( !file ) return;
+
+        if ( settings.tiled ) {
+            // Rows finish whole, so a band of tiles completes together
+            int tileY = y / settings.tileSize;
+            int y0 = tileY * settings.tileSize;
+            int y1 = std::min(y0 + settings.tileSize, frame->height);
+            if ( !RowsDone(y0, y1) ) return;
+
+            for ( int tileX = 0; tileX < TilesX(); tileX++ ) {
+                int x0 = tileX * settings.tileSize;
+                int x1 = std::min(x0 + settings.tileSize, frame->width);
+                WriteChunk(tileY * TilesX() + tileX, {tileX, tileY, 0, 0}, EncodeRegion(x0, y0, x1, y1));
+            }
+            return;
+        }
+
+        int block = y / LinesPerBlock();
+        int y0 = block * LinesPerBlock();
+        int y1 = std::min(y0 + LinesPerBlock(), frame->height);
+        if ( !RowsDone(y0, y1) ) return;
+
+        pendingBlocks[block] = EncodeRegion(0, y0, frame->width, y1);
+        while ( !pendingBlocks.empty() && pendingBlocks.begin()->first == nextBlock ) {
+            WriteChunk(nextBlock, {nextBlock * LinesPerBlock()}, pendingBlocks.begin()->second);
+            pendingBlocks.erase(pendingBlocks.begin());
+            nextBlock++;
+        }
+    }
+
+public:
+    EXRWriter() {}
+
+    EXRWriter(const Settings &_settings) : settings(_settings) {}
+
+    ~EXRWriter()
+    {
+        if ( file ) std::fclose(file);
+    }
+
+    bool Open(const std::string &filename, const FrameBuffer &frame) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Begin(filename, frame);
+        settings.tileSize = std::max(settings.tileSize, 1);
+
+        channels.clear();
+        for ( const auto &pass : frame.passes ) {
+            for ( int c = 0; c < pass.Channels(); c++ ) {
+                auto name = (pass.name == "beauty") ? pass.channels[c] : pass.name + "." + pass.channels[c];
+                channels.push_back({name, &pass, c});
+            }
+        }
+        std::sort(channels.begin(), channels.end(), [](const Channel &a, const Channel &b) { return a.name < b.name; });
+
+        file = std::fopen(filename.c_str(), "wb");
+        if ( !file ) return false;
+
+        auto header = Header();
+        auto chunkCount = settings.tiled ? TilesX() * TilesY() : (frame.height + LinesPerBlock() - 1) / LinesPerBlock();
+        offsets.assign(chunkCount, 0);
+        pendingBlocks.clear();
+        nextBlock = 0;
+
+        // Reserve the offset table; chunks follow it
+        std::vector<uint8_t> table(offsets.size() * sizeof(uint64_t), 0);
+        offsetTablePosition = long(header.size());
+        if ( std::fwrite(header.data(), header.size(), 1, file) != 1 ||
+             (!table.empty() && std::fwrite(table.data(), table.size(), 1, file) != 1) ) {
+            failed = true;
+        }
+        return !failed;
+    }
+
+    bool Close() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( !file ) return false;
+
+        FinishRemainingRows();
+        if ( std::fseek(file, offsetTablePosition, SEEK_SET) != 0 ||
+             (!offsets.empty() && std::fwrite(offsets.data(), offsets.size() * sizeof(uint64_t), 1, file) != 1) ) {
+            failed = true;
+        }
+        if ( std::fclose(file) != 0 ) failed = true;
+        file = nullptr;
+        return !failed;
+    }
+};
+
+#endif
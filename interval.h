@@ -4,55 +4,57 @@
 class Interval
 {
 public:
-    double min, max;
+    Real min, max;
 
     Interval() : min(+maxDouble), max(-maxDouble) {} // Default interval is empty
 
-    Interval(double _min, double _max) : min(_min), max(_max) {}
+    Interval(Real _min, Real _max) : min(_min), max(_max) {}
 
     Interval(const Interval &a, const Interval &b)
         : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
 
-    bool Contains(double x) const
+    bool Contains(Real x) const
     {
         return min <= x && x <= max;
     }
 
-    bool Surrounds(double x) const
+    bool Surrounds(Real x) const
     {
         return min < x && x < max;
     }
 
-    double Clamp(double x) const
+    Real Clamp(Real x) const
     {
         if ( x < min ) return min;
         if ( x > max ) return max;
         return x;
     }
 
-    double Size() const
+    Real Size() const
     {
         return max - min;
     }
 
-    Interval Expand(double delta) const
+    Interval Expand(Real delta) const
     {
         auto padding = delta / 2;
         return Interval(min - padding, max + padding);
     }
 
+    bool operator==(const Interval &other) const = default;
+
     // static const Interval empty, universe;
 };
 
 static const Interval empty(+maxDouble, -maxDouble);
 static const Interval universe(-maxDouble, +maxDouble);
 
-Interval operator+(const Interval &ival, double displacement)
+Interval operator+(const Interval &ival, Real displacement)
 {
     return Interval(ival.min + displacement, ival.max + displacement);
 }
 
-Interval operator+(double displacement, const Interval &ival)
+Interval operator+(Real displacement, const Interval &ival)
 {
     return ival + displacement;
 }
@@ -0,0 +1,195 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "hitable.h"
+#include "hitableList.h"
+
+class LightBVH : public Hitable
+{
+    // A bounding volume hierarchy over light sources that picks a light with probability
+    // proportional to its estimated contribution at the shading point. Each node stores the total
+    // power beneath it; descending the tree chooses a child by power / squared distance, so both
+    // sampling and PDF evaluation cost O(log n) instead of HitableList's O(n).
+
+private:
+    struct Node
+    {
+        AABB box;
+        Point3 centre;
+        double radiusSquared; // Squared half diagonal of the box, bounds the distance falloff
+        double power;         // Total power of all lights beneath this node
+        int secondChild;      // The first child directly follows its parent
+        int light;            // Index into lights for a leaf, -1 for an interior node
+    };
+
+    std::vector<shared_ptr<Hitable>> lights;
+    std::vector<Node> nodes;
+
+    int Build(std::vector<int> &indices, size_t start, size_t end, const std::vector<double> &powers)
+    {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+
+        AABB box;
+        AABB centroidBounds;
+        double power = 0;
+        for ( size_t i = start; i < end; i++ ) {
+            auto lightBox = lights[indices[i]]->BoundingBox();
+            auto centroid = Centre(lightBox);
+            box = AABB(box, lightBox);
+            centroidBounds = AABB(centroidBounds, AABB(centroid, centroid));
+            power += powers[indices[i]];
+        }
+
+        int light = -1;
+        int secondChild = -1;
+        if ( end - start == 1 ) {
+            light = indices[start];
+        } else {
+            // Median split along the longest axis of the light centres
+            int axis = 0;
+            for ( int a = 1; a < 3; a++ ) {
+                if ( centroidBounds.Axis(a).Size() > centroidBounds.Axis(axis).Size() ) axis = a;
+            }
+
+            auto mid = start + (end - start) / 2;
+            std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end, [this, axis](int a, int b) {
+                return Centre(lights[a]->BoundingBox())[axis] < Centre(lights[b]->BoundingBox())[axis];
+            });
+
+            Build(indices, start, mid, powers);
+            secondChild = Build(indices, mid, end, powers);
+        }
+
+        auto &node = nodes[index];
+        node.box = box;
+        node.centre = Centre(box);
+        node.radiusSquared = 0.25 * Vec3(box.x.Size(), box.y.Size(), box.z.Size()).LengthSquared();
+        node.power = power;
+        node.secondChild = secondChild;
+        node.light = light;
+        return index;
+    }
+
+    static Point3 Centre(const AABB &box)
+    {
+        return Point3(0.5 * (box.x.min + box.x.max), 0.5 * (box.y.min + box.y.max), 0.5 * (box.z.min + box.z.max));
+    }
+
+    double Importance(const Node &node, const Point3 &origin) const
+    {
+        // Power over squared distance to the node centre. Clamping the distance to the node's
+        // radius keeps nearby or enclosing clusters from dominating without bound.
+        auto distanceSquared = (node.centre - origin).LengthSquared();
+        return node.power / std::fmax(distanceSquared, node.radiusSquared);
+    }
+
+    double FirstChildProbability(int index, const Point3 &origin) const
+    {
+        auto first = Importance(nodes[index + 1], origin);
+        auto second = Importance(nodes[nodes[index].secondChild], origin);
+        auto total = first + second;
+        return (total > 0) ? first / total : 0.5;
+    }
+
+public:
+    // Lights with equal power, chosen by distance alone
+    LightBVH(const HitableList &lightList)
+        : LightBVH(lightList, std::vector<double>(lightList.objects.size(), 1.0)) {}
+
+    // Lights with the given powers, e.g. emitted radiance times area
+    LightBVH(const HitableList &lightList, const std::vector<double> &powers)
+        : lights(lightList.objects)
+    {
+        if ( lights.empty() ) return;
+
+        std::vector<int> indices(lights.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        nodes.reserve(2 * lights.size() - 1);
+        Build(indices, 0, indices.size(), powers);
+    }
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
+    {
+        if ( nodes.empty() ) return false;
+
+        bool hitAnything = false;
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while ( stackSize > 0 ) {
+            const auto &node = nodes[stack[--stackSize]];
+            if ( !node.box.Hit(ray, rayT) ) continue;
+
+            if ( node.light >= 0 ) {
+                if ( lights[node.light]->Hit(ray, rayT, record) ) {
+                    hitAnything = true;
+                    rayT.max = record.t;
+                }
+            } else {
+                stack[stackSize++] = node.secondChild;
+                stack[stackSize++] = int(&node - nodes.data()) + 1;
+            }
+        }
+
+        return hitAnything;
+    }
+
+    AABB BoundingBox() const override { return nodes.empty() ? AABB() : nodes[0].box; }
+
+    double PDFValue(const Point3 &origin, const Vec3 &direction) const override
+    {
+        // The mixture PDF sums selection probability times each light's PDF. A light's PDF is zero
+        // for directions that miss it, so only subtrees whose bounds the ray enters contribute.
+        if ( nodes.empty() ) return 0.0;
+
+        Ray ray(origin, direction, 0.0);
+        auto sum = 0.0;
+
+        struct Entry
+        {
+            int index;
+            double probability;
+        };
+        Entry stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 1.0};
+
+        while ( stackSize > 0 ) {
+            auto [index, probability] = stack[--stackSize];
+            const auto &node = nodes[index];
+            if ( probability <= 0 || !node.box.Hit(ray, Interval(0, maxDouble)) ) continue;
+
+            if ( node.light >= 0 ) {
+                sum += probability * lights[node.light]->PDFValue(origin, direction);
+            } else {
+                auto firstProbability = FirstChildProbability(index, origin);
+                stack[stackSize++] = {node.secondChild, probability * (1 - firstProbability)};
+                stack[stackSize++] = {index + 1, probability * firstProbability};
+            }
+        }
+
+        return sum;
+    }
+
+    Vec3 Random(const Point3 &origin) const override
+    {
+        if ( nodes.empty() ) return Vec3(1, 0, 0);
+
+        int index = 0;
+        while ( nodes[index].light < 0 ) {
+            index = (RandomDouble() < FirstChildProbability(index, origin)) ? index + 1 : nodes[index].secondChild;
+        }
+
+        return lights[nodes[index].light]->Random(origin);
+    }
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef LOCAL_SOCKET_H
+#define LOCAL_SOCKET_H
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class LocalSocket
+{
+    // Blocking helpers for stream sockets in the Unix domain, which the tile workers and the
+    // render server talk over. Functions return -1 or false on failure, like the calls they wrap.
+
+public:
+    static int Listen(const std::string &path)
+    {
+        // Listens on path, replacing a socket file left there by a process that has gone. Fails
+        // if anything else is there, so a mistyped path can't delete someone's file, and if a
+        // live server still answers on it, so a second one can't take over its address.
+        if ( path.size() >= sizeof(sockaddr_un::sun_path) ) return -1;
+        struct stat status;
+        if ( lstat(path.c_str(), &status) == 0 ) {
+            if ( !S_ISSOCK(status.st_mode) ) {
+                errno = EEXIST;
+                return -1;
+            }
+            int live = Connect(path);
+            if ( live >= 0 ) {
+                close(live);
+                errno = EADDRINUSE;
+                return -1;
+            }
+            unlink(path.c_str());
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ( fd < 0 ) return -1;
+        auto address = Address(path);
+        if ( bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 64) != 0 ) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static int Connect(const std::string &path)
+    {
+        if ( path.size() >= sizeof(sockaddr_un::sun_path) ) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ( fd < 0 ) return -1;
+        auto address = Address(path);
+        if ( connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static bool SendAll(int fd, const void *data, size_t size)
+    {
+        auto bytes = static_cast<const char *>(data);
+        while ( size > 0 ) {
+            auto sent = send(fd, bytes, size, MSG_NOSIGNAL);
+            if ( sent < 0 && errno == EINTR ) continue;
+            if ( sent <= 0 ) return false;
+            bytes += sent;
+            size -= size_t(sent);
+        }
+        return true;
+    }
+
+    static bool SendLine(int fd, const std::string &line)
+    {
+        auto message = line + "\n";
+        return SendAll(fd, message.data(), message.size());
+    }
+
+    static bool ReceiveAll(int fd, void *data, size_t size)
+    {
+        auto bytes = static_cast<char *>(data);
+        while ( size > 0 ) {
+            auto received = recv(fd, bytes, size, 0);
+            if ( received < 0 && errno == EINTR ) continue;
+            if ( received <= 0 ) return false;
+            bytes += received;
+            size -= size_t(received);
+        }
+        return true;
+    }
+
+    static bool ReceiveLine(int fd, std::string &line, size_t maxLength = 65536)
+    {
+        // Reads up to a newline, a byte at a time so nothing past it is consumed
+        line.clear();
+        char c;
+        while ( line.size() < maxLength ) {
+            if ( !ReceiveAll(fd, &c, 1) ) return !line.empty();
+            if ( c == '\n' ) return true;
+            line += c;
+        }
+        return false;
+    }
+
+private:
+    static sockaddr_un Address(const std::string &path)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        return address;
+    }
+};
+
+#endif
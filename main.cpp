@@ -1,5 +1,6 @@
 #include "rtweekend.h"
 
+#include "animation.h"
 #include "bvh.h"
 #include "camera.h"
 #include "colour.h"
@@ -7,10 +8,17 @@
 #include "hitableList.h"
 #include "material.h"
 #include "quad.h"
+#include "quadBatch.h"
+#include "sceneSetup.h"
 #include "sphere.h"
+#include "sphereBatch.h"
 #include "texture.h"
 
-void FinalRenderBookOne()
+#ifndef _WIN32
+#include "renderServer.h" // The server listens on a Unix domain socket
+#endif
+
+SceneSetup FinalRenderBookOne()
 {
     // World
     HitableList world;
@@ -18,6 +26,7 @@ void FinalRenderBookOne()
     auto groundMaterial = make_shared<Lambertian>(Colour(0.5, 0.5, 0.5));
     world.Add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, groundMaterial));
 
+    SphereCollection smallSpheres;
     for ( int i = -11; i < 11; i++ ) {
         for ( int j = -11; j < 11; j++ ) {
             auto chooseMaterial = RandomDouble();
@@ -30,21 +39,22 @@ void FinalRenderBookOne()
                     // diffuse
                     auto albedo = Colour::Random() * Colour::Random();
                     sphereMaterial = make_shared<Lambertian>(albedo);
-                    world.Add(make_shared<Sphere>(centre, 0.2, sphereMaterial));
+                    smallSpheres.Add(centre, 0.2, sphereMaterial);
                 } else if ( chooseMaterial < 0.95 ) {
                     // metal
                     auto albedo = Colour::Random(0.5, 1);
                     auto fuzz = RandomDouble(0, 0.5);
                     sphereMaterial = make_shared<Metal>(albedo, fuzz);
-                    world.Add(make_shared<Sphere>(centre, 0.2, sphereMaterial));
+                    smallSpheres.Add(centre, 0.2, sphereMaterial);
                 } else {
                     // glass
                     sphereMaterial = make_shared<Dielectric>(1.5);
-                    world.Add(make_shared<Sphere>(centre, 0.2, sphereMaterial));
+                    smallSpheres.Add(centre, 0.2, sphereMaterial);
                 }
             }
         }
     }
+    world.Add(make_shared<BVHNode>(smallSpheres.Batches()));
 
     auto material1 = make_shared<Dielectric>(1.5);
     world.Add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
@@ -57,10 +67,6 @@ void FinalRenderBookOne()
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 16.0 / 9.0;
@@ -77,10 +83,10 @@ void FinalRenderBookOne()
     cam.defocusAngle = 0.6;
     cam.focusDistance = 10.0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void RandomSpheres()
+SceneSetup RandomSpheres()
 {
     // World
     HitableList world;
@@ -88,6 +94,7 @@ void RandomSpheres()
     auto groundMaterial = make_shared<Lambertian>(Colour(0.5, 0.5, 0.5));
     world.Add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, groundMaterial));
 
+    SphereCollection smallSpheres;
     for ( int i = -11; i < 11; i++ ) {
         for ( int j = -11; j < 11; j++ ) {
             auto chooseMaterial = RandomDouble();
@@ -101,21 +108,22 @@ void RandomSpheres()
                     auto albedo = Colour::Random() * Colour::Random();
                     sphereMaterial = make_shared<Lambertian>(albedo);
                     auto centre2 = centre + Vec3(0, RandomDouble(0, .5), 0);
-                    world.Add(make_shared<Sphere>(centre, centre2, 0.2, sphereMaterial));
+                    smallSpheres.Add(centre, centre2, 0.2, sphereMaterial);
                 } else if ( chooseMaterial < 0.95 ) {
                     // metal
                     auto albedo = Colour::Random(0.5, 1);
                     auto fuzz = RandomDouble(0, 0.5);
                     sphereMaterial = make_shared<Metal>(albedo, fuzz);
-                    world.Add(make_shared<Sphere>(centre, 0.2, sphereMaterial));
+                    smallSpheres.Add(centre, 0.2, sphereMaterial);
                 } else {
                     // glass
                     sphereMaterial = make_shared<Dielectric>(1.5);
-                    world.Add(make_shared<Sphere>(centre, 0.2, sphereMaterial));
+                    smallSpheres.Add(centre, 0.2, sphereMaterial);
                 }
             }
         }
     }
+    world.Add(make_shared<BVHNode>(smallSpheres.Batches()));
 
     auto material1 = make_shared<Dielectric>(1.5);
     world.Add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
@@ -128,10 +136,6 @@ void RandomSpheres()
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 16.0 / 9.0;
@@ -148,10 +152,10 @@ void RandomSpheres()
     cam.defocusAngle = 0.6;
     cam.focusDistance = 10.0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void TwoSpheres()
+SceneSetup TwoSpheres()
 {
     HitableList world;
 
@@ -162,10 +166,6 @@ void TwoSpheres()
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 16.0 / 9.0;
@@ -181,19 +181,15 @@ void TwoSpheres()
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void Mars()
+SceneSetup Mars()
 {
     auto marsTexture = make_shared<ImageTexture>("mars.jpg");
     auto marsSurface = make_shared<Lambertian>(marsTexture);
     auto planet = make_shared<Sphere>(Point3(0, 0, 0), 2, marsSurface);
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 16.0 / 9.0;
@@ -209,10 +205,10 @@ void Mars()
 
     cam.defocusAngle = 0;
 
-    cam.Render(HitableList(planet), lights);
+    return {make_shared<HitableList>(planet), cam};
 }
 
-void TwoPerlinSpheres()
+SceneSetup TwoPerlinSpheres()
 {
     HitableList world;
 
@@ -222,10 +218,6 @@ void TwoPerlinSpheres()
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 16.0 / 9.0;
@@ -241,10 +233,10 @@ void TwoPerlinSpheres()
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void Quads()
+SceneSetup Quads()
 {
     HitableList world;
 
@@ -256,17 +248,14 @@ void Quads()
     auto lowerTeal = make_shared<Lambertian>(Colour(0.2, 0.8, 0.8));
 
     // Quads
-    world.Add(make_shared<Quad>(Point3(-3, -2, 5), Vec3(0, 0, -4), Vec3(0, 4, 0), leftRed));
-    world.Add(make_shared<Quad>(Point3(-2, -2, 0), Vec3(4, 0, 0), Vec3(0, 4, 0), backGreen));
-    world.Add(make_shared<Quad>(Point3(3, -2, 1), Vec3(0, 0, 4), Vec3(0, 4, 0), rightBlue));
-    world.Add(make_shared<Quad>(Point3(-2, 3, 1), Vec3(4, 0, 0), Vec3(0, 0, 4), upperOrange));
-    world.Add(make_shared<Quad>(Point3(-2, -3, 5), Vec3(4, 0, 0), Vec3(0, 0, -4), lowerTeal));
-
-    world = HitableList(make_shared<BVHNode>(world));
+    QuadCollection quads;
+    quads.Add(Point3(-3, -2, 5), Vec3(0, 0, -4), Vec3(0, 4, 0), leftRed);
+    quads.Add(Point3(-2, -2, 0), Vec3(4, 0, 0), Vec3(0, 4, 0), backGreen);
+    quads.Add(Point3(3, -2, 1), Vec3(0, 0, 4), Vec3(0, 4, 0), rightBlue);
+    quads.Add(Point3(-2, 3, 1), Vec3(4, 0, 0), Vec3(0, 0, 4), upperOrange);
+    quads.Add(Point3(-2, -3, 5), Vec3(4, 0, 0), Vec3(0, 0, -4), lowerTeal);
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
+    world = HitableList(make_shared<BVHNode>(quads.Batches()));
 
     Camera cam;
 
@@ -283,10 +272,10 @@ void Quads()
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void SimpleLight()
+SceneSetup SimpleLight()
 {
     HitableList world;
 
@@ -300,10 +289,6 @@ void SimpleLight()
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 16.0 / 9.0;
@@ -319,10 +304,10 @@ void SimpleLight()
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void CornellBox()
+SceneSetup CornellBox()
 {
     HitableList world;
 
@@ -344,18 +329,12 @@ void CornellBox()
     box1 = make_shared<Translate>(box1, Vec3(265, 0, 295));
     world.Add(box1);
 
-    // Glass Sphere
+    // Glass Sphere, sampled towards for caustics when next event estimation is off
     auto glass = make_shared<Dielectric>(1.5);
-    world.Add(make_shared<Sphere>(Point3(190, 90, 190), 90, glass));
+    world.Add(make_shared<ImportanceSampled>(make_shared<Sphere>(Point3(190, 90, 190), 90, glass)));
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    HitableList lights;
-    lights.Add(make_shared<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial));
-    lights.Add(make_shared<Sphere>(Point3(190, 90, 190), 90, emptyMaterial));
-
     Camera cam;
 
     cam.aspectRatio = 1.0;
@@ -371,10 +350,12 @@ void CornellBox()
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    cam.nextEventEstimation = true;
+
+    return {make_shared<HitableList>(world), cam};
 }
 
-void CornellSmoke()
+SceneSetup CornellSmoke()
 {
     HitableList world;
 
@@ -403,10 +384,6 @@ void CornellSmoke()
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 1.0;
@@ -422,10 +399,10 @@ void CornellSmoke()
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    return {make_shared<HitableList>(world), cam};
 }
 
-void FinalRenderBookTwo(int image_width, int samples_per_pixel, int max_depth)
+SceneSetup FinalRenderBookTwo(int image_width, int samples_per_pixel, int max_depth)
 {
     HitableList boxes1;
     auto ground = make_shared<Lambertian>(Colour(0.48, 0.83, 0.53));
@@ -472,24 +449,20 @@ void FinalRenderBookTwo(int image_width, int samples_per_pixel, int max_depth)
     auto perlinTexture = make_shared<NoiseTexture>(10);
     world.Add(make_shared<Sphere>(Point3(220, 280, 300), 80, make_shared<Lambertian>(perlinTexture)));
 
-    HitableList boxes2;
+    SphereCollection boxes2;
     auto white = make_shared<Lambertian>(Colour(.73, .73, .73));
     int numSpheres = 1000;
     for ( int j = 0; j < numSpheres; j++ ) {
-        boxes2.Add(make_shared<Sphere>(Point3::Random(0, 165), 10, white));
+        boxes2.Add(Point3::Random(0, 165), 10, white);
     }
 
     world.Add(make_shared<Translate>(
         make_shared<RotateY>(
-            make_shared<BVHNode>(boxes2), 15),
+            make_shared<BVHNode>(boxes2.Batches()), 15),
         Vec3(-100, 270, 395)));
 
     world = HitableList(make_shared<BVHNode>(world));
 
-    // Light Sources
-    auto emptyMaterial = shared_ptr<Material>();
-    Quad lights(Point3(123, 554, 147), Vec3(300, 0, 0), Vec3(0, 0, 265), emptyMaterial);
-
     Camera cam;
 
     cam.aspectRatio = 1.0;
@@ -505,44 +478,139 @@ void FinalRenderBookTwo(int image_width, int samples_per_pixel, int max_depth)
 
     cam.defocusAngle = 0;
 
-    cam.Render(world, lights);
+    cam.nextEventEstimation = true;
+
+    return {make_shared<HitableList>(world), cam};
 }
 
-int main()
+void AnimatedCornellBox(int firstFrame, int lastFrame)
 {
+    // The Cornell box with the tall box turning, the glass sphere rolling across the floor and
+    // the camera dollying in, over 48 frames
+    Scene scene;
+    HitableList world;
+
+    auto red = make_shared<Lambertian>(Colour(.65, .05, .05));
+    auto white = make_shared<Lambertian>(Colour(.73, .73, .73));
+    auto green = make_shared<Lambertian>(Colour(.12, .45, .15));
+    auto light = make_shared<DiffuseLight>(Colour(15, 15, 15));
+
+    world.Add(make_shared<Quad>(Point3(555, 0, 0), Vec3(0, 555, 0), Vec3(0, 0, 555), green));
+    world.Add(make_shared<Quad>(Point3(0, 0, 0), Vec3(0, 555, 0), Vec3(0, 0, 555), red));
+    world.Add(make_shared<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
+    world.Add(make_shared<Quad>(Point3(0, 0, 0), Vec3(555, 0, 0), Vec3(0, 0, 555), white));
+    world.Add(make_shared<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
+    world.Add(make_shared<Quad>(Point3(0, 0, 555), Vec3(555, 0, 0), Vec3(0, 555, 0), white));
+
+    // Box, turning about its corner while it stays in place
+    auto box = make_shared<Animated>(Box(Point3(0, 0, 0), Point3(165, 330, 165), white));
+    box->rotation.Key(0, 15);
+    box->rotation.Key(47, 105);
+    box->position.Key(0, Vec3(265, 0, 295));
+    scene.animated.push_back(box);
+    world.Add(box);
+
+    // Glass sphere, rolling from the left wall towards the right
+    auto glass = make_shared<Dielectric>(1.5);
+    auto sphere = make_shared<Animated>(make_shared<Sphere>(Point3(0, 90, 190), 90, glass));
+    sphere->position.Key(0, Vec3(100, 0, 0));
+    sphere->position.Key(47, Vec3(240, 0, -60));
+    scene.animated.push_back(sphere);
+    world.Add(make_shared<ImportanceSampled>(sphere));
+
+    Animation animation;
+    for ( const auto &object : scene.animated ) {
+        object->SetFrame(firstFrame, animation.shutter);
+    }
+    scene.world = make_shared<BVHNode>(world);
+
+    scene.cameraPath.lookFrom.Key(0, Point3(278, 278, -800));
+    scene.cameraPath.lookFrom.Key(47, Point3(278, 278, -500));
+    scene.cameraPath.verticalFOV.Key(0, 40);
+    scene.cameraPath.verticalFOV.Key(47, 55);
+
+    Camera cam;
+
+    cam.aspectRatio = 1.0;
+    cam.imageWidth = 400;
+    cam.samplesPerPixel = 200;
+    cam.maxDepth = 50;
+    cam.background = Colour(0, 0, 0);
+
+    cam.lookAt = Point3(278, 278, 0);
+    cam.vecUp = Vec3(0, 1, 0);
+
+    cam.defocusAngle = 0;
+
+    cam.nextEventEstimation = true;
+
+    animation.Render(cam, scene, firstFrame, lastFrame);
+}
+
+#ifndef _WIN32
+int Serve(const std::string &socketPath)
+{
+    RenderServer server;
+    server.Register("finalRenderBookOne", FinalRenderBookOne);
+    server.Register("randomSpheres", RandomSpheres);
+    server.Register("twoSpheres", TwoSpheres);
+    server.Register("mars", Mars);
+    server.Register("twoPerlinSpheres", TwoPerlinSpheres);
+    server.Register("quads", Quads);
+    server.Register("simpleLight", SimpleLight);
+    server.Register("cornellBox", CornellBox);
+    server.Register("cornellSmoke", CornellSmoke);
+    server.Register("finalRenderBookTwo", [] { return FinalRenderBookTwo(400, 800, 4); });
+    return server.Run(socketPath);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    // "--server [socket]" keeps scenes loaded and renders jobs sent to it, for instance with
+    // "--submit <socket> 'render scene=cornellBox samplesPerPixel=100'"
+#ifndef _WIN32
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if ( !args.empty() && args[0] == "--server" ) return Serve((args.size() > 1) ? args[1] : "/tmp/rtweekend-server.sock");
+    if ( args.size() == 3 && args[0] == "--submit" ) return RenderServer::Submit(args[1], args[2], std::cout);
+#endif
+
     switch ( 11 ) {
         case 1:
-            FinalRenderBookOne();
+            FinalRenderBookOne().Render();
             break;
         case 2:
-            RandomSpheres();
+            RandomSpheres().Render();
             break;
         case 3:
-            TwoSpheres();
+            TwoSpheres().Render();
             break;
         case 4:
-            Mars();
+            Mars().Render();
             break;
         case 5:
-            TwoPerlinSpheres();
+            TwoPerlinSpheres().Render();
             break;
         case 6:
-            Quads();
+            Quads().Render();
             break;
         case 7:
-            SimpleLight();
+            SimpleLight().Render();
             break;
         case 8:
-            CornellBox();
+            CornellBox().Render();
             break;
         case 9:
-            CornellSmoke();
+            CornellSmoke().Render();
             break;
         case 10:
-            FinalRenderBookTwo(800, 10000, 40); // For final high resolution render
+            FinalRenderBookTwo(800, 10000, 40).Render(); // For final high resolution render
             break;
         case 11:
-            FinalRenderBookTwo(400, 800, 4);  // For testing
+            FinalRenderBookTwo(400, 800, 4).Render(); // For testing
+            break;
+        case 12:
+            AnimatedCornellBox(0, 47);
             break;
     }
     return 0;
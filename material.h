@@ -26,6 +26,10 @@ public:
         return Colour(0, 0, 0);
     }
 
+    // Emitted radiance averaged over the surface, used to estimate light power. Zero for
+    // materials that don't emit.
+    virtual Colour AverageEmission() const { return Colour(0, 0, 0); }
+
     virtual bool Scatter(const Ray &rayIn, const HitRecord &record, ScatterRecord &sRecord) const = 0;
 
     virtual double ScatteringPDF(const Ray &rayIn, const HitRecord &record, const Ray &scattered) const { return 0; }
@@ -43,7 +47,7 @@ public:
 
     bool Scatter(const Ray &rayIn, const HitRecord &record, ScatterRecord &sRecord) const override
     {
-        sRecord.attenuation = albedo->Value(record.u, record.v, record.point);
+        sRecord.attenuation = albedo->FilteredValue(record.u, record.v, record.point, record.UVFootprint(), record.PointFootprint());
         sRecord.pdfPtr = make_shared<CosinePDF>(record.normal);
         sRecord.skipPdf = false;
         return true;
@@ -73,7 +77,8 @@ public:
         sRecord.attenuation = albedo;
         sRecord.pdfPtr = nullptr;
         sRecord.skipPdf = true;
-        sRecord.skipPdfRay = Ray(record.point, reflected, rayIn.Time());
+        sRecord.skipPdfRay = Ray(record.SpawnOrigin(reflected), reflected, rayIn.Time());
+        if ( fuzz == 0 ) record.ReflectDifferentials(rayIn, sRecord.skipPdfRay);
 
         return true;
     }
@@ -108,14 +113,20 @@ public:
 
         bool cannotRefract = refractionRatio * sinTheta > 1.0;
         Vec3 direction;
+        bool reflects = cannotRefract || Reflectance(cosTheta, refractionRatio) > RandomDouble();
 
-        if ( cannotRefract || Reflectance(cosTheta, refractionRatio) > RandomDouble() ) {
+        if ( reflects ) {
             direction = Reflect(unitDirection, record.normal);
         } else {
             direction = Refract(unitDirection, record.normal, refractionRatio);
         }
 
-        sRecord.skipPdfRay = Ray(record.point, direction, rayIn.Time());
+        sRecord.skipPdfRay = Ray(record.SpawnOrigin(direction), direction, rayIn.Time());
+        if ( reflects ) {
+            record.ReflectDifferentials(rayIn, sRecord.skipPdfRay);
+        } else {
+            record.RefractDifferentials(rayIn, sRecord.skipPdfRay, refractionRatio);
+        }
         return true;
     }
 };
@@ -140,6 +151,19 @@ public:
         if ( !record.frontFace ) return Colour(0, 0, 0);
         return emit->Value(u, v, p);
     }
+
+    Colour AverageEmission() const override
+    {
+        // Average the texture over a grid of surface coordinates
+        const int n = 4;
+        Colour sum(0, 0, 0);
+        for ( int i = 0; i < n; i++ ) {
+            for ( int j = 0; j < n; j++ ) {
+                sum += emit->Value((i + 0.5) / n, (j + 0.5) / n, Point3(0, 0, 0));
+            }
+        }
+        return sum / (n * n);
+    }
 };
 
 class Isotropic : public Material
@@ -166,4 +190,32 @@ public:
     }
 };
 
+class HenyeyGreenstein : public Material
+{
+    // Anisotropic phase function for participating media, see HenyeyGreensteinPDF
+
+private:
+    shared_ptr<Texture> tex;
+    double g;
+
+public:
+    HenyeyGreenstein(Colour c, double g) : tex(make_shared<SolidColour>(c)), g(g) {}
+
+    HenyeyGreenstein(shared_ptr<Texture> a, double g) : tex(a), g(g) {}
+
+    bool Scatter(const Ray &rayIn, const HitRecord &record, ScatterRecord &sRecord) const override
+    {
+        sRecord.attenuation = tex->Value(record.u, record.v, record.point);
+        sRecord.pdfPtr = make_shared<HenyeyGreensteinPDF>(rayIn.Direction(), g);
+        sRecord.skipPdf = false;
+        return true;
+    }
+
+    double ScatteringPDF(const Ray &rayIn, const HitRecord &record, const Ray &scattered) const override
+    {
+        auto cosTheta = Dot(UnitVector(rayIn.Direction()), UnitVector(scattered.Direction()));
+        return HenyeyGreensteinPDF::Phase(cosTheta, g);
+    }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class OutputQueue
+{
+    // Runs jobs, such as encoding and saving a finished frame, in order on a background thread.
+    // The queue is bounded: Push blocks while it's full, so a renderer that outpaces the disk
+    // waits instead of holding every frame it has made in memory. Destroying the queue finishes
+    // the jobs already pushed.
+
+public:
+    explicit OutputQueue(size_t _capacity = 2) : capacity(_capacity ? _capacity : 1), worker([this] { Run(); }) {}
+
+    ~OutputQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    OutputQueue(const OutputQueue &) = delete;
+    OutputQueue &operator=(const OutputQueue &) = delete;
+
+    void Push(std::function<void()> job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return jobs.size() < capacity; });
+        jobs.push_back(std::move(job));
+        changed.notify_all();
+    }
+
+    void Wait()
+    {
+        // Blocks until every job pushed so far has finished
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return jobs.empty() && !busy; });
+    }
+
+    // The queue the renderer shares between cameras, created on first use and drained at exit
+    static OutputQueue &Shared()
+    {
+        static OutputQueue queue;
+        return queue;
+    }
+
+private:
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::function<void()>> jobs;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker; // Last, so it starts once everything it uses is constructed
+
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ( true ) {
+            changed.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if ( jobs.empty() ) return;
+
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            changed.notify_all();
+
+            lock.unlock();
+            job();
+            lock.lock();
+
+            busy = false;
+            changed.notify_all();
+        }
+    }
+};
+
+#endif
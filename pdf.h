@@ -51,6 +51,49 @@ public:
     }
 };
 
+class HenyeyGreensteinPDF : public PDF
+{
+    // Henyey-Greenstein phase function around the incoming direction of travel. g in (-1, 1) is
+    // the mean scattering cosine: positive scatters forwards, negative backwards, 0 is isotropic.
+
+private:
+    ONB uvw;
+    double g;
+
+public:
+    HenyeyGreensteinPDF(const Vec3 &direction, double g) : uvw(direction), g(g) {}
+
+    static double Phase(double cosTheta, double g)
+    {
+        auto denominator = 1 + g * g - 2 * g * cosTheta;
+        return (1 - g * g) / (4 * PI * denominator * std::sqrt(denominator));
+    }
+
+    double Value(const Vec3 &direction) const override
+    {
+        return Phase(Dot(UnitVector(direction), uvw.W()), g);
+    }
+
+    Vec3 Generate() const override
+    {
+        // Invert the CDF of the cosine, then pick a uniform angle around the incoming direction
+        auto r1 = RandomDouble();
+        auto r2 = RandomDouble();
+
+        double cosTheta;
+        if ( std::fabs(g) < 1e-3 ) {
+            cosTheta = 1 - 2 * r1;
+        } else {
+            auto s = (1 - g * g) / (1 - g + 2 * g * r1);
+            cosTheta = (1 + g * g - s * s) / (2 * g);
+        }
+
+        auto sinTheta = std::sqrt(std::fmax(0.0, 1 - cosTheta * cosTheta));
+        auto phi = 2 * PI * r2;
+        return uvw.Transform(Vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta));
+    }
+};
+
 class HitablePDF : public PDF
 {
 private:
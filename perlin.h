@@ -1,27 +1,34 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+#include <algorithm>
+#include <cstddef>
+
 #include "rtweekend.h"
 
 class Perlin
 {
+public:
+    static const int batchSize = 8; // Points evaluated together by the noise kernel
+
 private:
     static const int pointCount = 256;
-    Vec3* randomVectors;
-    int* permutationX;
-    int* permutationY;
-    int* permutationZ;
 
-    static int* PerlinGeneratePermutation()
-    {
-        auto p = new int[pointCount];
+    // Gradient vectors stored as structure-of-arrays so the kernel gathers each component
+    // straight into a lane, rather than assembling a Vec3 per corner
+    alignas(64) Real gradientX[pointCount];
+    alignas(64) Real gradientY[pointCount];
+    alignas(64) Real gradientZ[pointCount];
+    int permutationX[pointCount];
+    int permutationY[pointCount];
+    int permutationZ[pointCount];
 
+    static void PerlinGeneratePermutation(int* p)
+    {
         for ( int i = 0; i < Perlin::pointCount; i++ )
             p[i] = i;
 
         Permute(p, pointCount);
-
-        return p;
     }
 
     static void Permute(int* p, int n)
@@ -49,83 +56,147 @@ private:
         return accumulation;
     }
 
-    static double PerlinInterpolation(Vec3 c[2][2][2], double u, double v, double w)
+    template <int lanes>
+    void NoiseLanes(const Point3* points, int count, double* results) const
     {
-        auto uu = u * u * (3 - 2 * u);
-        auto vv = v * v * (3 - 2 * v);
-        auto ww = w * w * (3 - 2 * w);
-        auto accumulation = 0.0;
+        // Evaluates noise at up to `lanes` points at once. Lanes past `count` repeat the first
+        // point so every loop runs over all lanes without masking, and is branch free so it
+        // compiles to packed arithmetic and gathers. Each lane does the same floating point
+        // operations in the same order as summing the eight corners one by one, so results are
+        // bit for bit those of the original scalar noise.
+        alignas(64) double offsetU[2][lanes], offsetV[2][lanes], offsetW[2][lanes]; // Fraction minus corner
+        alignas(64) double weightU[2][lanes], weightV[2][lanes], weightW[2][lanes]; // Smoothed corner weights
+        alignas(64) int hashX[2][lanes], hashY[2][lanes], hashZ[2][lanes];         // Permuted cell coordinates
+        alignas(64) double accumulation[lanes];
+
+        for ( int lane = 0; lane < lanes; lane++ ) {
+            const auto& p = points[(lane < count) ? lane : 0];
+            double u = p.X() - floor(p.X());
+            double v = p.Y() - floor(p.Y());
+            double w = p.Z() - floor(p.Z());
+            auto i = static_cast<int>(floor(p.X()));
+            auto j = static_cast<int>(floor(p.Y()));
+            auto k = static_cast<int>(floor(p.Z()));
+
+            offsetU[0][lane] = u, offsetU[1][lane] = u - 1;
+            offsetV[0][lane] = v, offsetV[1][lane] = v - 1;
+            offsetW[0][lane] = w, offsetW[1][lane] = w - 1;
+
+            auto uu = u * u * (3 - 2 * u);
+            auto vv = v * v * (3 - 2 * v);
+            auto ww = w * w * (3 - 2 * w);
+            weightU[0][lane] = 1 - uu, weightU[1][lane] = uu;
+            weightV[0][lane] = 1 - vv, weightV[1][lane] = vv;
+            weightW[0][lane] = 1 - ww, weightW[1][lane] = ww;
+
+            // Six table lookups per point instead of three for each of the eight corners
+            hashX[0][lane] = permutationX[i & 255], hashX[1][lane] = permutationX[(i + 1) & 255];
+            hashY[0][lane] = permutationY[j & 255], hashY[1][lane] = permutationY[(j + 1) & 255];
+            hashZ[0][lane] = permutationZ[k & 255], hashZ[1][lane] = permutationZ[(k + 1) & 255];
+
+            accumulation[lane] = 0.0;
+        }
 
-        for ( int i = 0; i < 2; i++ ) {
-            for ( int j = 0; j < 2; j++ ) {
-                for ( int k = 0; k < 2; k++ ) {
-                    Vec3 weightVector(u - i, v - j, w - k);
-                    accumulation += (i * uu + (1 - i) * (1 - uu)) *
-                                    (j * vv + (1 - j) * (1 - vv)) *
-                                    (k * ww + (1 - k) * (1 - ww)) *
-                                    Dot(c[i][j][k], weightVector);
+        for ( int di = 0; di < 2; di++ ) {
+            for ( int dj = 0; dj < 2; dj++ ) {
+                for ( int dk = 0; dk < 2; dk++ ) {
+                    for ( int lane = 0; lane < lanes; lane++ ) {
+                        auto index = hashX[di][lane] ^ hashY[dj][lane] ^ hashZ[dk][lane];
+                        Real dot = gradientX[index] * Real(offsetU[di][lane]) +
+                                   gradientY[index] * Real(offsetV[dj][lane]) +
+                                   gradientZ[index] * Real(offsetW[dk][lane]);
+                        accumulation[lane] += weightU[di][lane] * weightV[dj][lane] * weightW[dk][lane] * dot;
+                    }
                 }
             }
         }
-        return accumulation;
+
+        for ( int lane = 0; lane < count; lane++ ) results[lane] = accumulation[lane];
     }
 
 public:
     Perlin()
     {
-        randomVectors = new Vec3[pointCount];
         for ( int i = 0; i < pointCount; i++ ) {
-            randomVectors[i] = UnitVector(Vec3::Random(-1, 1));
+            auto gradient = UnitVector(Vec3::Random(-1, 1));
+            gradientX[i] = gradient.X();
+            gradientY[i] = gradient.Y();
+            gradientZ[i] = gradient.Z();
         }
 
-        permutationX = PerlinGeneratePermutation();
-        permutationY = PerlinGeneratePermutation();
-        permutationZ = PerlinGeneratePermutation();
+        PerlinGeneratePermutation(permutationX);
+        PerlinGeneratePermutation(permutationY);
+        PerlinGeneratePermutation(permutationZ);
     }
 
-    ~Perlin()
+    double Noise(const Point3& p) const
     {
-        delete[] randomVectors;
-        delete[] permutationX;
-        delete[] permutationY;
-        delete[] permutationZ;
+        double result;
+        NoiseLanes<1>(&p, 1, &result);
+        return result;
     }
 
-    double Noise(const Point3& p) const
+    void Noise(const Point3* points, double* results, size_t count) const
     {
-        auto u = p.X() - floor(p.X());
-        auto v = p.Y() - floor(p.Y());
-        auto w = p.Z() - floor(p.Z());
-        auto i = static_cast<int>(floor(p.X()));
-        auto j = static_cast<int>(floor(p.Y()));
-        auto k = static_cast<int>(floor(p.Z()));
-        Vec3 c[2][2][2];
-
-        for ( int di = 0; di < 2; di++ ) {
-            for ( int dj = 0; dj < 2; dj++ ) {
-                for ( int dk = 0; dk < 2; dk++ ) {
-                    c[di][dj][dk] = randomVectors[permutationX[(i + di) & 255] ^
-                                                  permutationY[(j + dj) & 255] ^
-                                                  permutationZ[(k + dk) & 255]];
-                }
-            }
+        // Batch form of Noise, for callers shading many points at once
+        for ( size_t first = 0; first < count; first += batchSize ) {
+            NoiseLanes<batchSize>(points + first, int(std::min<size_t>(batchSize, count - first)), results + first);
         }
-        return PerlinInterpolation(c, u, v, w);
     }
 
     double Turbulence(const Point3& p, int depth = 7) const
     {
+        // The octaves are independent, so evaluate them side by side in the kernel's lanes and
+        // sum them afterwards in order
+        Point3 octaves[batchSize];
+        double noise[batchSize];
         auto accumulation = 0.0;
         auto tempPoint = p;
         auto weight = 1.0;
 
-        for ( int i = 0; i < depth; i++ ) {
-            accumulation += weight * Noise(tempPoint);
-            weight *= 0.5;
-            tempPoint *= 2;
+        for ( int first = 0; first < depth; first += batchSize ) {
+            int count = std::min(batchSize, depth - first);
+            for ( int i = 0; i < count; i++ ) {
+                octaves[i] = tempPoint;
+                tempPoint *= 2;
+            }
+
+            NoiseLanes<batchSize>(octaves, count, noise);
+            for ( int i = 0; i < count; i++ ) {
+                accumulation += weight * noise[i];
+                weight *= 0.5;
+            }
         }
         return fabs(accumulation);
     }
+
+    void Turbulence(const Point3* points, double* results, size_t count, int depth = 7) const
+    {
+        // Batch form of Turbulence. Each octave is evaluated for a batch of points at once.
+        Point3 tempPoints[batchSize];
+        double noise[batchSize];
+        double accumulation[batchSize];
+
+        for ( size_t first = 0; first < count; first += batchSize ) {
+            int batchCount = int(std::min<size_t>(batchSize, count - first));
+            for ( int i = 0; i < batchCount; i++ ) {
+                tempPoints[i] = points[first + i];
+                accumulation[i] = 0.0;
+            }
+
+            auto weight = 1.0;
+            for ( int octave = 0; octave < depth; octave++ ) {
+                NoiseLanes<batchSize>(tempPoints, batchCount, noise);
+                for ( int i = 0; i < batchCount; i++ ) {
+                    accumulation[i] += weight * noise[i];
+                    tempPoints[i] *= 2;
+                }
+                weight *= 0.5;
+            }
+
+            for ( int i = 0; i < batchCount; i++ ) results[first + i] = fabs(accumulation[i]);
+        }
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
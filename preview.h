@@ -0,0 +1,187 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <execution>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "frameBuffer.h"
+#include "hitable.h"
+
+class PreviewSession
+{
+    // Renders a resident scene progressively for interactive look-dev. A background thread first
+    // renders one sample per block of pixels, which appears almost at once, then adds passes of
+    // one sample per pixel to a running sum until it has the camera's samples per pixel. Update
+    // changes the camera: rows being rendered see the change and stop, and the preview starts
+    // again from the block pass.
+    //
+    // Samples are seeded as Camera::Render seeds them, so a finished preview matches the render.
+
+public:
+    static const int blockSize = 4; // Pixels along each side of a block in the first pass
+
+    struct Image
+    {
+        FrameBuffer frame;     // Beauty pass of the current estimate
+        int samples = 0;       // Samples per pixel in it, or 0 for the block pass
+        bool complete = false; // Whether it has all the samples the camera asks for
+        uint64_t version = 0;  // Number of the camera update it shows
+    };
+
+    PreviewSession(shared_ptr<Hitable> _world, const Camera &_camera)
+        : world(_world), camera(_camera), renderer([this] { Run(); }) {}
+
+    ~PreviewSession()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            version++; // Cancels the pass in flight
+        }
+        changed.notify_all();
+        renderer.join();
+    }
+
+    PreviewSession(const PreviewSession &) = delete;
+    PreviewSession &operator=(const PreviewSession &) = delete;
+
+    uint64_t Update(const std::function<void(Camera &)> &change)
+    {
+        // Applies change to the camera and restarts the preview. Returns the update's number,
+        // which images rendered with it carry; the camera the session started with is number 1.
+        std::lock_guard<std::mutex> lock(mutex);
+        change(camera);
+        auto updated = ++version;
+        changed.notify_all();
+        return updated;
+    }
+
+    Image Latest() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return image;
+    }
+
+    Image WaitFor(uint64_t minVersion, int minSamples = 0) const
+    {
+        // Blocks until there's an image of the given update, or a later one, with at least
+        // minSamples samples per pixel or all it will get
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] {
+            return image.version >= minVersion && (image.samples >= minSamples || image.complete);
+        });
+        return image;
+    }
+
+private:
+    shared_ptr<Hitable> world;
+
+    mutable std::mutex mutex; // Guards camera, image and stopping
+    mutable std::condition_variable changed;
+    Camera camera; // Settings as last updated
+    Image image;
+    std::atomic<uint64_t> version = 1;
+    bool stopping = false;
+    std::thread renderer; // Last, so it starts once everything it uses is constructed
+
+    void Run()
+    {
+        Camera cam;
+        FrameBuffer sum;
+        std::vector<int> rows;
+        uint64_t rendering = 0;
+        int samples = 0, targetSamples = 0;
+        bool restart = true;
+
+        while ( true ) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stopping || version != rendering || restart || samples < targetSamples; });
+                if ( stopping ) return;
+                if ( version != rendering || restart ) {
+                    cam = camera;
+                    rendering = version;
+                    restart = true;
+                }
+            }
+
+            if ( restart ) {
+                targetSamples = cam.Prepare(*world);
+                sum = FrameBuffer(cam.imageWidth, cam.ImageHeight());
+                rows.resize(sum.height);
+                std::iota(rows.begin(), rows.end(), 0);
+                samples = 0;
+                restart = false;
+                BlockPass(cam, rendering, rows);
+                continue;
+            }
+
+            if ( !SamplePass(cam, rendering, rows, samples, sum) ) continue;
+            samples++;
+            Publish(sum, samples, samples >= targetSamples, rendering);
+        }
+    }
+
+    void BlockPass(Camera &cam, uint64_t rendering, const std::vector<int> &rows)
+    {
+        // Renders the centre of each block and shows it over the whole block
+        FrameBuffer blocks(cam.imageWidth, cam.ImageHeight());
+        auto &beauty = blocks.Beauty();
+        std::for_each(std::execution::par, rows.begin(), rows.end(), [&](int j) {
+            if ( j % blockSize != 0 || version != rendering ) return;
+            auto centreY = std::min(j + blockSize / 2, beauty.height - 1);
+            for ( int i = 0; i < beauty.width; i += blockSize ) {
+                auto colour = cam.Sample(*world, std::min(i + blockSize / 2, beauty.width - 1), centreY, 0);
+                for ( int y = j; y < std::min(j + blockSize, beauty.height); y++ ) {
+                    for ( int x = i; x < std::min(i + blockSize, beauty.width); x++ ) beauty.Set(x, y, colour);
+                }
+            }
+        });
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( version != rendering ) return;
+        image = {std::move(blocks), 0, false, rendering};
+        changed.notify_all();
+    }
+
+    bool SamplePass(Camera &cam, uint64_t rendering, const std::vector<int> &rows, int sampleIndex, FrameBuffer &sum)
+    {
+        // Adds one sample per pixel to sum. Returns false if an update cancelled the pass.
+        auto &total = sum.Beauty();
+        std::for_each(std::execution::par, rows.begin(), rows.end(), [&](int j) {
+            if ( version != rendering ) return;
+            for ( int i = 0; i < total.width; i++ ) {
+                auto pixel = total.Pixel(i, j);
+                auto colour = cam.Sample(*world, i, j, sampleIndex);
+                for ( int c = 0; c < 3; c++ ) pixel[c] += float(colour[c]);
+            }
+        });
+        return version == rendering;
+    }
+
+    void Publish(const FrameBuffer &sum, int samples, bool complete, uint64_t rendering)
+    {
+        FrameBuffer estimate(sum.width, sum.height);
+        const auto &total = sum.Beauty().data;
+        auto &mean = estimate.Beauty().data;
+        auto scale = 1.0f / std::max(samples, 1);
+        for ( size_t k = 0; k < total.size(); k++ ) mean[k] = total[k] * scale;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( version != rendering ) return;
+        image = {std::move(estimate), samples, complete, rendering};
+        changed.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "bvh.h"
+#include "camera.h"
+#include "hitableList.h"
+#include "material.h"
+#include "preview.h"
+#include "quad.h"
+#include "sphere.h"
+
+int main(int argc, char **argv)
+{
+    // Drives a preview of the Cornell box through a series of camera moves, as an interactive
+    // session would, and measures how long each move takes to show: the block pass, the first
+    // full sample and a few samples in.
+    // Usage: PreviewBenchmark [image width] [camera moves]
+    int width = (argc > 1) ? std::stoi(argv[1]) : 400;
+    int moves = (argc > 2) ? std::stoi(argv[2]) : 20;
+
+    HitableList world;
+    auto red = make_shared<Lambertian>(Colour(.65, .05, .05));
+    auto white = make_shared<Lambertian>(Colour(.73, .73, .73));
+    auto green = make_shared<Lambertian>(Colour(.12, .45, .15));
+    auto light = make_shared<DiffuseLight>(Colour(15, 15, 15));
+    world.Add(make_shared<Quad>(Point3(555, 0, 0), Vec3(0, 555, 0), Vec3(0, 0, 555), green));
+    world.Add(make_shared<Quad>(Point3(0, 0, 0), Vec3(0, 555, 0), Vec3(0, 0, 555), red));
+    world.Add(make_shared<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
+    world.Add(make_shared<Quad>(Point3(0, 0, 0), Vec3(555, 0, 0), Vec3(0, 0, 555), white));
+    world.Add(make_shared<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
+    world.Add(make_shared<Quad>(Point3(0, 0, 555), Vec3(555, 0, 0), Vec3(0, 555, 0), white));
+    shared_ptr<Hitable> box = Box(Point3(0, 0, 0), Point3(165, 330, 165), white);
+    box = make_shared<Translate>(make_shared<RotateY>(box, 15), Vec3(265, 0, 295));
+    world.Add(box);
+    world.Add(make_shared<Sphere>(Point3(190, 90, 190), 90, make_shared<Dielectric>(1.5)));
+    auto scene = make_shared<BVHNode>(world);
+
+    Camera cam;
+    cam.aspectRatio = 1.0;
+    cam.imageWidth = width;
+    cam.samplesPerPixel = 64;
+    cam.maxDepth = 50;
+    cam.background = Colour(0, 0, 0);
+    cam.verticalFOV = 40;
+    cam.lookFrom = Point3(278, 278, -800);
+    cam.lookAt = Point3(278, 278, 0);
+    cam.nextEventEstimation = true;
+
+    using Clock = std::chrono::steady_clock;
+    auto Seconds = [](Clock::time_point from) { return std::chrono::duration<double>(Clock::now() - from).count(); };
+
+    PreviewSession session(scene, cam);
+    auto startTime = Clock::now();
+    session.WaitFor(1, 0);
+    auto firstImage = Seconds(startTime);
+    session.WaitFor(1, 1);
+    auto firstSample = Seconds(startTime);
+    std::cout << std::fixed << std::setprecision(2)
+              << "Start: first image " << 1000 * firstImage << " ms, 1 spp " << 1000 * firstSample << " ms\n";
+
+    // Orbit the camera and pull focus, moving on once each move has a few samples
+    std::vector<double> toImage, toSample, toFourSamples;
+    for ( int m = 1; m <= moves; m++ ) {
+        auto angle = 0.3 * std::sin(m * 0.7);
+        auto moveTime = Clock::now();
+        auto version = session.Update([angle, m](Camera &c) {
+            c.lookFrom = Point3(278 + 1078 * std::sin(angle), 278, 278 - 1078 * std::cos(angle));
+            c.defocusAngle = (m % 2) ? 0.0 : 2.0;
+            c.focusDistance = 800 + 50 * m;
+        });
+        session.WaitFor(version, 0);
+        toImage.push_back(Seconds(moveTime));
+        session.WaitFor(version, 1);
+        toSample.push_back(Seconds(moveTime));
+        session.WaitFor(version, 4);
+        toFourSamples.push_back(Seconds(moveTime));
+    }
+
+    // A move made while a pass is in flight cancels it
+    auto version = session.Update([](Camera &c) { c.lookFrom = Point3(278, 278, -700); });
+    session.WaitFor(version, 1);
+    auto cancelTime = Clock::now();
+    version = session.Update([](Camera &c) { c.lookFrom = Point3(278, 278, -800); });
+    session.WaitFor(version, 0);
+    auto cancelled = Seconds(cancelTime);
+
+    auto Report = [](const char *label, std::vector<double> times) {
+        std::sort(times.begin(), times.end());
+        auto mean = 0.0;
+        for ( auto t : times ) mean += t;
+        mean /= times.size();
+        std::cout << label << ": mean " << 1000 * mean << " ms, median " << 1000 * times[times.size() / 2]
+                  << " ms, max " << 1000 * times.back() << " ms\n";
+    };
+    std::cout << moves << " camera moves at " << width << "x" << width << "\n";
+    Report("  First image", toImage);
+    Report("  1 spp      ", toSample);
+    Report("  4 spp      ", toFourSamples);
+    std::cout << "Move during a pass to its first image: " << 1000 * cancelled << " ms\n";
+    return 0;
+}
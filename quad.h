@@ -3,8 +3,10 @@
 
 #include <cmath>
 
+#include "colour.h"
 #include "hitable.h"
 #include "hitableList.h"
+#include "material.h"
 #include "rtweekend.h"
 
 class Quad : public Hitable
@@ -16,8 +18,8 @@ private:
     shared_ptr<Material> material;
     AABB boundingBox;
     Vec3 normal;
-    double D;
-    double area;
+    Real D;
+    Real area;
 
 public:
     Quad(const Point3 &_Q, const Vec3 &_u, const Vec3 &_v, shared_ptr<Material> _material)
@@ -38,7 +40,7 @@ public:
         // Compute the bounding box of all four vertices
         auto boundingBoxDiagonal1 = AABB(Q, Q + u + v);
         auto boundingBoxDiagonal2 = AABB(Q + u, Q + v);
-        boundingBox = AABB(boundingBoxDiagonal1, boundingBoxDiagonal2);
+        boundingBox = AABB(boundingBoxDiagonal1, boundingBoxDiagonal2).Pad(); // Axis-aligned quads are flat
     }
 
     AABB BoundingBox() const override { return boundingBox; }
@@ -65,8 +67,11 @@ public:
         // Ray hits the 2D shape; set the rest of the hit record and return true
         record.t = t;
         record.point = intersection;
+        record.pointError = 0;
         record.material = material;
         record.SetFaceNormal(ray, normal);
+        record.SetSurfaceDerivatives(u, v);
+        record.velocity = Vec3();
 
         return true;
     }
@@ -86,7 +91,7 @@ public:
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
         HitRecord record;
-        if ( !this->Hit(Ray(origin, direction, 0.0), Interval(0.001, maxDouble), record) ) return 0;
+        if ( !this->Hit(Ray(origin, direction, 0.0), Interval(0, maxDouble), record) ) return 0;
 
         auto distanceSquared = record.t * record.t * direction.LengthSquared();
         auto cosine = std::fabs(Dot(direction, record.normal) / direction.Length());
@@ -99,56 +104,181 @@ public:
         auto p = Q + (RandomDouble() * u) + (RandomDouble() * v);
         return p - origin;
     }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        if ( material ) lights.AddEmitter(self, Luminance(material->AverageEmission()) * area);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { materials.push_back(material.get()); }
 };
 
-// class Box : public Hitable
-// {
-// public:
-//     shared_ptr<HitableList> sides;
+class AxisAlignedBox : public Hitable
+{
+    // A solid box intersected with a single slab test. Faces report the same normals and UV
+    // coordinates as the six quads Box() used to build.
 
-//     Box(const Point3 &a, const Point3 &b, shared_ptr<Material> material)
-//     {
-//         // Construct the two opposite verticles with the minimum and maximum coordinates.
-//         auto min = Point3(fmin(a.X(), b.X()), fmin(a.Y(), b.Y()), fmin(a.Z(), b.Z()));
-//         auto max = Point3(fmax(a.X(), b.X()), fmax(a.Y(), b.Y()), fmax(a.Z(), b.Z()));
+private:
+    Point3 min;
+    Point3 max;
+    shared_ptr<Material> material;
+    AABB boundingBox;
 
-//         auto dx = Vec3(max.X() - min.X(), 0, 0);
-//         auto dy = Vec3(0, max.Y() - min.Y(), 0);
-//         auto dz = Vec3(0, 0, max.Z() - min.Z());
+    double FaceCoordinate(const Point3 &p, int axis, bool flip) const
+    {
+        // Returns p's coordinate along axis as a fraction of the box width, measured from the
+        // max side when flip is set
+        auto size = max[axis] - min[axis];
+        if ( size <= 0 ) return 0;
+        return flip ? (max[axis] - p[axis]) / size : (p[axis] - min[axis]) / size;
+    }
 
-//         sides->Add(make_shared<Quad>(Point3(min.X(), min.Y(), max.Z()), dx, dy, material));  // front
-//         sides->Add(make_shared<Quad>(Point3(max.X(), min.Y(), max.Z()), -dz, dy, material)); // right
-//         sides->Add(make_shared<Quad>(Point3(max.X(), min.Y(), min.Z()), -dx, dy, material)); // back
-//         sides->Add(make_shared<Quad>(Point3(min.X(), min.Y(), min.Z()), dz, dy, material));  // left
-//         sides->Add(make_shared<Quad>(Point3(min.X(), max.Y(), max.Z()), dx, -dz, material)); // top
-//         sides->Add(make_shared<Quad>(Point3(min.X(), min.Y(), min.Z()), dx, dz, material));  // bottom
-//     }
+    void FaceUV(const Point3 &p, int axis, bool maxSide, double &u, double &v) const
+    {
+        if ( axis == 0 ) { // right / left
+            u = FaceCoordinate(p, 2, maxSide);
+            v = FaceCoordinate(p, 1, false);
+        } else if ( axis == 1 ) { // top / bottom
+            u = FaceCoordinate(p, 0, false);
+            v = FaceCoordinate(p, 2, maxSide);
+        } else { // front / back
+            u = FaceCoordinate(p, 0, !maxSide);
+            v = FaceCoordinate(p, 1, false);
+        }
+    }
 
-//     shared_ptr<HitableList> Sides() const { return sides; }
-// };
+    void FaceDerivatives(int axis, bool maxSide, Vec3 &dpdu, Vec3 &dpdv) const
+    {
+        // Derivatives of the face point with respect to the coordinates FaceUV returns
+        auto size = max - min;
+        dpdu = dpdv = Vec3();
+        if ( axis == 0 ) {
+            dpdu[2] = maxSide ? -size[2] : size[2];
+            dpdv[1] = size[1];
+        } else if ( axis == 1 ) {
+            dpdu[0] = size[0];
+            dpdv[2] = maxSide ? -size[2] : size[2];
+        } else {
+            dpdu[0] = maxSide ? size[0] : -size[0];
+            dpdv[1] = size[1];
+        }
+    }
 
-inline shared_ptr<HitableList> Box(const Point3 &a, const Point3 &b, shared_ptr<Material> material)
-{
-    // Returns the 3D box (six sides) that contains the top opposite vertices a & b.
+public:
+    AxisAlignedBox(const Point3 &a, const Point3 &b, shared_ptr<Material> _material)
+        : material(_material)
+    {
+        // Construct the two opposite vertices with the minimum and maximum coordinates.
+        min = Point3(fmin(a.X(), b.X()), fmin(a.Y(), b.Y()), fmin(a.Z(), b.Z()));
+        max = Point3(fmax(a.X(), b.X()), fmax(a.Y(), b.Y()), fmax(a.Z(), b.Z()));
+        boundingBox = AABB(min, max).Pad();
+    }
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
+    {
+        // Slab test that remembers which axis produced the entry and exit distances
+        auto tNear = -maxDouble;
+        auto tFar = maxDouble;
+        int nearAxis = 0;
+        int farAxis = 0;
+
+        for ( int a = 0; a < 3; a++ ) {
+            auto inverseDirection = 1 / ray.Direction()[a];
+            auto origin = ray.Origin()[a];
+
+            auto t0 = (min[a] - origin) * inverseDirection;
+            auto t1 = (max[a] - origin) * inverseDirection;
+
+            if ( inverseDirection < 0 ) std::swap(t0, t1);
+
+            if ( t0 > tNear ) {
+                tNear = t0;
+                nearAxis = a;
+            }
+            if ( t1 < tFar ) {
+                tFar = t1;
+                farAxis = a;
+            }
+        }
+
+        if ( tNear > tFar ) return false;
+
+        // Take the entry face, or the exit face when the ray starts inside the box
+        Real t;
+        int axis;
+        bool entering;
+        if ( rayT.Contains(tNear) ) {
+            t = tNear;
+            axis = nearAxis;
+            entering = true;
+        } else if ( rayT.Contains(tFar) ) {
+            t = tFar;
+            axis = farAxis;
+            entering = false;
+        } else {
+            return false;
+        }
+
+        // Faces are entered against the direction of travel and exited along it
+        bool maxSide = (ray.Direction()[axis] < 0) == entering;
+        Vec3 outwardNormal(0, 0, 0);
+        outwardNormal[axis] = maxSide ? 1 : -1;
+
+        record.t = t;
+        record.point = ray.At(t);
+        record.point[axis] = maxSide ? max[axis] : min[axis]; // Snap onto the face plane
+        record.pointError = 0;
+        record.material = material;
+        record.SetFaceNormal(ray, outwardNormal);
+        FaceUV(record.point, axis, maxSide, record.u, record.v);
+
+        Vec3 dpdu, dpdv;
+        FaceDerivatives(axis, maxSide, dpdu, dpdv);
+        record.SetSurfaceDerivatives(dpdu, dpdv);
+        record.velocity = Vec3();
+
+        return true;
+    }
 
-    auto sides = make_shared<HitableList>();
+    bool Span(const Ray &ray, Interval &span) const override
+    {
+        // The slab interval itself
+        span = Interval(-maxDouble, maxDouble);
+        for ( int a = 0; a < 3; a++ ) {
+            auto inverseDirection = 1 / ray.Direction()[a];
+            auto origin = ray.Origin()[a];
+
+            auto t0 = (min[a] - origin) * inverseDirection;
+            auto t1 = (max[a] - origin) * inverseDirection;
+
+            if ( inverseDirection < 0 ) std::swap(t0, t1);
 
-    // Construct the two opposite verticles with the minimum and maximum coordinates.
-    auto min = Point3(fmin(a.X(), b.X()), fmin(a.Y(), b.Y()), fmin(a.Z(), b.Z()));
-    auto max = Point3(fmax(a.X(), b.X()), fmax(a.Y(), b.Y()), fmax(a.Z(), b.Z()));
+            if ( t0 > span.min ) span.min = t0;
+            if ( t1 < span.max ) span.max = t1;
+        }
 
-    auto dx = Vec3(max.X() - min.X(), 0, 0);
-    auto dy = Vec3(0, max.Y() - min.Y(), 0);
-    auto dz = Vec3(0, 0, max.Z() - min.Z());
+        return span.min < span.max;
+    }
 
-    sides->Add(make_shared<Quad>(Point3(min.X(), min.Y(), max.Z()), dx, dy, material));  // front
-    sides->Add(make_shared<Quad>(Point3(max.X(), min.Y(), max.Z()), -dz, dy, material)); // right
-    sides->Add(make_shared<Quad>(Point3(max.X(), min.Y(), min.Z()), -dx, dy, material)); // back
-    sides->Add(make_shared<Quad>(Point3(min.X(), min.Y(), min.Z()), dz, dy, material));  // left
-    sides->Add(make_shared<Quad>(Point3(min.X(), max.Y(), max.Z()), dx, -dz, material)); // top
-    sides->Add(make_shared<Quad>(Point3(min.X(), min.Y(), min.Z()), dx, dz, material));  // bottom
+    AABB BoundingBox() const override { return boundingBox; }
 
-    return sides;
+    double PDFValue(const Point3 &origin, const Vec3 &direction) const override
+    {
+        return 0.0;
+    }
+
+    Vec3 Random(const Point3 &origin) const override
+    {
+        return Vec3(1, 0, 0);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { materials.push_back(material.get()); }
+};
+
+inline shared_ptr<HitableList> Box(const Point3 &a, const Point3 &b, shared_ptr<Material> material)
+{
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    return make_shared<HitableList>(make_shared<AxisAlignedBox>(a, b, material));
 }
 
 #endif
\ No newline at end of file
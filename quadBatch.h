@@ -0,0 +1,200 @@
+#ifndef QUAD_BATCH_H
+#define QUAD_BATCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "hitable.h"
+#include "hitableList.h"
+
+class QuadBatch : public Hitable
+{
+public:
+    static const int maxQuads = 8; // Lanes tested together
+
+private:
+    // Structure-of-arrays quad data, following the fields of Quad. Lanes past `count` repeat the
+    // first quad so the kernel can always run over every lane without masking.
+    alignas(64) Real qX[maxQuads], qY[maxQuads], qZ[maxQuads];
+    alignas(64) Real uX[maxQuads], uY[maxQuads], uZ[maxQuads];
+    alignas(64) Real vX[maxQuads], vY[maxQuads], vZ[maxQuads];
+    alignas(64) Real wX[maxQuads], wY[maxQuads], wZ[maxQuads];
+    alignas(64) Real normalX[maxQuads], normalY[maxQuads], normalZ[maxQuads];
+    alignas(64) Real D[maxQuads];
+    uint32_t materialIndex[maxQuads];
+
+    shared_ptr<const std::vector<shared_ptr<Material>>> materials; // Palette shared by all batches
+    AABB boundingBox;
+
+public:
+    struct QuadData
+    {
+        Point3 Q;
+        Vec3 u, v;
+        uint32_t materialIndex;
+    };
+
+    QuadBatch(const QuadData *quads, int quadCount, shared_ptr<const std::vector<shared_ptr<Material>>> palette)
+        : materials(palette)
+    {
+        for ( int i = 0; i < maxQuads; i++ ) {
+            const auto &quad = quads[(i < quadCount) ? i : 0];
+            auto n = Cross(quad.u, quad.v);
+            auto normal = UnitVector(n);
+            auto w = n / Dot(n, n);
+
+            qX[i] = quad.Q.X(), qY[i] = quad.Q.Y(), qZ[i] = quad.Q.Z();
+            uX[i] = quad.u.X(), uY[i] = quad.u.Y(), uZ[i] = quad.u.Z();
+            vX[i] = quad.v.X(), vY[i] = quad.v.Y(), vZ[i] = quad.v.Z();
+            wX[i] = w.X(), wY[i] = w.Y(), wZ[i] = w.Z();
+            normalX[i] = normal.X(), normalY[i] = normal.Y(), normalZ[i] = normal.Z();
+            D[i] = Dot(normal, quad.Q);
+            materialIndex[i] = quad.materialIndex;
+
+            boundingBox = AABB(boundingBox, AABB(AABB(quad.Q, quad.Q + quad.u + quad.v), AABB(quad.Q + quad.u, quad.Q + quad.v)));
+        }
+
+        boundingBox = boundingBox.Pad();
+    }
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
+    {
+        const auto o = ray.Origin();
+        const auto d = ray.Direction();
+
+        // Intersect every lane at once with the same plane and barycentric tests as Quad::Hit.
+        // The loop is branch free so it compiles to packed compares and blends.
+        alignas(64) Real roots[maxQuads], alphas[maxQuads], betas[maxQuads];
+        for ( int i = 0; i < maxQuads; i++ ) {
+            auto denominator = normalX[i] * d.X() + normalY[i] * d.Y() + normalZ[i] * d.Z();
+            auto t = (D[i] - (normalX[i] * o.X() + normalY[i] * o.Y() + normalZ[i] * o.Z())) / denominator;
+
+            // Planar hit point vector relative to Q
+            auto pX = o.X() + t * d.X() - qX[i];
+            auto pY = o.Y() + t * d.Y() - qY[i];
+            auto pZ = o.Z() + t * d.Z() - qZ[i];
+
+            // alpha = w . (p x v), beta = w . (u x p)
+            auto alpha = wX[i] * (pY * vZ[i] - pZ * vY[i]) + wY[i] * (pZ * vX[i] - pX * vZ[i]) + wZ[i] * (pX * vY[i] - pY * vX[i]);
+            auto beta = wX[i] * (uY[i] * pZ - uZ[i] * pY) + wY[i] * (uZ[i] * pX - uX[i] * pZ) + wZ[i] * (uX[i] * pY - uY[i] * pX);
+
+            bool hit = std::fabs(denominator) >= 1e-8 && rayT.min <= t && t <= rayT.max &&
+                       alpha >= 0 && alpha <= 1 && beta >= 0 && beta <= 1;
+            roots[i] = hit ? t : maxDouble;
+            alphas[i] = alpha;
+            betas[i] = beta;
+        }
+
+        int closest = 0;
+        for ( int i = 1; i < maxQuads; i++ ) {
+            if ( roots[i] < roots[closest] ) closest = i;
+        }
+        if ( roots[closest] == maxDouble ) return false;
+
+        record.t = roots[closest];
+        record.point = ray.At(record.t);
+        record.pointError = 0;
+        record.u = alphas[closest];
+        record.v = betas[closest];
+        record.material = (*materials)[materialIndex[closest]];
+        record.SetFaceNormal(ray, Vec3(normalX[closest], normalY[closest], normalZ[closest]));
+        record.SetSurfaceDerivatives(Vec3(uX[closest], uY[closest], uZ[closest]), Vec3(vX[closest], vY[closest], vZ[closest]));
+        record.velocity = Vec3();
+
+        return true;
+    }
+
+    AABB BoundingBox() const override { return boundingBox; }
+
+    double PDFValue(const Point3 &origin, const Vec3 &direction) const override
+    {
+        return 0.0;
+    }
+
+    Vec3 Random(const Point3 &origin) const override
+    {
+        return Vec3(1, 0, 0);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &collected) const override
+    {
+        for ( int i = 0; i < maxQuads; i++ ) collected.push_back((*materials)[materialIndex[i]].get());
+    }
+};
+
+class QuadCollection
+{
+    // Gathers many quads and packs them into spatially coherent QuadBatch primitives. Batched quads
+    // can't be importance sampled, so keep light sources as individual Quads.
+
+private:
+    std::vector<QuadBatch::QuadData> quads;
+    std::vector<shared_ptr<Material>> materials;
+    std::unordered_map<const Material *, uint32_t> materialIndices;
+
+    uint32_t MaterialIndex(shared_ptr<Material> material)
+    {
+        auto [entry, inserted] = materialIndices.try_emplace(material.get(), uint32_t(materials.size()));
+        if ( inserted ) materials.push_back(material);
+        return entry->second;
+    }
+
+    static Point3 Centre(const QuadBatch::QuadData &quad)
+    {
+        return quad.Q + 0.5 * (quad.u + quad.v);
+    }
+
+    static void Pack(std::vector<QuadBatch::QuadData> &quads, size_t start, size_t end,
+                     shared_ptr<const std::vector<shared_ptr<Material>>> palette, HitableList &batches)
+    {
+        // Recursively median split along the longest axis until each range fits in one batch
+        size_t span = end - start;
+        if ( span <= size_t(QuadBatch::maxQuads) ) {
+            batches.Add(make_shared<QuadBatch>(quads.data() + start, int(span), palette));
+            return;
+        }
+
+        AABB bounds;
+        for ( size_t i = start; i < end; i++ ) {
+            bounds = AABB(bounds, AABB(Centre(quads[i]), Centre(quads[i])));
+        }
+
+        int axis = 0;
+        for ( int a = 1; a < 3; a++ ) {
+            if ( bounds.Axis(a).Size() > bounds.Axis(axis).Size() ) axis = a;
+        }
+
+        // Keep the left half a whole number of batches so batches stay full
+        auto mid = start + std::max<size_t>(QuadBatch::maxQuads, (span / 2) / QuadBatch::maxQuads * QuadBatch::maxQuads);
+        std::nth_element(quads.begin() + start, quads.begin() + mid, quads.begin() + end,
+                         [axis](const QuadBatch::QuadData &a, const QuadBatch::QuadData &b) {
+                             return Centre(a)[axis] < Centre(b)[axis];
+                         });
+
+        Pack(quads, start, mid, palette, batches);
+        Pack(quads, mid, end, palette, batches);
+    }
+
+public:
+    void Add(const Point3 &Q, const Vec3 &u, const Vec3 &v, shared_ptr<Material> material)
+    {
+        quads.push_back({Q, u, v, MaterialIndex(material)});
+    }
+
+    HitableList Batches() const
+    {
+        // Returns the packed batches, ready to be added to a scene or built into a BVH
+        auto palette = make_shared<const std::vector<shared_ptr<Material>>>(materials);
+        auto quadsCopy = quads;
+
+        HitableList batches;
+        if ( !quadsCopy.empty() ) Pack(quadsCopy, 0, quadsCopy.size(), palette, batches);
+        return batches;
+    }
+};
+
+#endif
@@ -1,8 +1,18 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <memory>
+
 #include "vec3.h"
 
+struct RayDifferentials
+{
+    // The rays through the neighbouring pixel in x and in y, used to estimate a ray's footprint
+    // on the surfaces it hits
+    Point3 rxOrigin, ryOrigin;
+    Vec3 rxDirection, ryDirection;
+};
+
 class Ray
 {
 private:
@@ -11,6 +21,10 @@ private:
     double time;
 
 public:
+    // Optional ray differentials. Only camera rays and their specular bounces have them, so
+    // they're kept out of line and the rest, shadow and scatter rays included, carry a null pointer.
+    std::shared_ptr<const RayDifferentials> differentials;
+
     Ray() {}
 
     Ray(const Point3 &orig, const Vec3 &dir) : origin(orig), direction(dir), time(0) {}
@@ -24,7 +38,7 @@ public:
 
     double Time() const { return time; }
 
-    Point3 At(double t) const
+    Point3 At(Real t) const
     {
         return origin + t * direction;
     }
@@ -0,0 +1,417 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hitable.h"
+#include "localSocket.h"
+#include "sceneSetup.h"
+
+class RenderServer
+{
+    // A long-running renderer taking jobs over a Unix domain socket. A client sends one line,
+    //
+    //     render scene=<name> [priority=<n>] [<camera setting>=<value> ...]
+    //
+    // and the server answers on the same connection as the job goes along: "queued <id>",
+    // "started <id> cached|built <setup seconds>", "progress <id> <percent>" and finally
+    // "done <id> <render seconds> <output stem>" or "error <id> <message>". Settings are named
+    // after the Camera's fields, with vectors written x,y,z and the crop window x0,y0,x1,y1.
+    // "shutdown" finishes the queued jobs and stops the server.
+    //
+    // Jobs run one at a time, as a render already uses every core: highest priority first, then
+    // in arrival order. Built scenes stay in a least recently used cache keyed by a hash of what
+    // they're built from, so rendering a scene again, say from a new viewpoint, starts tracing
+    // without rebuilding its textures or BVHs.
+
+public:
+    using Builder = std::function<SceneSetup()>;
+
+    explicit RenderServer(size_t _cacheCapacity = 4) : cacheCapacity(_cacheCapacity ? _cacheCapacity : 1) {}
+
+    void Register(const std::string &name, Builder builder) { builders[name] = builder; }
+
+    int Run(const std::string &socketPath)
+    {
+        // Serves until a shutdown request. Returns a process exit code.
+        int listener = LocalSocket::Listen(socketPath);
+        if ( listener < 0 ) {
+            std::cerr << "ERROR: Could not listen on '" << socketPath << "'.\n";
+            return 1;
+        }
+        std::clog << "Serving on '" << socketPath << "'\n"
+                  << std::flush;
+
+        // Request lines are read as they arrive, alongside new connections, so a client that
+        // connects and says nothing only ever holds up itself
+        std::thread renderer([this] { RenderJobs(); });
+        std::vector<PendingRequest> pending;
+        while ( true ) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if ( stopping ) break;
+            }
+            std::vector<pollfd> polled = {{listener, POLLIN, 0}};
+            for ( const auto &request : pending ) polled.push_back({request.fd, POLLIN, 0});
+            if ( poll(polled.data(), polled.size(), 100) > 0 ) {
+                for ( size_t k = 1; k < polled.size(); k++ ) {
+                    if ( polled[k].revents ) ReadRequest(pending[k - 1]);
+                }
+                if ( polled[0].revents & POLLIN ) {
+                    int fd = accept(listener, nullptr, nullptr);
+                    if ( fd >= 0 ) pending.push_back({fd, "", std::chrono::steady_clock::now() + requestTimeout});
+                }
+            }
+
+            // Forget requests that were handled, and drop those that took too long to arrive
+            auto now = std::chrono::steady_clock::now();
+            std::erase_if(pending, [now](const PendingRequest &request) {
+                if ( request.fd >= 0 && now < request.deadline ) return false;
+                if ( request.fd >= 0 ) close(request.fd);
+                return true;
+            });
+        }
+        for ( const auto &request : pending ) close(request.fd);
+
+        renderer.join();
+        close(listener);
+        unlink(socketPath.c_str());
+        return 0;
+    }
+
+    static int Submit(const std::string &socketPath, const std::string &request, std::ostream &out)
+    {
+        // Sends a request to the server on socketPath and copies its replies to out until it
+        // closes the connection. Returns 0 if the request succeeded.
+        int fd = LocalSocket::Connect(socketPath);
+        if ( fd < 0 ) {
+            std::cerr << "ERROR: Could not connect to '" << socketPath << "'.\n";
+            return 1;
+        }
+
+        bool succeeded = false;
+        std::string line;
+        LocalSocket::SendLine(fd, request);
+        while ( LocalSocket::ReceiveLine(fd, line) ) {
+            out << line << "\n"
+                << std::flush;
+            succeeded = line.starts_with("done ") || line == "stopping";
+        }
+        close(fd);
+        return succeeded ? 0 : 1;
+    }
+
+private:
+    struct Job
+    {
+        uint64_t id;
+        int priority;
+        std::string scene;
+        std::vector<std::pair<std::string, std::string>> settings;
+        int fd; // Connection the job's replies go to
+    };
+
+    struct JobOrder
+    {
+        // Orders the queue so its top is the highest priority job that arrived first
+        bool operator()(const Job &a, const Job &b) const
+        {
+            return (a.priority != b.priority) ? a.priority < b.priority : a.id > b.id;
+        }
+    };
+
+    struct PendingRequest
+    {
+        int fd;                                         // Set to -1 once the request is handled
+        std::string received;                           // What has arrived of the request line
+        std::chrono::steady_clock::time_point deadline; // When to give up on the rest of it
+    };
+
+    static constexpr std::chrono::seconds requestTimeout{5};
+    static const size_t maxRequestLength = 65536;
+
+    struct CachedScene
+    {
+        uint64_t key;
+        shared_ptr<const SceneSetup> scene;
+    };
+
+    std::unordered_map<std::string, Builder> builders;
+
+    // Only the render thread uses the cache
+    size_t cacheCapacity;
+    std::list<CachedScene> cache; // Most recently used first
+    std::unordered_map<uint64_t, std::list<CachedScene>::iterator> cacheIndex;
+
+    std::mutex mutex; // Guards the queue and stopping
+    std::condition_variable changed;
+    std::priority_queue<Job, std::vector<Job>, JobOrder> jobs;
+    bool stopping = false;
+    uint64_t nextID = 1;
+
+    static uint64_t Key(const std::string &name)
+    {
+        // FNV-1a over what a scene is built from, which for a registered scene is its name
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for ( unsigned char c : name ) {
+            hash = (hash ^ c) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    static bool ParseNumber(const std::string &text, double &value)
+    {
+        std::istringstream stream(text);
+        return (stream >> value) && stream.eof();
+    }
+
+    static bool ParseVector(const std::string &text, Vec3 &value)
+    {
+        std::istringstream stream(text);
+        char comma1 = 0, comma2 = 0;
+        double x, y, z;
+        if ( !(stream >> x >> comma1 >> y >> comma2 >> z) || !stream.eof() || comma1 != ',' || comma2 != ',' ) return false;
+        value = Vec3(x, y, z);
+        return true;
+    }
+
+    static bool ParseRect(const std::string &text, PixelRect &value)
+    {
+        std::istringstream stream(text);
+        char comma1 = 0, comma2 = 0, comma3 = 0;
+        int x0, y0, x1, y1;
+        if ( !(stream >> x0 >> comma1 >> y0 >> comma2 >> x1 >> comma3 >> y1) || !stream.eof() || comma1 != ',' || comma2 != ',' || comma3 != ',' ) return false;
+        value = {x0, y0, x1, y1};
+        return true;
+    }
+
+    // Numbers are checked against this before conversion to int, where larger ones are undefined
+    static constexpr double largestInt = std::numeric_limits<int>::max();
+
+    static int MaxWorkerProcesses()
+    {
+        // Any client can ask for workers, so a request can't fork more than there are cores
+        return std::max(1, int(std::thread::hardware_concurrency()));
+    }
+
+    static bool ApplySetting(Camera &cam, const std::string &name, const std::string &text)
+    {
+        // Sets the camera field called name from its text. Returns false for an unknown field
+        // or a value that doesn't parse or is out of range.
+        double number;
+        if ( name == "lookFrom" ) return ParseVector(text, cam.lookFrom);
+        if ( name == "lookAt" ) return ParseVector(text, cam.lookAt);
+        if ( name == "vecUp" ) return ParseVector(text, cam.vecUp);
+        if ( name == "background" ) return ParseVector(text, cam.background);
+        if ( name == "crop" ) return ParseRect(text, cam.crop);
+        if ( !ParseNumber(text, number) ) return false;
+
+        if ( name == "aspectRatio" && number > 0 ) {
+            cam.aspectRatio = number;
+        } else if ( name == "imageWidth" && number >= 1 && number <= largestInt ) {
+            cam.imageWidth = int(number);
+        } else if ( name == "samplesPerPixel" && number >= 1 && number <= largestInt ) {
+            cam.samplesPerPixel = int(number);
+        } else if ( name == "maxDepth" && number >= 1 && number <= largestInt ) {
+            cam.maxDepth = int(number);
+        } else if ( name == "verticalFOV" && number > 0 && number < 180 ) {
+            cam.verticalFOV = number;
+        } else if ( name == "defocusAngle" && number >= 0 ) {
+            cam.defocusAngle = number;
+        } else if ( name == "focusDistance" && number > 0 ) {
+            cam.focusDistance = number;
+        } else if ( name == "nextEventEstimation" ) {
+            cam.nextEventEstimation = number != 0;
+        } else if ( name == "denoise" ) {
+            cam.denoise = number != 0;
+        } else if ( name == "writeHDR" ) {
+            cam.writeHDR = number != 0;
+        } else if ( name == "writePFM" ) {
+            cam.writePFM = number != 0;
+        } else if ( name == "writeEXR" ) {
+            cam.writeEXR = number != 0;
+        } else if ( name == "exposure" ) {
+            cam.toneMapping.exposure = number;
+        } else if ( name == "seed" && number >= 0 && number < 0x1p64 ) {
+            cam.seed = uint64_t(number);
+        } else if ( name == "workerProcesses" && number >= 0 && number <= MaxWorkerProcesses() ) {
+            cam.workerProcesses = int(number);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void ReadRequest(PendingRequest &request)
+    {
+        // Takes whatever has arrived without waiting for more, and handles the request once its
+        // line is complete. A client that closes its end after a line without a newline still
+        // gets it handled.
+        char buffer[4096];
+        auto received = recv(request.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if ( received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ) return;
+        if ( received > 0 ) request.received.append(buffer, size_t(received));
+
+        auto newline = request.received.find('\n');
+        if ( newline != std::string::npos || (received == 0 && !request.received.empty()) ) {
+            HandleRequest(request.fd, request.received.substr(0, newline));
+        } else if ( received > 0 && request.received.size() < maxRequestLength ) {
+            return;
+        } else {
+            close(request.fd);
+        }
+        request.fd = -1;
+    }
+
+    void HandleRequest(int fd, const std::string &line)
+    {
+        // Queues a request's job, or answers it straight away
+        std::istringstream words(line);
+        std::string command;
+        words >> command;
+        if ( command == "shutdown" ) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            LocalSocket::SendLine(fd, "stopping");
+            close(fd);
+            return;
+        }
+
+        Job job = {0, 0, "", {}, fd};
+        std::string error = (command == "render") ? "" : "unknown command '" + command + "'";
+        Camera check;
+        for ( std::string word; error.empty() && words >> word; ) {
+            auto equals = word.find('=');
+            auto name = word.substr(0, equals);
+            auto value = (equals == std::string::npos) ? "" : word.substr(equals + 1);
+            double priority;
+            if ( name == "scene" ) {
+                job.scene = value;
+            } else if ( name == "priority" && ParseNumber(value, priority) && std::fabs(priority) <= largestInt ) {
+                job.priority = int(priority);
+            } else if ( ApplySetting(check, name, value) ) {
+                job.settings.emplace_back(name, value);
+            } else {
+                error = "bad setting '" + word + "'";
+            }
+        }
+        if ( error.empty() && !builders.contains(job.scene) ) error = "unknown scene '" + job.scene + "'";
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if ( error.empty() && stopping ) error = "server is stopping";
+        if ( !error.empty() ) {
+            LocalSocket::SendLine(fd, "error 0 " + error);
+            close(fd);
+            return;
+        }
+        job.id = nextID++;
+        LocalSocket::SendLine(fd, "queued " + std::to_string(job.id));
+        jobs.push(job);
+        changed.notify_all();
+    }
+
+    void RenderJobs()
+    {
+        while ( true ) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if ( jobs.empty() ) return;
+                job = jobs.top();
+                jobs.pop();
+            }
+            RenderJob(job);
+            close(job.fd);
+        }
+    }
+
+    shared_ptr<const SceneSetup> FindScene(const std::string &name, bool &cached)
+    {
+        auto key = Key(name);
+        auto found = cacheIndex.find(key);
+        cached = found != cacheIndex.end();
+        if ( cached ) {
+            cache.splice(cache.begin(), cache, found->second);
+            return cache.front().scene;
+        }
+
+        // Seeded, so a scene drawn from random numbers builds the same every time
+        SeedRandom(key);
+        auto scene = make_shared<const SceneSetup>(builders.at(name)());
+        cache.push_front({key, scene});
+        cacheIndex[key] = cache.begin();
+        if ( cache.size() > cacheCapacity ) {
+            cacheIndex.erase(cache.back().key);
+            cache.pop_back();
+        }
+        return scene;
+    }
+
+    void RenderJob(const Job &job)
+    {
+        auto id = std::to_string(job.id);
+        try {
+            auto startTime = std::chrono::steady_clock::now();
+            bool cached;
+            auto scene = FindScene(job.scene, cached);
+
+            Camera cam = scene->camera;
+            for ( const auto &[name, value] : job.settings ) {
+                ApplySetting(cam, name, value);
+            }
+            cam.asyncOutput = false; // Files must be complete before the job is reported done
+
+            // Rows finish on many threads, so report each whole percent once
+            std::mutex progressMutex;
+            int lastPercent = -1;
+            cam.progress = [&](double fraction) {
+                std::lock_guard<std::mutex> lock(progressMutex);
+                int percent = int(100 * fraction);
+                if ( percent <= lastPercent ) return;
+                lastPercent = percent;
+                LocalSocket::SendLine(job.fd, "progress " + id + " " + std::to_string(percent));
+            };
+
+            std::chrono::duration<double> setupTime(std::chrono::steady_clock::now() - startTime);
+            LocalSocket::SendLine(job.fd, "started " + id + (cached ? " cached " : " built ") + std::to_string(setupTime.count()));
+
+            auto renderStart = std::chrono::steady_clock::now();
+            cam.Render(*scene->world);
+            std::chrono::duration<double> renderTime(std::chrono::steady_clock::now() - renderStart);
+            LocalSocket::SendLine(job.fd, "done " + id + " " + std::to_string(renderTime.count()) + " " + cam.OutputStem());
+        } catch ( const std::exception &e ) {
+            LocalSocket::SendLine(job.fd, "error " + id + " " + e.what());
+        }
+    }
+};
+
+#endif
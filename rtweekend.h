@@ -2,6 +2,7 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -11,6 +12,14 @@ using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 
+// Floating point type for geometry: vectors, rays, intervals, bounding boxes and primitive data.
+// Define RTW_SINGLE_PRECISION to store and intersect geometry in float.
+#ifdef RTW_SINGLE_PRECISION
+using Real = float;
+#else
+using Real = double;
+#endif
+
 // Constants
 const double maxDouble = std::numeric_limits<double>::infinity();
 const double PI = 3.1415926535897932385;
@@ -21,10 +30,32 @@ inline double DegreesTooRadians(double degrees)
     return degrees * PI / 180.0;
 }
 
+inline uint64_t &RandomState()
+{
+    // Each thread draws from its own generator, so samples don't contend for a shared one and
+    // a sample's random numbers depend only on the seed it was given
+    thread_local uint64_t state = 0;
+    return state;
+}
+
+inline uint64_t MixBits(uint64_t z)
+{
+    // SplitMix64 finaliser: nearby inputs give unrelated outputs
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+inline void SeedRandom(uint64_t seed)
+{
+    RandomState() = MixBits(seed);
+}
+
 inline double RandomDouble()
 {
-    // Returns a random real in [0,1)
-    return std::rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1), stepping this thread's SplitMix64 generator
+    uint64_t z = MixBits(RandomState() += 0x9e3779b97f4a7c15ull);
+    return (z >> 11) * 0x1.0p-53;
 }
 
 inline double RandomDouble(double min, double max)
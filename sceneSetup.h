@@ -0,0 +1,18 @@
+#ifndef SCENE_SETUP_H
+#define SCENE_SETUP_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hitable.h"
+
+struct SceneSetup
+{
+    // A world and the camera framing it, as a scene function builds them
+    shared_ptr<Hitable> world;
+    Camera camera;
+
+    void Render() { camera.Render(*world); }
+};
+
+#endif
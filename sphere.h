@@ -1,7 +1,9 @@
 #ifndef SPHERE_H
 #define SPHERE_H
 
+#include "colour.h"
 #include "hitable.h"
+#include "material.h"
 #include "onb.h"
 #include "vec3.h"
 
@@ -9,7 +11,7 @@ class Sphere : public Hitable
 {
 private:
     Point3 centre1;
-    double radius;
+    Real radius;
     shared_ptr<Material> material;
     bool isMoving;
     Vec3 centreVec;
@@ -22,6 +24,20 @@ private:
         return centre1 + time * centreVec;
     }
 
+    static Vec3 RandomToSphere(double radius, double distanceSquared)
+    {
+        auto r1 = RandomDouble();
+        auto r2 = RandomDouble();
+        auto z = 1 + r2 * (std::sqrt(1 - radius * radius / distanceSquared) - 1);
+
+        auto phi = 2 * PI * r1;
+        auto x = std::cos(phi) * std::sqrt(1 - z * z);
+        auto y = std::sin(phi) * std::sqrt(1 - z * z);
+
+        return Vec3(x, y, z);
+    }
+
+public:
     static void GetSphereUV(const Point3 &p, double &u, double &v)
     {
         // p: a given point on the sphere of radius one, centered at the origin.
@@ -38,20 +54,29 @@ private:
         v = theta / PI;
     }
 
-    static Vec3 RandomToSphere(double radius, double distanceSquared)
+    static void GetSphereDerivatives(const Point3 &p, double radius, Vec3 &dpdu, Vec3 &dpdv)
     {
-        auto r1 = RandomDouble();
-        auto r2 = RandomDouble();
-        auto z = 1 + r2 * (std::sqrt(1 - radius * radius / distanceSquared) - 1);
-
-        auto phi = 2 * PI * r1;
-        auto x = std::cos(phi) * std::sqrt(1 - z * z);
-        auto y = std::sin(phi) * std::sqrt(1 - z * z);
+        // p: a given point on the sphere of radius one, centered at the origin.
+        // dpdu, dpdv: returned derivatives of the point on a sphere of the given radius with
+        // respect to the coordinates GetSphereUV returns. dpdv is undefined at the poles.
+        auto sinTheta = std::sqrt(p.X() * p.X() + p.Z() * p.Z());
+        dpdu = 2 * PI * radius * Vec3(p.Z(), 0, -p.X());
+        dpdv = (sinTheta > 0) ? PI * radius * Vec3(-p.X() * p.Y() / sinTheta, sinTheta, -p.Y() * p.Z() / sinTheta) : Vec3();
+    }
 
-        return Vec3(x, y, z);
+    static Vec3 ProjectToSurface(const Point3 &centre, double radius, HitRecord &record)
+    {
+        // Moves the hit point onto the sphere and returns the outward normal there. The root of
+        // the quadratic is only as accurate as the ray's distance from the centre allows, which
+        // on a large sphere leaves the point well off the surface; projected, it is off by no
+        // more than rounding in the centre and radius, which is bounded in pointError.
+        auto outwardNormal = UnitVector(record.point - centre);
+        record.point = centre + radius * outwardNormal;
+        auto magnitude = fmax(fabs(centre.X()), fmax(fabs(centre.Y()), fabs(centre.Z())));
+        record.pointError = (magnitude + radius + 1) * HitRecord::errorScale;
+        return outwardNormal;
     }
 
-public:
     // Stationary Sphere
     Sphere(Point3 _centre, double _radius, shared_ptr<Material> _material)
         : centre1(_centre), radius(_radius), material(_material), isMoving(false)
@@ -95,22 +120,40 @@ public:
 
         record.t = root;
         record.point = ray.At(record.t);
-        Vec3 outwardNormal = (record.point - centre1) / radius;
+        Vec3 outwardNormal = ProjectToSurface(centre, radius, record);
         record.SetFaceNormal(ray, outwardNormal);
         GetSphereUV(outwardNormal, record.u, record.v);
         record.material = material;
 
+        Vec3 dpdu, dpdv;
+        GetSphereDerivatives(outwardNormal, radius, dpdu, dpdv);
+        record.SetSurfaceDerivatives(dpdu, dpdv, dpdu / radius, dpdv / radius);
+        record.velocity = isMoving ? centreVec : Vec3();
+
         return true;
     }
 
     AABB BoundingBox() const override { return boundingBox; }
 
+    AABB StartBoundingBox() const override
+    {
+        auto radiusVec = Vec3(radius, radius, radius);
+        return AABB(centre1 - radiusVec, centre1 + radiusVec);
+    }
+
+    AABB EndBoundingBox() const override
+    {
+        auto radiusVec = Vec3(radius, radius, radius);
+        auto centre2 = Centre(1);
+        return AABB(centre2 - radiusVec, centre2 + radiusVec);
+    }
+
     double PDFValue(const Point3 &origin, const Vec3 &direction) const override
     {
         // This method only works for stationary spheres.
 
         HitRecord record;
-        if ( !this->Hit(Ray(origin, direction, 0.0), Interval(0.001, maxDouble), record) ) return 0;
+        if ( !this->Hit(Ray(origin, direction, 0.0), Interval(0, maxDouble), record) ) return 0;
 
         auto cosThetaMax = std::sqrt(1 - radius * radius / (centre1 - origin).LengthSquared());
         auto solidAngle = 2 * PI * (1 - cosThetaMax);
@@ -125,6 +168,31 @@ public:
         ONB uvw(direction);
         return uvw.Transform(RandomToSphere(radius, distanceSquared));
     }
+
+    bool Span(const Ray &ray, Interval &span) const override
+    {
+        // Both roots of the intersection quadratic
+        Point3 centre = isMoving ? Centre(ray.Time()) : centre1;
+        Vec3 oc = ray.Origin() - centre;
+        auto a = ray.Direction().LengthSquared();
+        auto halfB = Dot(oc, ray.Direction());
+        auto c = oc.LengthSquared() - radius * radius;
+
+        auto discriminant = halfB * halfB - a * c;
+        if ( discriminant <= 0 ) return false;
+        auto sqrtD = sqrt(discriminant);
+
+        span = Interval((-halfB - sqrtD) / a, (-halfB + sqrtD) / a);
+        return true;
+    }
+
+    void CollectLights(const shared_ptr<Hitable> &self, LightCollection &lights) const override
+    {
+        // PDFValue and Random only know the stationary centre, so moving spheres aren't sampled
+        if ( material && !isMoving ) lights.AddEmitter(self, Luminance(material->AverageEmission()) * 4 * PI * radius * radius);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &materials) const override { materials.push_back(material.get()); }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,243 @@
+#ifndef SPHERE_BATCH_H
+#define SPHERE_BATCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+
+#include "hitable.h"
+#include "hitableList.h"
+#include "sphere.h"
+
+class SphereBatch : public Hitable
+{
+public:
+    static const int maxSpheres = 8; // Lanes tested together; one AVX-512 register of doubles or an AVX2 register of floats
+
+private:
+    // Structure-of-arrays sphere data. Lanes past `count` repeat the first sphere so the kernel can
+    // always run over every lane without masking.
+    alignas(64) Real centreX[maxSpheres];
+    alignas(64) Real centreY[maxSpheres];
+    alignas(64) Real centreZ[maxSpheres];
+    alignas(64) Real radius[maxSpheres];
+    uint32_t materialIndex[maxSpheres];
+    int count;
+
+    // Motion over the shutter interval, only allocated for batches of moving spheres
+    std::vector<Real> centreVecX, centreVecY, centreVecZ;
+
+    shared_ptr<const std::vector<shared_ptr<Material>>> materials; // Palette shared by all batches
+    AABB boundingBox;
+    AABB startBoundingBox;
+    AABB endBoundingBox;
+
+public:
+    struct SphereData
+    {
+        Point3 centre1;
+        Vec3 centreVec;
+        double radius;
+        uint32_t materialIndex;
+    };
+
+    SphereBatch(const SphereData *spheres, int sphereCount, bool moving,
+                shared_ptr<const std::vector<shared_ptr<Material>>> palette)
+        : count(sphereCount), materials(palette)
+    {
+        if ( moving ) {
+            centreVecX.resize(maxSpheres);
+            centreVecY.resize(maxSpheres);
+            centreVecZ.resize(maxSpheres);
+        }
+
+        for ( int i = 0; i < maxSpheres; i++ ) {
+            const auto &sphere = spheres[(i < count) ? i : 0];
+            centreX[i] = sphere.centre1.X();
+            centreY[i] = sphere.centre1.Y();
+            centreZ[i] = sphere.centre1.Z();
+            radius[i] = sphere.radius;
+            materialIndex[i] = sphere.materialIndex;
+
+            if ( moving ) {
+                centreVecX[i] = sphere.centreVec.X();
+                centreVecY[i] = sphere.centreVec.Y();
+                centreVecZ[i] = sphere.centreVec.Z();
+            }
+
+            auto radiusVec = Vec3(sphere.radius, sphere.radius, sphere.radius);
+            auto centre2 = sphere.centre1 + sphere.centreVec;
+            startBoundingBox = AABB(startBoundingBox, AABB(sphere.centre1 - radiusVec, sphere.centre1 + radiusVec));
+            endBoundingBox = AABB(endBoundingBox, AABB(centre2 - radiusVec, centre2 + radiusVec));
+        }
+
+        boundingBox = AABB(startBoundingBox, endBoundingBox);
+    }
+
+    bool Hit(const Ray &ray, Interval rayT, HitRecord &record) const override
+    {
+        const auto origin = ray.Origin();
+        const auto direction = ray.Direction();
+        const auto time = ray.Time();
+        const auto a = direction.LengthSquared();
+        const auto inverseA = 1 / a;
+        const bool isMoving = !centreVecX.empty();
+
+        // Intersect every lane at once. The loop is branch free so it compiles to packed
+        // compares and blends on SSE2/AVX2/AVX-512 targets.
+        alignas(64) Real cx[maxSpheres], cy[maxSpheres], cz[maxSpheres], roots[maxSpheres];
+        for ( int i = 0; i < maxSpheres; i++ ) {
+            cx[i] = centreX[i];
+            cy[i] = centreY[i];
+            cz[i] = centreZ[i];
+        }
+        if ( isMoving ) {
+            for ( int i = 0; i < maxSpheres; i++ ) {
+                cx[i] += time * centreVecX[i];
+                cy[i] += time * centreVecY[i];
+                cz[i] += time * centreVecZ[i];
+            }
+        }
+
+        for ( int i = 0; i < maxSpheres; i++ ) {
+            auto ocX = origin.X() - cx[i];
+            auto ocY = origin.Y() - cy[i];
+            auto ocZ = origin.Z() - cz[i];
+            auto halfB = ocX * direction.X() + ocY * direction.Y() + ocZ * direction.Z();
+            auto c = ocX * ocX + ocY * ocY + ocZ * ocZ - radius[i] * radius[i];
+            auto discriminant = halfB * halfB - a * c;
+            auto sqrtD = std::sqrt(std::max(discriminant, Real(0)));
+
+            // Take the nearest root that lies in the acceptable range
+            auto nearRoot = (-halfB - sqrtD) * inverseA;
+            auto farRoot = (-halfB + sqrtD) * inverseA;
+            auto root = (rayT.min < farRoot && farRoot < rayT.max) ? farRoot : maxDouble;
+            root = (rayT.min < nearRoot && nearRoot < rayT.max) ? nearRoot : root;
+            roots[i] = (discriminant < 0) ? maxDouble : root;
+        }
+
+        int closest = 0;
+        for ( int i = 1; i < maxSpheres; i++ ) {
+            if ( roots[i] < roots[closest] ) closest = i;
+        }
+        if ( roots[closest] == maxDouble ) return false;
+
+        Point3 centre(cx[closest], cy[closest], cz[closest]);
+        record.t = roots[closest];
+        record.point = ray.At(record.t);
+        Vec3 outwardNormal = Sphere::ProjectToSurface(centre, radius[closest], record);
+        record.SetFaceNormal(ray, outwardNormal);
+        Sphere::GetSphereUV(outwardNormal, record.u, record.v);
+        record.material = (*materials)[materialIndex[closest]];
+
+        Vec3 dpdu, dpdv;
+        Sphere::GetSphereDerivatives(outwardNormal, radius[closest], dpdu, dpdv);
+        record.SetSurfaceDerivatives(dpdu, dpdv, dpdu / radius[closest], dpdv / radius[closest]);
+        record.velocity = isMoving ? Vec3(centreVecX[closest], centreVecY[closest], centreVecZ[closest]) : Vec3();
+
+        return true;
+    }
+
+    AABB BoundingBox() const override { return boundingBox; }
+
+    AABB StartBoundingBox() const override { return startBoundingBox; }
+
+    AABB EndBoundingBox() const override { return endBoundingBox; }
+
+    double PDFValue(const Point3 &origin, const Vec3 &direction) const override
+    {
+        return 0.0;
+    }
+
+    Vec3 Random(const Point3 &origin) const override
+    {
+        return Vec3(1, 0, 0);
+    }
+
+    void CollectMaterials(std::vector<const Material *> &collected) const override
+    {
+        for ( int i = 0; i < count; i++ ) collected.push_back((*materials)[materialIndex[i]].get());
+    }
+};
+
+class SphereCollection
+{
+    // Gathers many small spheres and packs them into spatially coherent SphereBatch primitives.
+    // Static and moving spheres go into separate batches so static ones carry no motion data.
+
+private:
+    std::vector<SphereBatch::SphereData> staticSpheres;
+    std::vector<SphereBatch::SphereData> movingSpheres;
+    std::vector<shared_ptr<Material>> materials;
+    std::unordered_map<const Material *, uint32_t> materialIndices;
+
+    uint32_t MaterialIndex(shared_ptr<Material> material)
+    {
+        auto [entry, inserted] = materialIndices.try_emplace(material.get(), uint32_t(materials.size()));
+        if ( inserted ) materials.push_back(material);
+        return entry->second;
+    }
+
+    static void Pack(std::vector<SphereBatch::SphereData> &spheres, size_t start, size_t end, bool moving,
+                     shared_ptr<const std::vector<shared_ptr<Material>>> palette, HitableList &batches)
+    {
+        // Recursively median split along the longest axis until each range fits in one batch
+        size_t span = end - start;
+        if ( span <= size_t(SphereBatch::maxSpheres) ) {
+            batches.Add(make_shared<SphereBatch>(spheres.data() + start, int(span), moving, palette));
+            return;
+        }
+
+        AABB bounds;
+        for ( size_t i = start; i < end; i++ ) {
+            bounds = AABB(bounds, AABB(spheres[i].centre1, spheres[i].centre1));
+        }
+
+        int axis = 0;
+        for ( int a = 1; a < 3; a++ ) {
+            if ( bounds.Axis(a).Size() > bounds.Axis(axis).Size() ) axis = a;
+        }
+
+        // Keep the left half a whole number of batches so batches stay full
+        auto mid = start + std::max<size_t>(SphereBatch::maxSpheres, (span / 2) / SphereBatch::maxSpheres * SphereBatch::maxSpheres);
+        std::nth_element(spheres.begin() + start, spheres.begin() + mid, spheres.begin() + end,
+                         [axis](const SphereBatch::SphereData &a, const SphereBatch::SphereData &b) {
+                             return a.centre1[axis] < b.centre1[axis];
+                         });
+
+        Pack(spheres, start, mid, moving, palette, batches);
+        Pack(spheres, mid, end, moving, palette, batches);
+    }
+
+public:
+    // Stationary Sphere
+    void Add(const Point3 &centre, double radius, shared_ptr<Material> material)
+    {
+        staticSpheres.push_back({centre, Vec3(0, 0, 0), radius, MaterialIndex(material)});
+    }
+
+    // Moving Sphere
+    void Add(const Point3 &centre1, const Point3 &centre2, double radius, shared_ptr<Material> material)
+    {
+        movingSpheres.push_back({centre1, centre2 - centre1, radius, MaterialIndex(material)});
+    }
+
+    HitableList Batches() const
+    {
+        // Returns the packed batches, ready to be added to a scene or built into a BVH
+        auto palette = make_shared<const std::vector<shared_ptr<Material>>>(materials);
+        auto staticCopy = staticSpheres;
+        auto movingCopy = movingSpheres;
+
+        HitableList batches;
+        if ( !staticCopy.empty() ) Pack(staticCopy, 0, staticCopy.size(), false, palette, batches);
+        if ( !movingCopy.empty() ) Pack(movingCopy, 0, movingCopy.size(), true, palette, batches);
+        return batches;
+    }
+};
+
+#endif
@@ -1,9 +1,11 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "colour.h"
 #include "perlin.h"
 #include "rtweekend.h"
 #include "stbImplementation.h"
+#include "textureCache.h"
 
 class Texture
 {
@@ -11,6 +13,13 @@ public:
     virtual ~Texture() = default;
 
     virtual Colour Value(double u, double v, const Point3 &p) const = 0;
+
+    // Value averaged over a footprint uvWidth wide in surface coordinates and pointWidth wide in
+    // world space, both zero when unknown. Textures that can filter or drop detail override this.
+    virtual Colour FilteredValue(double u, double v, const Point3 &p, double uvWidth, double pointWidth) const
+    {
+        return Value(u, v, p);
+    }
 };
 
 class SolidColour : public Texture
@@ -61,26 +70,29 @@ public:
 class ImageTexture : public Texture
 {
 private:
-    RTWImage image;
+    shared_ptr<TiledImage> image; // Shared through the texture cache, null if loading failed
 
 public:
-    ImageTexture(const char *filename) : image(filename) {}
+    ImageTexture(const char *filename) : image(TextureCache::Global().Open(filename)) {}
 
-    Colour Value(double u, double v, const Point3 &p) const override
+    Colour Value(double u, double v, const Point3 &p) const override { return Lookup(u, v, 0); }
+
+    Colour FilteredValue(double u, double v, const Point3 &p, double uvWidth, double pointWidth) const override
+    {
+        return Lookup(u, v, uvWidth);
+    }
+
+private:
+    Colour Lookup(double u, double v, double uvWidth) const
     {
         // If we haave no texture data, then reutrn soild cyan as a debugging aid.
-        if ( image.Height() <= 0 ) return Colour(0, 1, 1);
+        if ( !image || image->Height() <= 0 ) return Colour(0, 1, 1);
 
         // Clamp input texture coordinates to [0,1] x [0,1]
         u = Interval(0, 1).Clamp(u);
         v = 1.0 - Interval(0, 1).Clamp(v); // Flip V to image coordinates
 
-        auto i = static_cast<int>(u * image.Width());
-        auto j = static_cast<int>(v * image.Height());
-        auto pixel = image.pixelData(i, j);
-
-        auto colourScale = 1.0 / 255.0;
-        return Colour(colourScale * pixel[0], colourScale * pixel[1], colourScale * pixel[2]);
+        return image->Lookup(u, v, uvWidth);
     }
 };
 
@@ -100,6 +112,18 @@ public:
         auto s = scale * p;
         return Colour(1, 1, 1) * 0.5 * (1 + sin(s.Z() + 10 * noise.Turbulence(s)));
     }
+
+    Colour FilteredValue(double u, double v, const Point3 &p, double uvWidth, double pointWidth) const override
+    {
+        // Octave i of the turbulence varies over 1/2^i noise cells. Octaves finer than the
+        // footprint would only alias, so leave them out.
+        int depth = 7;
+        auto footprint = scale * pointWidth;
+        if ( footprint > 0 ) depth = std::clamp(int(std::floor(-std::log2(footprint))) + 1, 1, 7);
+
+        auto s = scale * p;
+        return Colour(1, 1, 1) * 0.5 * (1 + sin(s.Z() + 10 * noise.Turbulence(s, depth)));
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,365 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <cerrno>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "rtweekend.h"
+
+#include "colour.h"
+#include "stbImplementation.h"
+
+class TiledImage
+{
+    // An image converted to a mip pyramid of fixed-size RGB tiles, stored in a temporary tile file.
+    // Texels are read a tile at a time through the TextureCache, so only recently used tiles of
+    // any level are held in memory. Create through TextureCache::Open.
+
+public:
+    static const int tileSize = 64; // Texels along each side of a tile
+    static const int tileBytes = tileSize * tileSize * 3;
+
+    struct Tile
+    {
+        uint8_t texels[tileBytes];
+    };
+
+private:
+    struct Level
+    {
+        int width, height;
+        int tilesX, tilesY;
+        long long firstTile; // Index of the level's first tile in the tile file
+    };
+
+    uint32_t id;
+    std::vector<Level> levels;
+    std::filesystem::path tilePath;
+    std::FILE *tileFile = nullptr;
+    mutable std::mutex fileMutex; // Guards the file position where tiles are read by seeking
+
+    friend class TextureCache;
+
+    static std::vector<uint8_t> Downsample(const std::vector<uint8_t> &source, int width, int height, int &newWidth, int &newHeight)
+    {
+        // Halves each dimension with a 2x2 box filter, clamping at odd edges
+        newWidth = std::max(1, width / 2);
+        newHeight = std::max(1, height / 2);
+        std::vector<uint8_t> result(size_t(newWidth) * newHeight * 3);
+
+        for ( int y = 0; y < newHeight; y++ ) {
+            int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for ( int x = 0; x < newWidth; x++ ) {
+                int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                for ( int c = 0; c < 3; c++ ) {
+                    int sum = source[(size_t(y0) * width + x0) * 3 + c] + source[(size_t(y0) * width + x1) * 3 + c] +
+                              source[(size_t(y1) * width + x0) * 3 + c] + source[(size_t(y1) * width + x1) * 3 + c];
+                    result[(size_t(y) * newWidth + x) * 3 + c] = uint8_t((sum + 2) / 4);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    bool Convert(const char *imageFilename)
+    {
+        // Decodes the image once, writes every level of the pyramid out as tiles, then drops the
+        // decoded pixels. Returns false if the image couldn't be loaded or the tile file written.
+        RTWImage image(imageFilename);
+        if ( image.Height() <= 0 ) return false;
+
+        tileFile = std::fopen(tilePath.string().c_str(), "w+b");
+        if ( !tileFile ) return false;
+
+        int width = image.Width();
+        int height = image.Height();
+        std::vector<uint8_t> pixels(size_t(width) * height * 3);
+        for ( int y = 0; y < height; y++ ) {
+            std::copy_n(image.pixelData(0, y), size_t(width) * 3, &pixels[size_t(y) * width * 3]);
+        }
+
+        long long tileCount = 0;
+        Tile tile;
+        while ( true ) {
+            Level level = {width, height, (width + tileSize - 1) / tileSize, (height + tileSize - 1) / tileSize, tileCount};
+            levels.push_back(level);
+
+            for ( int ty = 0; ty < level.tilesY; ty++ ) {
+                for ( int tx = 0; tx < level.tilesX; tx++ ) {
+                    // Tiles past the image edge repeat the edge texels
+                    for ( int y = 0; y < tileSize; y++ ) {
+                        int sy = std::min(ty * tileSize + y, height - 1);
+                        for ( int x = 0; x < tileSize; x++ ) {
+                            int sx = std::min(tx * tileSize + x, width - 1);
+                            std::copy_n(&pixels[(size_t(sy) * width + sx) * 3], 3, &tile.texels[(y * tileSize + x) * 3]);
+                        }
+                    }
+                    if ( std::fwrite(tile.texels, tileBytes, 1, tileFile) != 1 ) return false;
+                }
+            }
+            tileCount += (long long)level.tilesX * level.tilesY;
+
+            if ( width == 1 && height == 1 ) break;
+            pixels = Downsample(pixels, width, height, width, height);
+        }
+
+        return std::fflush(tileFile) == 0;
+    }
+
+    bool ReadAt(long long offset, uint8_t *data) const
+    {
+        // Reads one tile's bytes from offset. Positional reads leave the file offset alone, which
+        // forked tile workers share through the descriptor they inherit, so no lock can guard it.
+        // Windows has no fork, and seeks under the mutex; fseek's long is 32 bits there, and tile
+        // files can pass 2 GiB.
+#ifdef _WIN32
+        std::lock_guard<std::mutex> lock(fileMutex);
+        return _fseeki64(tileFile, offset, SEEK_SET) == 0 && std::fread(data, tileBytes, 1, tileFile) == 1;
+#else
+        size_t done = 0;
+        while ( done < size_t(tileBytes) ) {
+            auto bytesRead = pread(fileno(tileFile), data + done, tileBytes - done, off_t(offset + done));
+            if ( bytesRead < 0 && errno == EINTR ) continue;
+            if ( bytesRead <= 0 ) return false;
+            done += size_t(bytesRead);
+        }
+        return true;
+#endif
+    }
+
+    std::shared_ptr<const Tile> ReadTile(int level, int tx, int ty) const
+    {
+        auto tile = std::make_shared<Tile>();
+        long long index = levels[level].firstTile + (long long)ty * levels[level].tilesX + tx;
+
+        if ( !ReadAt(index * tileBytes, tile->texels) ) std::fill_n(tile->texels, tileBytes, uint8_t(0));
+        return tile;
+    }
+
+    std::shared_ptr<const Tile> FetchTile(int level, int tx, int ty) const;
+
+    static Colour TexelInTile(const Tile &tile, int x, int y)
+    {
+        auto texel = &tile.texels[((y % tileSize) * tileSize + (x % tileSize)) * 3];
+        auto colourScale = 1.0 / 255.0;
+        return Colour(colourScale * texel[0], colourScale * texel[1], colourScale * texel[2]);
+    }
+
+    Colour Texel(int level, int x, int y) const
+    {
+        const auto &l = levels[level];
+        x = std::clamp(x, 0, l.width - 1);
+        y = std::clamp(y, 0, l.height - 1);
+        return TexelInTile(*FetchTile(level, x / tileSize, y / tileSize), x, y);
+    }
+
+    Colour Bilinear(int level, double u, double v) const
+    {
+        // Bilinear interpolation between texel centres, clamped at the edges
+        const auto &l = levels[level];
+        double x = u * l.width - 0.5;
+        double y = v * l.height - 0.5;
+        int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        double fx = x - x0, fy = y - y0;
+
+        int x1 = std::min(x0 + 1, l.width - 1), y1 = std::min(y0 + 1, l.height - 1);
+        x0 = std::max(x0, 0), y0 = std::max(y0, 0);
+
+        Colour c00, c10, c01, c11;
+        if ( x0 / tileSize == x1 / tileSize && y0 / tileSize == y1 / tileSize ) {
+            // All four texels share a tile, the common case, so fetch it once
+            auto tile = FetchTile(level, x0 / tileSize, y0 / tileSize);
+            c00 = TexelInTile(*tile, x0, y0), c10 = TexelInTile(*tile, x1, y0);
+            c01 = TexelInTile(*tile, x0, y1), c11 = TexelInTile(*tile, x1, y1);
+        } else {
+            c00 = Texel(level, x0, y0), c10 = Texel(level, x1, y0);
+            c01 = Texel(level, x0, y1), c11 = Texel(level, x1, y1);
+        }
+
+        return (1 - fy) * ((1 - fx) * c00 + fx * c10) + fy * ((1 - fx) * c01 + fx * c11);
+    }
+
+public:
+    TiledImage(uint32_t id, const std::filesystem::path &path) : id(id), tilePath(path) {}
+
+    ~TiledImage()
+    {
+        if ( tileFile ) std::fclose(tileFile);
+        std::error_code error;
+        std::filesystem::remove(tilePath, error);
+    }
+
+    int Width() const { return levels.empty() ? 0 : levels[0].width; }
+
+    int Height() const { return levels.empty() ? 0 : levels[0].height; }
+
+    int LevelCount() const { return int(levels.size()); }
+
+    Colour Lookup(double u, double v, double footprint) const
+    {
+        // Trilinear lookup at image coordinates u, v in [0,1] (v downwards). footprint is the
+        // width of the filter region in the same units; zero samples the full resolution level.
+        auto texels = footprint * std::max(Width(), Height());
+        auto lod = (texels > 1) ? std::log2(texels) : 0.0;
+        auto maxLevel = LevelCount() - 1;
+        if ( lod >= maxLevel ) return Bilinear(maxLevel, u, v);
+
+        int level = int(lod);
+        double blend = lod - level;
+        auto colour = Bilinear(level, u, v);
+        if ( blend > 0 ) colour = (1 - blend) * colour + blend * Bilinear(level + 1, u, v);
+        return colour;
+    }
+};
+
+class TextureCache
+{
+    // Process-wide cache of image texture tiles under a fixed memory budget. Images are shared
+    // by filename, so every ImageTexture("mars.jpg") reads the same pyramid. The tile table is
+    // split into independently locked shards, each evicting its least recently used tiles once
+    // it exceeds its share of the budget, so concurrent lookups rarely contend.
+
+private:
+    static const int shardCount = 64;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::list<uint64_t> recentlyUsed; // Front is most recent
+        std::unordered_map<uint64_t, std::pair<std::shared_ptr<const TiledImage::Tile>, std::list<uint64_t>::iterator>> tiles;
+        size_t bytes = 0;
+    };
+
+    Shard shards[shardCount];
+    std::atomic<size_t> shardBudget;
+    std::atomic<size_t> tileReads{0};
+
+    std::mutex imagesMutex;
+    std::unordered_map<std::string, std::weak_ptr<TiledImage>> images;
+    uint32_t nextId = 0;
+
+    TextureCache() : shardBudget((size_t(256) << 20) / shardCount) {}
+
+    static uint64_t Key(uint32_t id, int level, int tx, int ty)
+    {
+        return (uint64_t(id) << 40) | (uint64_t(level) << 34) | (uint64_t(ty) << 17) | uint64_t(tx);
+    }
+
+    static long ProcessID()
+    {
+#ifdef _WIN32
+        return long(_getpid());
+#else
+        return long(getpid());
+#endif
+    }
+
+public:
+    static TextureCache &Global()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void SetBudget(size_t bytes)
+    {
+        // Sets the memory budget for cached tiles. Shards shrink as they next load a tile.
+        shardBudget = std::max<size_t>(bytes / shardCount, TiledImage::tileBytes);
+    }
+
+    size_t Budget() const { return shardBudget * shardCount; }
+
+    size_t ResidentBytes()
+    {
+        size_t total = 0;
+        for ( auto &shard : shards ) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.bytes;
+        }
+        return total;
+    }
+
+    size_t TileReads() const { return tileReads; }
+
+    std::shared_ptr<TiledImage> Open(const char *filename)
+    {
+        // Returns the tiled pyramid for the image, converting it on first use. Returns null if
+        // the image can't be loaded.
+        std::lock_guard<std::mutex> lock(imagesMutex);
+
+        auto &entry = images[filename];
+        if ( auto image = entry.lock() ) return image;
+
+        // Named for this process too, so other renders converting the same image at the same time
+        // neither overwrite its tile file nor delete it when they finish
+        auto id = nextId++;
+        auto tilePath = std::filesystem::temp_directory_path() /
+                        ("rtw_tiles_" + std::to_string(ProcessID()) + "_" + std::to_string(std::hash<std::string>()(filename)) + "_" + std::to_string(id) + ".bin");
+        auto image = std::make_shared<TiledImage>(id, tilePath);
+        if ( !image->Convert(filename) ) return nullptr;
+
+        entry = image;
+        return image;
+    }
+
+    std::shared_ptr<const TiledImage::Tile> Fetch(const TiledImage &image, int level, int tx, int ty)
+    {
+        auto key = Key(image.id, level, tx, ty);
+        auto &shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 58];
+
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto found = shard.tiles.find(key);
+            if ( found != shard.tiles.end() ) {
+                shard.recentlyUsed.splice(shard.recentlyUsed.begin(), shard.recentlyUsed, found->second.second);
+                return found->second.first;
+            }
+        }
+
+        // Read outside the shard lock so other lookups in the shard can proceed
+        auto tile = image.ReadTile(level, tx, ty);
+        tileReads++;
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto [found, inserted] = shard.tiles.try_emplace(key, tile, shard.recentlyUsed.end());
+        if ( !inserted ) return found->second.first; // Another thread loaded it first
+
+        shard.recentlyUsed.push_front(key);
+        found->second.second = shard.recentlyUsed.begin();
+        shard.bytes += TiledImage::tileBytes;
+
+        while ( shard.bytes > shardBudget && shard.recentlyUsed.size() > 1 ) {
+            shard.tiles.erase(shard.recentlyUsed.back());
+            shard.recentlyUsed.pop_back();
+            shard.bytes -= TiledImage::tileBytes;
+        }
+
+        return tile;
+    }
+};
+
+inline std::shared_ptr<const TiledImage::Tile> TiledImage::FetchTile(int level, int tx, int ty) const
+{
+    return TextureCache::Global().Fetch(*this, level, tx, ty);
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef TONE_MAPPER_H
+#define TONE_MAPPER_H
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <execution>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "frameBuffer.h"
+#include "stbImplementation.h"
+
+class ToneMapper
+{
+    // Turns a linear float pass into 8-bit display values, once over the whole frame: exposure,
+    // then a tone curve into [0, 1], then a transfer function and quantisation. A frame can be
+    // encoded any number of times with different settings, and written alongside the float
+    // formats, without rendering it again.
+    //
+    // Quantisation goes through a table rather than evaluating the transfer function. Values
+    // are bucketed by their exponent and top mantissa bits, fine enough that no bucket spans
+    // more than one step between output codes, so each bucket stores its code and the value at
+    // which the next code starts. That's exact, and the loop over it is branch free.
+
+public:
+    enum class Operator
+    {
+        Clamp,    // Values above 1 are clipped
+        Reinhard, // L / (1 + L) on luminance, keeping hue
+        ACES      // Narkowicz's fit of the ACES filmic curve, per channel
+    };
+
+    enum class Encoding
+    {
+        Gamma2, // Square root, as the renderer has always written
+        sRGB    // The sRGB piecewise curve
+    };
+
+    struct Settings
+    {
+        Operator toneMap = Operator::Clamp;   // Curve bringing scene values into [0, 1]
+        double exposure = 0.0;                // Stops of gain applied before the curve
+        Encoding encoding = Encoding::Gamma2; // Transfer function from linear values to code values
+    };
+
+    struct PNGSettings
+    {
+        int compressionLevel = 8;   // Effort spent searching for matches; stb treats anything below 5 as 5
+        bool adaptiveFilter = true; // Try every row filter and keep the best, or use Sub throughout: several times faster, but larger on noisy frames
+    };
+
+    Settings settings;
+
+    ToneMapper() { BuildTable(); }
+
+    ToneMapper(const Settings &_settings) : settings(_settings) { BuildTable(); }
+
+    void Encode(const FrameBuffer::Pass &pass, uint8_t *image) const
+    {
+        // Writes the pass as width * height RGB triples. Passes with fewer than three channels
+        // are shown as grey from their first channel.
+        std::vector<int> rows(pass.height);
+        std::iota(rows.begin(), rows.end(), 0);
+        std::for_each(std::execution::par, rows.begin(), rows.end(), [this, &pass, image](int y) {
+            std::vector<float> mapped(size_t(pass.width) * 3);
+            ToneMapRow(pass, y, mapped.data());
+            QuantiseRow(mapped.data(), mapped.size(), image + size_t(y) * pass.width * 3);
+        });
+    }
+
+    std::vector<uint8_t> Encode(const FrameBuffer::Pass &pass) const
+    {
+        std::vector<uint8_t> image(size_t(pass.width) * pass.height * 3);
+        Encode(pass, image.data());
+        return image;
+    }
+
+    bool WritePNG(const FrameBuffer::Pass &pass, const std::string &filename) const
+    {
+        return WritePNG(pass, filename, PNGSettings());
+    }
+
+    bool WritePNG(const FrameBuffer::Pass &pass, const std::string &filename, const PNGSettings &png) const
+    {
+        auto image = Encode(pass);
+
+        // stb takes its PNG options from globals, so hold them for the length of the write
+        static std::mutex stbSettingsMutex;
+        std::lock_guard<std::mutex> lock(stbSettingsMutex);
+        stbi_write_png_compression_level = png.compressionLevel;
+        stbi_write_force_png_filter = png.adaptiveFilter ? -1 : 1;
+        return stbi_write_png(filename.c_str(), pass.width, pass.height, 3, image.data(), pass.width * 3) != 0;
+    }
+
+    bool WriteJPG(const FrameBuffer::Pass &pass, const std::string &filename, int quality = 90) const
+    {
+        auto image = Encode(pass);
+        return stbi_write_jpg(filename.c_str(), pass.width, pass.height, 3, image.data(), quality) != 0;
+    }
+
+    int Quantise(double linear) const
+    {
+        // Reference mapping from a tone mapped value to its code, which the table reproduces
+        if ( !(linear > 0.0) ) return 0;
+        double encoded = (settings.encoding == Encoding::sRGB)
+                             ? ((linear <= 0.0031308) ? 12.92 * linear : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055)
+                             : std::sqrt(linear);
+        return static_cast<int>(256 * std::clamp(encoded, 0.0, 0.999));
+    }
+
+private:
+    static constexpr int bucketBits = 8;        // Mantissa bits that pick a bucket within each power of two
+    static constexpr int lowestExponent = -18;  // Values below 2^-18 encode to 0 under either curve
+    static constexpr int highestExponent = 1;   // Values from 1 up encode to 255
+    static constexpr int bucketShift = 23 - bucketBits;
+    static constexpr int bucketCount = (highestExponent - lowestExponent) << bucketBits;
+
+    std::vector<uint8_t> codes;    // Code at the bottom of each bucket
+    std::vector<float> thresholds; // Where the next code starts within the bucket, or NaN if it doesn't
+
+    static int32_t FirstBits() { return std::bit_cast<int32_t>(std::ldexp(1.0f, lowestExponent)); }
+
+    void BuildTable()
+    {
+        codes.resize(bucketCount);
+        thresholds.resize(bucketCount);
+        for ( int bucket = 0; bucket < bucketCount; bucket++ ) {
+            int32_t first = FirstBits() + (bucket << bucketShift);
+            int32_t last = first + (1 << bucketShift) - 1;
+            int code = Quantise(std::bit_cast<float>(first));
+            codes[bucket] = uint8_t(code);
+            thresholds[bucket] = std::numeric_limits<float>::quiet_NaN();
+            if ( Quantise(std::bit_cast<float>(last)) == code ) continue;
+
+            // Smallest value in the bucket with the next code
+            while ( first < last ) {
+                int32_t middle = first + (last - first) / 2;
+                if ( Quantise(std::bit_cast<float>(middle)) > code ) {
+                    last = middle;
+                } else {
+                    first = middle + 1;
+                }
+            }
+            thresholds[bucket] = std::bit_cast<float>(last);
+        }
+    }
+
+    void ToneMapRow(const FrameBuffer::Pass &pass, int y, float *mapped) const
+    {
+        auto gain = float(std::exp2(settings.exposure));
+        auto channels = pass.Channels();
+        auto row = pass.Row(y);
+
+        for ( int x = 0; x < pass.width; x++ ) {
+            const float *pixel = row + size_t(x) * channels;
+            float r = gain * pixel[0];
+            float g = gain * ((channels >= 3) ? pixel[1] : pixel[0]);
+            float b = gain * ((channels >= 3) ? pixel[2] : pixel[0]);
+
+            switch ( settings.toneMap ) {
+                case Operator::Clamp:
+                    // Clipping happens in quantisation
+                    break;
+                case Operator::Reinhard: {
+                    float scale = 1.0f / (1.0f + std::fabs(0.2126f * r + 0.7152f * g + 0.0722f * b));
+                    r *= scale, g *= scale, b *= scale;
+                    break;
+                }
+                case Operator::ACES:
+                    r = ACES(r), g = ACES(g), b = ACES(b);
+                    break;
+            }
+
+            mapped[3 * x] = r;
+            mapped[3 * x + 1] = g;
+            mapped[3 * x + 2] = b;
+        }
+    }
+
+    static float ACES(float x)
+    {
+        // Narkowicz 2015, with his 0.6 prescale so an exposure of 0 matches the reference curve
+        x *= 0.6f;
+        return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+    }
+
+    void QuantiseRow(const float *mapped, size_t count, uint8_t *out) const
+    {
+        // Negative values and NaN fall into the first bucket and come out 0. Values of 2 and
+        // more, and infinity, fall into the last and come out 255.
+        const int32_t firstBits = FirstBits();
+        const uint8_t *codeTable = codes.data();
+        const float *thresholdTable = thresholds.data();
+        for ( size_t i = 0; i < count; i++ ) {
+            float value = mapped[i];
+            int32_t bits = std::bit_cast<int32_t>(value);
+            bits = (bits > 0x7f800000) ? 0 : std::max(bits, 0);
+            int32_t bucket = std::clamp((bits - firstBits) >> bucketShift, 0, bucketCount - 1);
+            out[i] = uint8_t(codeTable[bucket] + (value >= thresholdTable[bucket]));
+        }
+    }
+};
+
+#endif
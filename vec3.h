@@ -4,57 +4,70 @@
 #include <cmath>
 #include <iostream>
 
+#if defined(RTW_SIMD) && defined(RTW_SINGLE_PRECISION) && (defined(__SSE__) || defined(_M_X64))
+#include <xmmintrin.h>
+#define RTW_SSE_RSQRT
+#endif
+
 using std::sqrt;
 
 class Vec3
 {
-private:
 public:
-    double e[3];
+#ifdef RTW_SIMD
+    // Padded to four lanes and aligned so whole vectors load into one SIMD register. Element-wise
+    // operators loop over every lane and compile to packed instructions; e[3] stays zero.
+    static constexpr int lanes = 4;
+    alignas(lanes * sizeof(Real)) Real e[lanes];
+#else
+    static constexpr int lanes = 3;
+    Real e[lanes];
+#endif
 
     Vec3() : e{0, 0, 0} {}
 
-    Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    Vec3(Real e0, Real e1, Real e2) : e{e0, e1, e2} {}
 
-    double X() const { return e[0]; }
+    Real X() const { return e[0]; }
 
-    double Y() const { return e[1]; }
+    Real Y() const { return e[1]; }
 
-    double Z() const { return e[2]; }
+    Real Z() const { return e[2]; }
 
-    Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
+    Vec3 operator-() const
+    {
+        Vec3 result;
+        for ( int i = 0; i < lanes; i++ ) result.e[i] = -e[i];
+        return result;
+    }
 
-    double operator[](int i) const { return e[i]; }
+    Real operator[](int i) const { return e[i]; }
 
-    double &operator[](int i) { return e[i]; }
+    Real &operator[](int i) { return e[i]; }
 
     Vec3 &operator+=(const Vec3 &v)
     {
-        e[0] += v.e[0];
-        e[1] += v.e[1];
-        e[2] += v.e[2];
+        for ( int i = 0; i < lanes; i++ ) e[i] += v.e[i];
         return *this;
     }
 
-    Vec3 &operator*=(double t)
+    Vec3 &operator*=(Real t)
     {
-        e[0] *= t;
-        e[1] *= t;
-        e[2] *= t;
+        for ( int i = 0; i < lanes; i++ ) e[i] *= t;
         return *this;
     }
 
-    Vec3 &operator/=(double t)
+    Vec3 &operator/=(Real t)
     {
         return *this *= 1 / t;
     }
 
-    double Length() const
+    Real Length() const
     {
         return sqrt(LengthSquared());
     }
 
-    double LengthSquared() const
+    Real LengthSquared() const
     {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
@@ -88,49 +101,80 @@ inline std::ostream &operator<<(std::ostream &out, const Vec3 &v)
 
 inline Vec3 operator+(const Vec3 &u, const Vec3 &v)
 {
-    return Vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    Vec3 result;
+    for ( int i = 0; i < Vec3::lanes; i++ ) result.e[i] = u.e[i] + v.e[i];
+    return result;
 }
 
 inline Vec3 operator-(const Vec3 &u, const Vec3 &v)
 {
-    return Vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    Vec3 result;
+    for ( int i = 0; i < Vec3::lanes; i++ ) result.e[i] = u.e[i] - v.e[i];
+    return result;
 }
 
 inline Vec3 operator*(const Vec3 &u, const Vec3 &v)
 {
-    return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    Vec3 result;
+    for ( int i = 0; i < Vec3::lanes; i++ ) result.e[i] = u.e[i] * v.e[i];
+    return result;
 }
 
-inline Vec3 operator*(double t, const Vec3 &v)
+inline Vec3 operator*(Real t, const Vec3 &v)
 {
-    return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+    Vec3 result;
+    for ( int i = 0; i < Vec3::lanes; i++ ) result.e[i] = t * v.e[i];
+    return result;
 }
 
-inline Vec3 operator*(const Vec3 &v, double t)
+inline Vec3 operator*(const Vec3 &v, Real t)
 {
     return t * v;
 }
 
-inline Vec3 operator/(Vec3 v, double t)
+inline Vec3 operator/(Vec3 v, Real t)
 {
     return (1 / t) * v;
 }
 
-inline double Dot(const Vec3 &u, const Vec3 &v)
+inline Real Dot(const Vec3 &u, const Vec3 &v)
 {
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
 inline Vec3 Cross(const Vec3 &u, const Vec3 &v)
 {
+#ifdef RTW_SIMD
+    // u.yzx * v.zxy - u.zxy * v.yzx, written as lane permutations so it compiles to shuffles
+    static constexpr int next[4] = {1, 2, 0, 3};
+    static constexpr int prev[4] = {2, 0, 1, 3};
+    Vec3 result;
+    for ( int i = 0; i < Vec3::lanes; i++ ) {
+        result.e[i] = u.e[next[i]] * v.e[prev[i]] - u.e[prev[i]] * v.e[next[i]];
+    }
+    return result;
+#else
     return Vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+#endif
+}
+
+inline Real InverseSqrt(Real x)
+{
+#ifdef RTW_SSE_RSQRT
+    // Hardware reciprocal square root estimate refined with one Newton-Raphson step
+    float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return estimate * (1.5f - 0.5f * x * estimate * estimate);
+#else
+    return 1 / sqrt(x);
+#endif
 }
 
 inline Vec3 UnitVector(Vec3 v)
 {
-    return v / v.Length();
+    // Normalise with one reciprocal square root and a packed multiply
+    return InverseSqrt(v.LengthSquared()) * v;
 }
 
 inline Vec3 RandomInUnitDisk()
@@ -186,7 +230,7 @@ inline Vec3 Reflect(const Vec3 &v, const Vec3 &n)
     return v - 2 * Dot(v, n) * n;
 }
 
-inline Vec3 Refract(const Vec3 &uv, const Vec3 &n, double etaIOverEtaT)
+inline Vec3 Refract(const Vec3 &uv, const Vec3 &n, Real etaIOverEtaT)
 {
     auto cosTheta = fmin(Dot(-uv, n), 1.0);
     Vec3 rOutPerp = etaIOverEtaT * (uv + cosTheta * n);